@@ -38,15 +38,7179 @@
 #include "ns3/network-module.h"
 #include "ns3/internet-module.h"
 #include "ns3/point-to-point-module.h"
+#include "ns3/traffic-control-module.h"
 #include "ns3/applications-module.h"
 #include "ns3/wifi-module.h"
 #include "ns3/mobility-module.h"
 #include "ns3/netanim-module.h"
 #include "ns3/flow-monitor-module.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
 using namespace ns3;
 
-NS_LOG_COMPONENT_DEFINE("SolarEnergyWAN");
+NS_LOG_COMPONENT_DEFINE("SolarEnergyWAN");
+
+// ============================================================================
+// SAMPLE STATISTICS
+// ============================================================================
+//
+// Collects raw samples (latencies, completion times, ...) and reports their
+// mean and nearest-rank percentiles. Samples are sorted lazily on the first
+// percentile query after an insertion.
+
+class SampleStats
+{
+public:
+    SampleStats();
+
+    void Add(double value);
+    // Adds every sample of another collection
+    void Merge(const SampleStats& other);
+    uint32_t GetCount(void) const;
+    double GetMean(void) const;
+    double GetPercentile(double percent) const;
+    double GetMax(void) const;
+
+    // Print "count / mean / p50 / p95 / p99 / max" on one line
+    void Print(std::ostream& os, const std::string& unit) const;
+
+private:
+    mutable std::vector<double> m_samples;
+    mutable bool m_sorted;
+    double m_sum;
+};
+
+SampleStats::SampleStats()
+    : m_sorted(true),
+      m_sum(0.0)
+{
+}
+
+void
+SampleStats::Add(double value)
+{
+    m_samples.push_back(value);
+    m_sum += value;
+    m_sorted = false;
+}
+
+void
+SampleStats::Merge(const SampleStats& other)
+{
+    m_samples.insert(m_samples.end(), other.m_samples.begin(), other.m_samples.end());
+    m_sum += other.m_sum;
+    m_sorted = other.m_samples.empty() && m_sorted;
+}
+
+uint32_t
+SampleStats::GetCount(void) const
+{
+    return m_samples.size();
+}
+
+double
+SampleStats::GetMean(void) const
+{
+    return m_samples.empty() ? 0.0 : m_sum / m_samples.size();
+}
+
+double
+SampleStats::GetPercentile(double percent) const
+{
+    if (m_samples.empty())
+    {
+        return 0.0;
+    }
+    if (!m_sorted)
+    {
+        std::sort(m_samples.begin(), m_samples.end());
+        m_sorted = true;
+    }
+    uint32_t rank = static_cast<uint32_t>(std::ceil(percent / 100.0 * m_samples.size()));
+    return m_samples[rank > 0 ? rank - 1 : 0];
+}
+
+double
+SampleStats::GetMax(void) const
+{
+    return GetPercentile(100.0);
+}
+
+void
+SampleStats::Print(std::ostream& os, const std::string& unit) const
+{
+    os << "n=" << GetCount()
+       << " mean=" << GetMean() << unit
+       << " p50=" << GetPercentile(50.0) << unit
+       << " p95=" << GetPercentile(95.0) << unit
+       << " p99=" << GetPercentile(99.0) << unit
+       << " max=" << GetMax() << unit;
+}
+
+// ============================================================================
+// SITE APPLICATIONS
+// ============================================================================
+//
+// Base of every application that runs on a site's own power. SetSitePower
+// switches all of them on a node at once. While the site is dark they keep
+// their schedules but neither send, answer nor count anything, so an outage
+// shows up as work that was never done rather than as network loss.
+
+class SiteApplication : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    SiteApplication();
+    virtual ~SiteApplication();
+
+    void SetPowered(bool powered);
+    bool IsPowered(void) const;
+
+private:
+    bool m_powered;
+};
+
+TypeId
+SiteApplication::GetTypeId(void)
+{
+    static TypeId tid = TypeId("SiteApplication")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN");
+    return tid;
+}
+
+SiteApplication::SiteApplication()
+    : m_powered(true)
+{
+}
+
+SiteApplication::~SiteApplication()
+{
+}
+
+void
+SiteApplication::SetPowered(bool powered)
+{
+    m_powered = powered;
+}
+
+bool
+SiteApplication::IsPowered(void) const
+{
+    return m_powered;
+}
+
+// ============================================================================
+// SITE TELEMETRY CLIENT
+// ============================================================================
+//
+// UDP sender used by every school, clinic and micro-grid to report energy
+// readings to the central station. Each reading carries a SeqTsHeader so the
+// echo coming back from the central server gives a round-trip time. The gap
+// between readings is the nominal interval perturbed by a uniform per-send
+// jitter, which keeps sites started close together from staying phase-locked.
+//
+// With store-and-forward enabled, readings taken while the site uplink is
+// down are kept in a bounded on-site buffer (oldest reading dropped when
+// full) and replayed at a limited rate once the uplink is back. New readings
+// queue behind the backlog so the central station sees them in order.
+//
+// SetTos marks every reading with an IP TOS byte (DSCP in the upper six
+// bits) so the routers can tell the site classes apart.
+//
+// While the site has no power the reading schedule keeps running but
+// nothing is measured; those readings are counted as missed.
+// A store-and-forward backlog survives the outage and is replayed after it.
+
+class TelemetryClient : public SiteApplication
+{
+public:
+    // One echoed reading: transmission time (s) and round-trip time (ms)
+    struct RttSample
+    {
+        double sent;
+        double rtt;
+    };
+
+    static TypeId GetTypeId(void);
+
+    TelemetryClient();
+    virtual ~TelemetryClient();
+
+    void Setup(Address peer, uint32_t packetSize, uint32_t maxPackets,
+               Time interval, double jitter);
+    void EnableStoreAndForward(Ptr<NetDevice> uplink, uint32_t capacity, double drainRate);
+    void SetTos(uint8_t tos);
+
+    uint32_t GetSent(void) const;
+    uint32_t GetMissed(void) const;
+    uint32_t GetReceived(void) const;
+    const std::vector<RttSample>& GetRttSamples(void) const;
+
+    uint32_t GetBuffered(void) const;
+    uint32_t GetMaxBacklog(void) const;
+    uint32_t GetBufferDrops(void) const;
+    const SampleStats& GetBufferDelay(void) const;
+    const std::vector<std::pair<Time, Time> >& GetDrainWindows(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void ScheduleNextReading(void);
+    void TakeReading(void);
+    void Transmit(uint32_t seq);
+    bool UplinkUp(void) const;
+    void DrainOne(void);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    Address m_peer;
+    uint32_t m_packetSize;
+    uint32_t m_maxPackets;
+    Time m_interval;
+    double m_jitter;
+    uint8_t m_tos;
+    Ptr<UniformRandomVariable> m_jitterRng;
+    EventId m_sendEvent;
+    uint32_t m_taken;
+    uint32_t m_sent;
+    uint32_t m_received;
+    uint32_t m_missed;
+    std::vector<RttSample> m_rttSamples;
+
+    // Store-and-forward state
+    bool m_storeForward;
+    Ptr<NetDevice> m_uplink;
+    uint32_t m_capacity;
+    Time m_drainGap;
+    std::deque<std::pair<uint32_t, Time> > m_backlog;  // (seq, time taken)
+    EventId m_drainEvent;
+    bool m_draining;
+    Time m_drainStart;
+    uint32_t m_buffered;
+    uint32_t m_maxBacklog;
+    uint32_t m_bufferDrops;
+    SampleStats m_bufferDelay;                           // ms
+    std::vector<std::pair<Time, Time> > m_drainWindows;
+};
+
+TypeId
+TelemetryClient::GetTypeId(void)
+{
+    static TypeId tid = TypeId("TelemetryClient")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<TelemetryClient>();
+    return tid;
+}
+
+TelemetryClient::TelemetryClient()
+    : m_socket(0),
+      m_packetSize(0),
+      m_maxPackets(0),
+      m_interval(Seconds(1.0)),
+      m_jitter(0.0),
+      m_tos(0),
+      m_taken(0),
+      m_sent(0),
+      m_received(0),
+      m_missed(0),
+      m_storeForward(false),
+      m_capacity(0),
+      m_draining(false),
+      m_buffered(0),
+      m_maxBacklog(0),
+      m_bufferDrops(0)
+{
+    m_jitterRng = CreateObject<UniformRandomVariable>();
+}
+
+TelemetryClient::~TelemetryClient()
+{
+    m_socket = 0;
+}
+
+void
+TelemetryClient::Setup(Address peer, uint32_t packetSize, uint32_t maxPackets,
+                       Time interval, double jitter)
+{
+    m_peer = peer;
+    m_packetSize = packetSize;
+    m_maxPackets = maxPackets;
+    m_interval = interval;
+    m_jitter = jitter;
+}
+
+void
+TelemetryClient::EnableStoreAndForward(Ptr<NetDevice> uplink, uint32_t capacity, double drainRate)
+{
+    m_storeForward = true;
+    m_uplink = uplink;
+    m_capacity = std::max<uint32_t>(capacity, 1);
+    m_drainGap = Seconds(1.0 / drainRate);
+}
+
+void
+TelemetryClient::SetTos(uint8_t tos)
+{
+    m_tos = tos;
+}
+
+uint32_t
+TelemetryClient::GetSent(void) const
+{
+    return m_sent;
+}
+
+uint32_t
+TelemetryClient::GetReceived(void) const
+{
+    return m_received;
+}
+
+uint32_t
+TelemetryClient::GetMissed(void) const
+{
+    return m_missed;
+}
+
+const std::vector<TelemetryClient::RttSample>&
+TelemetryClient::GetRttSamples(void) const
+{
+    return m_rttSamples;
+}
+
+uint32_t
+TelemetryClient::GetBuffered(void) const
+{
+    return m_buffered;
+}
+
+uint32_t
+TelemetryClient::GetMaxBacklog(void) const
+{
+    return m_maxBacklog;
+}
+
+uint32_t
+TelemetryClient::GetBufferDrops(void) const
+{
+    return m_bufferDrops;
+}
+
+const SampleStats&
+TelemetryClient::GetBufferDelay(void) const
+{
+    return m_bufferDelay;
+}
+
+const std::vector<std::pair<Time, Time> >&
+TelemetryClient::GetDrainWindows(void) const
+{
+    return m_drainWindows;
+}
+
+void
+TelemetryClient::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->Connect(m_peer);
+        m_socket->SetIpTos(m_tos);
+        m_socket->SetRecvCallback(MakeCallback(&TelemetryClient::HandleRead, this));
+    }
+    TakeReading();
+}
+
+void
+TelemetryClient::StopApplication(void)
+{
+    Simulator::Cancel(m_sendEvent);
+    Simulator::Cancel(m_drainEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+TelemetryClient::ScheduleNextReading(void)
+{
+    if (m_taken >= m_maxPackets)
+    {
+        return;
+    }
+    // Uniform jitter of +/- m_jitter around the nominal reporting interval
+    double scale = 1.0 + m_jitterRng->GetValue(-m_jitter, m_jitter);
+    m_sendEvent = Simulator::Schedule(Seconds(m_interval.GetSeconds() * scale),
+                                      &TelemetryClient::TakeReading, this);
+}
+
+void
+TelemetryClient::TakeReading(void)
+{
+    uint32_t seq = m_taken++;
+    if (!IsPowered())
+    {
+        ++m_missed;
+    }
+    else if (m_storeForward && (!UplinkUp() || !m_backlog.empty()))
+    {
+        if (m_backlog.size() >= m_capacity)
+        {
+            m_backlog.pop_front();
+            ++m_bufferDrops;
+        }
+        m_backlog.push_back(std::make_pair(seq, Simulator::Now()));
+        m_maxBacklog = std::max<uint32_t>(m_maxBacklog, m_backlog.size());
+        ++m_buffered;
+        if (!m_drainEvent.IsRunning())
+        {
+            m_drainEvent = Simulator::Schedule(m_drainGap, &TelemetryClient::DrainOne, this);
+        }
+    }
+    else
+    {
+        Transmit(seq);
+    }
+    ScheduleNextReading();
+}
+
+void
+TelemetryClient::Transmit(uint32_t seq)
+{
+    SeqTsHeader seqTs;
+    seqTs.SetSeq(seq);
+    uint32_t headerSize = seqTs.GetSerializedSize();
+    Ptr<Packet> packet = Create<Packet>(m_packetSize > headerSize ? m_packetSize - headerSize : 0);
+    packet->AddHeader(seqTs);
+
+    m_socket->Send(packet);
+    ++m_sent;
+}
+
+bool
+TelemetryClient::UplinkUp(void) const
+{
+    Ptr<Ipv4> ipv4 = GetNode()->GetObject<Ipv4>();
+    int32_t interface = ipv4->GetInterfaceForDevice(m_uplink);
+    return interface >= 0 && ipv4->IsUp(interface);
+}
+
+void
+TelemetryClient::DrainOne(void)
+{
+    if (m_backlog.empty())
+    {
+        return;
+    }
+    if (UplinkUp())
+    {
+        if (!m_draining)
+        {
+            m_draining = true;
+            m_drainStart = Simulator::Now();
+        }
+        m_bufferDelay.Add((Simulator::Now() - m_backlog.front().second).GetSeconds() * 1000.0);
+        Transmit(m_backlog.front().first);
+        m_backlog.pop_front();
+        if (m_backlog.empty())
+        {
+            m_drainWindows.push_back(std::make_pair(m_drainStart, Simulator::Now()));
+            m_draining = false;
+            return;
+        }
+    }
+    // Still down (checked again at the drain pace) or more backlog to replay
+    m_drainEvent = Simulator::Schedule(m_drainGap, &TelemetryClient::DrainOne, this);
+}
+
+void
+TelemetryClient::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        ++m_received;
+        SeqTsHeader seqTs;
+        packet->RemoveHeader(seqTs);
+        RttSample sample;
+        sample.sent = seqTs.GetTs().GetSeconds();
+        sample.rtt = (Simulator::Now() - seqTs.GetTs()).GetSeconds() * 1000.0;
+        m_rttSamples.push_back(sample);
+    }
+}
+
+// Print readings sent and echoed for one class of site
+static void
+ReportTelemetry(const std::string& label, const std::vector<Ptr<TelemetryClient> >& clients)
+{
+    uint32_t sent = 0, echoed = 0;
+    for (uint32_t i = 0; i < clients.size(); ++i)
+    {
+        sent += clients[i]->GetSent();
+        echoed += clients[i]->GetReceived();
+    }
+    std::cout << "  " << label << sent << " sent / " << echoed << " echoed\n";
+}
+
+// ============================================================================
+// MONITORING CENTER POLLER
+// ============================================================================
+//
+// Sweeps every site from the monitoring center on a fixed schedule. At most
+// maxOutstanding requests are in flight at once; a request that is not
+// answered within the timeout is abandoned and the slot is reused for the
+// next site. A cycle completes once every site has answered or timed out,
+// and the next cycle starts one cycle interval after the previous one began
+// (or immediately, if the sweep overran the interval).
+
+class SitePoller : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    SitePoller();
+    virtual ~SitePoller();
+
+    void Setup(const std::vector<Address>& targets, uint32_t requestSize,
+               uint32_t maxOutstanding, Time timeout, Time cycleInterval);
+
+    uint32_t GetRequests(void) const;
+    uint32_t GetResponses(void) const;
+    uint32_t GetTimeouts(void) const;
+    const SampleStats& GetCycleTimes(void) const;
+    const SampleStats& GetRtts(void) const;
+    const SampleStats& GetSiteRtts(uint32_t site) const;
+    uint32_t GetSiteTimeouts(uint32_t site) const;
+
+protected:
+    // Request for one transaction; the default is a SeqTs echo probe
+    virtual Ptr<Packet> BuildRequest(uint32_t txId, uint32_t site);
+    // Recovers the transaction id of a response; false discards the packet
+    virtual bool ParseResponse(Ptr<Packet> packet, uint32_t& txId);
+
+private:
+    struct PendingRequest
+    {
+        uint32_t site;
+        Time sent;
+        EventId timeout;
+    };
+
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void StartCycle(void);
+    void IssueNext(void);
+    void HandleTimeout(uint32_t txId);
+    void CompleteOne(void);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    std::vector<Address> m_targets;
+    uint32_t m_requestSize;
+    uint32_t m_maxOutstanding;
+    Time m_timeout;
+    Time m_cycleInterval;
+
+    std::map<uint32_t, PendingRequest> m_pending;  // keyed by transaction id
+    uint32_t m_nextTxId;
+    uint32_t m_nextSite;
+    uint32_t m_completed;
+    Time m_cycleStart;
+    EventId m_cycleEvent;
+
+    uint32_t m_requests;
+    uint32_t m_responses;
+    uint32_t m_timeouts;
+    SampleStats m_cycleTimes;          // ms
+    SampleStats m_rtts;                // ms, all sites
+    std::vector<SampleStats> m_siteRtts;
+    std::vector<uint32_t> m_siteTimeouts;
+};
+
+TypeId
+SitePoller::GetTypeId(void)
+{
+    static TypeId tid = TypeId("SitePoller")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<SitePoller>();
+    return tid;
+}
+
+SitePoller::SitePoller()
+    : m_socket(0),
+      m_requestSize(64),
+      m_maxOutstanding(1),
+      m_nextTxId(0),
+      m_nextSite(0),
+      m_completed(0),
+      m_requests(0),
+      m_responses(0),
+      m_timeouts(0)
+{
+}
+
+SitePoller::~SitePoller()
+{
+    m_socket = 0;
+}
+
+void
+SitePoller::Setup(const std::vector<Address>& targets, uint32_t requestSize,
+                  uint32_t maxOutstanding, Time timeout, Time cycleInterval)
+{
+    m_targets = targets;
+    m_requestSize = requestSize;
+    m_maxOutstanding = std::max<uint32_t>(maxOutstanding, 1);
+    m_timeout = timeout;
+    m_cycleInterval = cycleInterval;
+    m_siteRtts.assign(targets.size(), SampleStats());
+    m_siteTimeouts.assign(targets.size(), 0);
+}
+
+uint32_t
+SitePoller::GetRequests(void) const
+{
+    return m_requests;
+}
+
+uint32_t
+SitePoller::GetResponses(void) const
+{
+    return m_responses;
+}
+
+uint32_t
+SitePoller::GetTimeouts(void) const
+{
+    return m_timeouts;
+}
+
+const SampleStats&
+SitePoller::GetCycleTimes(void) const
+{
+    return m_cycleTimes;
+}
+
+const SampleStats&
+SitePoller::GetRtts(void) const
+{
+    return m_rtts;
+}
+
+const SampleStats&
+SitePoller::GetSiteRtts(uint32_t site) const
+{
+    return m_siteRtts[site];
+}
+
+uint32_t
+SitePoller::GetSiteTimeouts(uint32_t site) const
+{
+    return m_siteTimeouts[site];
+}
+
+Ptr<Packet>
+SitePoller::BuildRequest(uint32_t txId, uint32_t /* site */)
+{
+    SeqTsHeader seqTs;
+    seqTs.SetSeq(txId);
+    uint32_t headerSize = seqTs.GetSerializedSize();
+    Ptr<Packet> packet = Create<Packet>(m_requestSize > headerSize ? m_requestSize - headerSize : 0);
+    packet->AddHeader(seqTs);
+    return packet;
+}
+
+bool
+SitePoller::ParseResponse(Ptr<Packet> packet, uint32_t& txId)
+{
+    SeqTsHeader seqTs;
+    packet->RemoveHeader(seqTs);
+    txId = seqTs.GetSeq();
+    return true;
+}
+
+void
+SitePoller::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->SetRecvCallback(MakeCallback(&SitePoller::HandleRead, this));
+    }
+    StartCycle();
+}
+
+void
+SitePoller::StopApplication(void)
+{
+    Simulator::Cancel(m_cycleEvent);
+    for (std::map<uint32_t, PendingRequest>::iterator it = m_pending.begin();
+         it != m_pending.end(); ++it)
+    {
+        Simulator::Cancel(it->second.timeout);
+    }
+    m_pending.clear();
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+SitePoller::StartCycle(void)
+{
+    if (m_targets.empty())
+    {
+        return;
+    }
+    m_cycleStart = Simulator::Now();
+    m_nextSite = 0;
+    m_completed = 0;
+    while (m_nextSite < m_targets.size() && m_pending.size() < m_maxOutstanding)
+    {
+        IssueNext();
+    }
+}
+
+void
+SitePoller::IssueNext(void)
+{
+    uint32_t txId = m_nextTxId++;
+    Ptr<Packet> packet = BuildRequest(txId, m_nextSite);
+
+    PendingRequest& request = m_pending[txId];
+    request.site = m_nextSite;
+    request.sent = Simulator::Now();
+    request.timeout = Simulator::Schedule(m_timeout, &SitePoller::HandleTimeout, this, txId);
+
+    m_socket->SendTo(packet, 0, m_targets[m_nextSite]);
+    ++m_nextSite;
+    ++m_requests;
+}
+
+void
+SitePoller::HandleTimeout(uint32_t txId)
+{
+    std::map<uint32_t, PendingRequest>::iterator it = m_pending.find(txId);
+    if (it == m_pending.end())
+    {
+        return;
+    }
+    ++m_siteTimeouts[it->second.site];
+    m_pending.erase(it);
+    ++m_timeouts;
+    CompleteOne();
+}
+
+void
+SitePoller::CompleteOne(void)
+{
+    ++m_completed;
+    if (m_nextSite < m_targets.size())
+    {
+        IssueNext();
+    }
+    else if (m_completed == m_targets.size())
+    {
+        Time elapsed = Simulator::Now() - m_cycleStart;
+        m_cycleTimes.Add(elapsed.GetSeconds() * 1000.0);
+        Time wait = m_cycleInterval > elapsed ? m_cycleInterval - elapsed : Seconds(0.0);
+        m_cycleEvent = Simulator::Schedule(wait, &SitePoller::StartCycle, this);
+    }
+}
+
+void
+SitePoller::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        uint32_t txId;
+        if (!ParseResponse(packet, txId))
+        {
+            continue;
+        }
+        std::map<uint32_t, PendingRequest>::iterator it = m_pending.find(txId);
+        if (it == m_pending.end())
+        {
+            continue; // Late answer to a request that already timed out
+        }
+        double rtt = (Simulator::Now() - it->second.sent).GetSeconds() * 1000.0;
+        m_rtts.Add(rtt);
+        m_siteRtts[it->second.site].Add(rtt);
+        Simulator::Cancel(it->second.timeout);
+        m_pending.erase(it);
+        ++m_responses;
+        CompleteOne();
+    }
+}
+
+// ============================================================================
+// SCADA POLLING
+// ============================================================================
+//
+// Modbus/TCP-style master/slave polling of the micro-grid controllers. The
+// master reuses the SitePoller sweep (outstanding-request limit, per-
+// transaction timeout, scan cycles) and only swaps the wire format: each
+// transaction is a "read holding registers" request framed with an MBAP
+// header, answered by the slave with the register contents or an exception.
+
+class ModbusHeader : public Header
+{
+public:
+    enum Direction
+    {
+        REQUEST,
+        RESPONSE
+    };
+
+    static const uint8_t READ_HOLDING_REGISTERS = 0x03;
+    static const uint8_t EXCEPTION_FLAG = 0x80;
+    static const uint16_t MAX_READ_REGISTERS = 125;
+
+    explicit ModbusHeader(Direction direction = REQUEST);
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetTransaction(uint16_t transaction);
+    uint16_t GetTransaction(void) const;
+    void SetUnit(uint8_t unit);
+    uint8_t GetUnit(void) const;
+    void SetFunction(uint8_t function);
+    uint8_t GetFunction(void) const;
+    bool IsException(void) const;
+
+    // Request PDU
+    void SetRead(uint16_t startRegister, uint16_t quantity);
+    uint16_t GetStartRegister(void) const;
+    uint16_t GetQuantity(void) const;
+
+    // Response PDU: register bytes that follow as payload, or the exception code
+    void SetByteCount(uint8_t byteCount);
+    uint8_t GetByteCount(void) const;
+    void SetException(uint8_t code);
+    uint8_t GetExceptionCode(void) const;
+
+private:
+    Direction m_direction;
+    uint16_t m_transaction;
+    uint8_t m_unit;
+    uint8_t m_function;
+    uint16_t m_startRegister;
+    uint16_t m_quantity;
+    uint8_t m_byteCount;        // Exception code when the exception flag is set
+};
+
+ModbusHeader::ModbusHeader(Direction direction)
+    : m_direction(direction),
+      m_transaction(0),
+      m_unit(1),
+      m_function(READ_HOLDING_REGISTERS),
+      m_startRegister(0),
+      m_quantity(0),
+      m_byteCount(0)
+{
+}
+
+TypeId
+ModbusHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("ModbusHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<ModbusHeader>();
+    return tid;
+}
+
+TypeId
+ModbusHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+ModbusHeader::GetSerializedSize(void) const
+{
+    // MBAP (7) + function code + request fields or byte count / exception code
+    return 7 + 1 + (m_direction == REQUEST ? 4 : 1);
+}
+
+void
+ModbusHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    // The MBAP length field covers the unit id and the whole PDU
+    uint16_t length = GetSerializedSize() - 6;
+    if (m_direction == RESPONSE && !IsException())
+    {
+        length += m_byteCount;
+    }
+    i.WriteHtonU16(m_transaction);
+    i.WriteHtonU16(0);            // Protocol identifier: Modbus
+    i.WriteHtonU16(length);
+    i.WriteU8(m_unit);
+    i.WriteU8(m_function);
+    if (m_direction == REQUEST)
+    {
+        i.WriteHtonU16(m_startRegister);
+        i.WriteHtonU16(m_quantity);
+    }
+    else
+    {
+        i.WriteU8(m_byteCount);
+    }
+}
+
+uint32_t
+ModbusHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_transaction = i.ReadNtohU16();
+    i.ReadNtohU16();
+    i.ReadNtohU16();
+    m_unit = i.ReadU8();
+    m_function = i.ReadU8();
+    if (m_direction == REQUEST)
+    {
+        m_startRegister = i.ReadNtohU16();
+        m_quantity = i.ReadNtohU16();
+    }
+    else
+    {
+        m_byteCount = i.ReadU8();
+    }
+    return GetSerializedSize();
+}
+
+void
+ModbusHeader::Print(std::ostream& os) const
+{
+    os << "tx=" << m_transaction << " unit=" << static_cast<uint32_t>(m_unit)
+       << " fc=" << static_cast<uint32_t>(m_function);
+    if (m_direction == REQUEST)
+    {
+        os << " start=" << m_startRegister << " qty=" << m_quantity;
+    }
+    else
+    {
+        os << (IsException() ? " exception=" : " bytes=") << static_cast<uint32_t>(m_byteCount);
+    }
+}
+
+void
+ModbusHeader::SetTransaction(uint16_t transaction)
+{
+    m_transaction = transaction;
+}
+
+uint16_t
+ModbusHeader::GetTransaction(void) const
+{
+    return m_transaction;
+}
+
+void
+ModbusHeader::SetUnit(uint8_t unit)
+{
+    m_unit = unit;
+}
+
+uint8_t
+ModbusHeader::GetUnit(void) const
+{
+    return m_unit;
+}
+
+void
+ModbusHeader::SetFunction(uint8_t function)
+{
+    m_function = function;
+}
+
+uint8_t
+ModbusHeader::GetFunction(void) const
+{
+    return m_function;
+}
+
+bool
+ModbusHeader::IsException(void) const
+{
+    return (m_function & EXCEPTION_FLAG) != 0;
+}
+
+void
+ModbusHeader::SetRead(uint16_t startRegister, uint16_t quantity)
+{
+    m_function = READ_HOLDING_REGISTERS;
+    m_startRegister = startRegister;
+    m_quantity = quantity;
+}
+
+uint16_t
+ModbusHeader::GetStartRegister(void) const
+{
+    return m_startRegister;
+}
+
+uint16_t
+ModbusHeader::GetQuantity(void) const
+{
+    return m_quantity;
+}
+
+void
+ModbusHeader::SetByteCount(uint8_t byteCount)
+{
+    m_byteCount = byteCount;
+}
+
+uint8_t
+ModbusHeader::GetByteCount(void) const
+{
+    return m_byteCount;
+}
+
+void
+ModbusHeader::SetException(uint8_t code)
+{
+    m_function |= EXCEPTION_FLAG;
+    m_byteCount = code;
+}
+
+uint8_t
+ModbusHeader::GetExceptionCode(void) const
+{
+    return m_byteCount;
+}
+
+class ModbusMaster : public SitePoller
+{
+public:
+    static TypeId GetTypeId(void);
+
+    ModbusMaster();
+
+    void SetRegisters(uint16_t startRegister, uint16_t quantity);
+
+    uint32_t GetExceptions(void) const;
+
+protected:
+    virtual Ptr<Packet> BuildRequest(uint32_t txId, uint32_t site);
+    virtual bool ParseResponse(Ptr<Packet> packet, uint32_t& txId);
+
+private:
+    uint16_t m_startRegister;
+    uint16_t m_quantity;
+    uint32_t m_lastTxId;
+    uint32_t m_exceptions;
+};
+
+TypeId
+ModbusMaster::GetTypeId(void)
+{
+    static TypeId tid = TypeId("ModbusMaster")
+        .SetParent<SitePoller>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<ModbusMaster>();
+    return tid;
+}
+
+ModbusMaster::ModbusMaster()
+    : m_startRegister(0),
+      m_quantity(1),
+      m_lastTxId(0),
+      m_exceptions(0)
+{
+}
+
+void
+ModbusMaster::SetRegisters(uint16_t startRegister, uint16_t quantity)
+{
+    m_startRegister = startRegister;
+    m_quantity = quantity;
+}
+
+uint32_t
+ModbusMaster::GetExceptions(void) const
+{
+    return m_exceptions;
+}
+
+Ptr<Packet>
+ModbusMaster::BuildRequest(uint32_t txId, uint32_t /* site */)
+{
+    m_lastTxId = txId;
+    ModbusHeader header(ModbusHeader::REQUEST);
+    header.SetTransaction(static_cast<uint16_t>(txId));
+    header.SetRead(m_startRegister, m_quantity);
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(header);
+    return packet;
+}
+
+bool
+ModbusMaster::ParseResponse(Ptr<Packet> packet, uint32_t& txId)
+{
+    ModbusHeader header(ModbusHeader::RESPONSE);
+    packet->RemoveHeader(header);
+    if (header.IsException())
+    {
+        ++m_exceptions;
+    }
+    // The wire carries 16 bits; pending transactions are always recent, so
+    // the full id is the latest one issued with matching low bits
+    uint16_t wrapped = static_cast<uint16_t>(m_lastTxId) - header.GetTransaction();
+    txId = m_lastTxId - wrapped;
+    return true;
+}
+
+class ModbusSlave : public SiteApplication
+{
+public:
+    static TypeId GetTypeId(void);
+
+    ModbusSlave();
+    virtual ~ModbusSlave();
+
+    // 'registers' is the size of the holding register table; 'processing' the
+    // controller's time to service one request
+    void Setup(uint16_t port, uint16_t registers, Time processing);
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+    void Respond(ModbusHeader request, Address to);
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+    uint16_t m_registers;
+    Time m_processing;
+};
+
+TypeId
+ModbusSlave::GetTypeId(void)
+{
+    static TypeId tid = TypeId("ModbusSlave")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<ModbusSlave>();
+    return tid;
+}
+
+ModbusSlave::ModbusSlave()
+    : m_socket(0),
+      m_port(502),
+      m_registers(0)
+{
+}
+
+ModbusSlave::~ModbusSlave()
+{
+    m_socket = 0;
+}
+
+void
+ModbusSlave::Setup(uint16_t port, uint16_t registers, Time processing)
+{
+    m_port = port;
+    m_registers = registers;
+    m_processing = processing;
+}
+
+void
+ModbusSlave::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&ModbusSlave::HandleRead, this));
+    }
+}
+
+void
+ModbusSlave::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+ModbusSlave::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        ModbusHeader request(ModbusHeader::REQUEST);
+        packet->RemoveHeader(request);
+        Simulator::Schedule(m_processing, &ModbusSlave::Respond, this, request, from);
+    }
+}
+
+void
+ModbusSlave::Respond(ModbusHeader request, Address to)
+{
+    if (!IsPowered())
+    {
+        return;
+    }
+    ModbusHeader response(ModbusHeader::RESPONSE);
+    response.SetTransaction(request.GetTransaction());
+    response.SetUnit(request.GetUnit());
+    response.SetFunction(request.GetFunction());
+
+    uint32_t dataBytes = 0;
+    if (request.GetFunction() != ModbusHeader::READ_HOLDING_REGISTERS)
+    {
+        response.SetException(0x01);    // Illegal function
+    }
+    else if (request.GetQuantity() == 0 || request.GetQuantity() > ModbusHeader::MAX_READ_REGISTERS)
+    {
+        response.SetException(0x03);    // Illegal data value
+    }
+    else if (request.GetStartRegister() + request.GetQuantity() > m_registers)
+    {
+        response.SetException(0x02);    // Illegal data address
+    }
+    else
+    {
+        dataBytes = 2 * request.GetQuantity();
+        response.SetByteCount(dataBytes);
+    }
+
+    Ptr<Packet> packet = Create<Packet>(dataBytes);
+    packet->AddHeader(response);
+    m_socket->SendTo(packet, 0, to);
+}
+
+// ============================================================================
+// TOPIC PUB/SUB BROKER
+// ============================================================================
+//
+// Lightweight MQTT-like messaging over UDP. Sites publish readings to
+// hierarchical topics ("school/3/energy"), consumers subscribe with filters
+// that may use the single-level "+" and multi-level "#" wildcards, and the
+// broker on the central station fans each publication out to every
+// subscriber with a matching filter.
+
+// Split a string on a single separator character, dropping empty fields
+static std::vector<std::string>
+SplitString(const std::string& text, char separator)
+{
+    std::vector<std::string> fields;
+    std::istringstream stream(text);
+    std::string field;
+    while (std::getline(stream, field, separator))
+    {
+        if (!field.empty())
+        {
+            fields.push_back(field);
+        }
+    }
+    return fields;
+}
+
+// MQTT topic filter matching: "+" matches one level, a trailing "#" matches
+// the remaining levels (including none)
+static bool
+TopicMatches(const std::string& filter, const std::string& topic)
+{
+    std::vector<std::string> filterLevels = SplitString(filter, '/');
+    std::vector<std::string> topicLevels = SplitString(topic, '/');
+    for (uint32_t i = 0; i < filterLevels.size(); ++i)
+    {
+        if (filterLevels[i] == "#")
+        {
+            return true;
+        }
+        if (i >= topicLevels.size())
+        {
+            return false;
+        }
+        if (filterLevels[i] != "+" && filterLevels[i] != topicLevels[i])
+        {
+            return false;
+        }
+    }
+    return filterLevels.size() == topicLevels.size();
+}
+
+class PubSubHeader : public Header
+{
+public:
+    enum MessageType
+    {
+        SUBSCRIBE = 1,
+        PUBLISH = 2
+    };
+
+    PubSubHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetType(MessageType type);
+    MessageType GetType(void) const;
+    void SetTopic(const std::string& topic);
+    std::string GetTopic(void) const;
+    void SetSeq(uint32_t seq);
+    uint32_t GetSeq(void) const;
+    void SetPublishTime(Time t);
+    Time GetPublishTime(void) const;
+    void SetForwardTime(Time t);
+    Time GetForwardTime(void) const;
+
+private:
+    uint8_t m_type;
+    std::string m_topic;      // Topic (PUBLISH) or topic filter (SUBSCRIBE)
+    uint32_t m_seq;
+    uint64_t m_publishTs;     // Set by the publisher
+    uint64_t m_forwardTs;     // Set by the broker when fanning out
+};
+
+PubSubHeader::PubSubHeader()
+    : m_type(PUBLISH),
+      m_seq(0),
+      m_publishTs(0),
+      m_forwardTs(0)
+{
+}
+
+TypeId
+PubSubHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("PubSubHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<PubSubHeader>();
+    return tid;
+}
+
+TypeId
+PubSubHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+PubSubHeader::GetSerializedSize(void) const
+{
+    return 1 + 1 + m_topic.size() + 4 + 8 + 8;
+}
+
+void
+PubSubHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteU8(m_type);
+    i.WriteU8(m_topic.size());
+    i.Write(reinterpret_cast<const uint8_t*>(m_topic.data()), m_topic.size());
+    i.WriteHtonU32(m_seq);
+    i.WriteHtonU64(m_publishTs);
+    i.WriteHtonU64(m_forwardTs);
+}
+
+uint32_t
+PubSubHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_type = i.ReadU8();
+    uint8_t topicLength = i.ReadU8();
+    std::vector<uint8_t> topic(topicLength);
+    if (topicLength > 0)
+    {
+        i.Read(&topic[0], topicLength);
+    }
+    m_topic.assign(topic.begin(), topic.end());
+    m_seq = i.ReadNtohU32();
+    m_publishTs = i.ReadNtohU64();
+    m_forwardTs = i.ReadNtohU64();
+    return GetSerializedSize();
+}
+
+void
+PubSubHeader::Print(std::ostream& os) const
+{
+    os << (m_type == SUBSCRIBE ? "SUBSCRIBE " : "PUBLISH ") << m_topic << " seq=" << m_seq;
+}
+
+void
+PubSubHeader::SetType(MessageType type)
+{
+    m_type = type;
+}
+
+PubSubHeader::MessageType
+PubSubHeader::GetType(void) const
+{
+    return static_cast<MessageType>(m_type);
+}
+
+void
+PubSubHeader::SetTopic(const std::string& topic)
+{
+    NS_ASSERT_MSG(topic.size() <= 255, "Topic too long");
+    m_topic = topic;
+}
+
+std::string
+PubSubHeader::GetTopic(void) const
+{
+    return m_topic;
+}
+
+void
+PubSubHeader::SetSeq(uint32_t seq)
+{
+    m_seq = seq;
+}
+
+uint32_t
+PubSubHeader::GetSeq(void) const
+{
+    return m_seq;
+}
+
+void
+PubSubHeader::SetPublishTime(Time t)
+{
+    m_publishTs = t.GetTimeStep();
+}
+
+Time
+PubSubHeader::GetPublishTime(void) const
+{
+    return TimeStep(m_publishTs);
+}
+
+void
+PubSubHeader::SetForwardTime(Time t)
+{
+    m_forwardTs = t.GetTimeStep();
+}
+
+Time
+PubSubHeader::GetForwardTime(void) const
+{
+    return TimeStep(m_forwardTs);
+}
+
+// Broker: keeps (subscriber, filter) pairs and forwards every publication
+// once to each subscriber holding at least one matching filter
+class PubSubBroker : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    PubSubBroker();
+    virtual ~PubSubBroker();
+
+    void Setup(uint16_t port);
+
+    uint32_t GetPublished(void) const;
+    uint32_t GetDelivered(void) const;
+    uint64_t GetDeliveredBytes(void) const;
+    Time GetActiveTime(void) const;
+
+private:
+    struct Subscription
+    {
+        Address subscriber;
+        std::string filter;
+    };
+
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+    std::vector<Subscription> m_subscriptions;
+    uint32_t m_published;
+    uint32_t m_delivered;
+    uint64_t m_deliveredBytes;
+    Time m_firstPublish;
+    Time m_lastPublish;
+};
+
+TypeId
+PubSubBroker::GetTypeId(void)
+{
+    static TypeId tid = TypeId("PubSubBroker")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<PubSubBroker>();
+    return tid;
+}
+
+PubSubBroker::PubSubBroker()
+    : m_socket(0),
+      m_port(0),
+      m_published(0),
+      m_delivered(0),
+      m_deliveredBytes(0)
+{
+}
+
+PubSubBroker::~PubSubBroker()
+{
+    m_socket = 0;
+}
+
+void
+PubSubBroker::Setup(uint16_t port)
+{
+    m_port = port;
+}
+
+uint32_t
+PubSubBroker::GetPublished(void) const
+{
+    return m_published;
+}
+
+uint32_t
+PubSubBroker::GetDelivered(void) const
+{
+    return m_delivered;
+}
+
+uint64_t
+PubSubBroker::GetDeliveredBytes(void) const
+{
+    return m_deliveredBytes;
+}
+
+Time
+PubSubBroker::GetActiveTime(void) const
+{
+    return m_lastPublish - m_firstPublish;
+}
+
+void
+PubSubBroker::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&PubSubBroker::HandleRead, this));
+    }
+}
+
+void
+PubSubBroker::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+PubSubBroker::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        PubSubHeader header;
+        packet->RemoveHeader(header);
+
+        if (header.GetType() == PubSubHeader::SUBSCRIBE)
+        {
+            bool known = false;
+            for (uint32_t i = 0; i < m_subscriptions.size() && !known; ++i)
+            {
+                known = m_subscriptions[i].subscriber == from
+                        && m_subscriptions[i].filter == header.GetTopic();
+            }
+            if (!known)
+            {
+                Subscription subscription;
+                subscription.subscriber = from;
+                subscription.filter = header.GetTopic();
+                m_subscriptions.push_back(subscription);
+            }
+            continue;
+        }
+
+        if (m_published == 0)
+        {
+            m_firstPublish = Simulator::Now();
+        }
+        m_lastPublish = Simulator::Now();
+        ++m_published;
+
+        header.SetForwardTime(Simulator::Now());
+        std::set<Address> delivered;
+        for (uint32_t i = 0; i < m_subscriptions.size(); ++i)
+        {
+            const Subscription& subscription = m_subscriptions[i];
+            if (delivered.count(subscription.subscriber) > 0
+                || !TopicMatches(subscription.filter, header.GetTopic()))
+            {
+                continue;
+            }
+            Ptr<Packet> copy = packet->Copy();
+            copy->AddHeader(header);
+            if (socket->SendTo(copy, 0, subscription.subscriber) >= 0)
+            {
+                ++m_delivered;
+                m_deliveredBytes += copy->GetSize();
+            }
+            delivered.insert(subscription.subscriber);
+        }
+    }
+}
+
+// Site-side publisher: one topic, fixed payload, jittered period
+class TopicPublisher : public SiteApplication
+{
+public:
+    static TypeId GetTypeId(void);
+
+    TopicPublisher();
+    virtual ~TopicPublisher();
+
+    void Setup(Address broker, const std::string& topic, uint32_t payloadSize,
+               Time interval, double jitter);
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void Publish(void);
+
+    Ptr<Socket> m_socket;
+    Address m_broker;
+    std::string m_topic;
+    uint32_t m_payloadSize;
+    Time m_interval;
+    double m_jitter;
+    Ptr<UniformRandomVariable> m_jitterRng;
+    EventId m_publishEvent;
+    uint32_t m_seq;
+};
+
+TypeId
+TopicPublisher::GetTypeId(void)
+{
+    static TypeId tid = TypeId("TopicPublisher")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<TopicPublisher>();
+    return tid;
+}
+
+TopicPublisher::TopicPublisher()
+    : m_socket(0),
+      m_payloadSize(0),
+      m_interval(Seconds(1.0)),
+      m_jitter(0.0),
+      m_seq(0)
+{
+    m_jitterRng = CreateObject<UniformRandomVariable>();
+}
+
+TopicPublisher::~TopicPublisher()
+{
+    m_socket = 0;
+}
+
+void
+TopicPublisher::Setup(Address broker, const std::string& topic, uint32_t payloadSize,
+                      Time interval, double jitter)
+{
+    m_broker = broker;
+    m_topic = topic;
+    m_payloadSize = payloadSize;
+    m_interval = interval;
+    m_jitter = jitter;
+}
+
+void
+TopicPublisher::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->Connect(m_broker);
+    }
+    Publish();
+}
+
+void
+TopicPublisher::StopApplication(void)
+{
+    Simulator::Cancel(m_publishEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+    }
+}
+
+void
+TopicPublisher::Publish(void)
+{
+    if (IsPowered())
+    {
+        PubSubHeader header;
+        header.SetType(PubSubHeader::PUBLISH);
+        header.SetTopic(m_topic);
+        header.SetSeq(m_seq++);
+        header.SetPublishTime(Simulator::Now());
+        Ptr<Packet> packet = Create<Packet>(m_payloadSize);
+        packet->AddHeader(header);
+        m_socket->Send(packet);
+    }
+
+    double scale = 1.0 + m_jitterRng->GetValue(-m_jitter, m_jitter);
+    m_publishEvent = Simulator::Schedule(Seconds(m_interval.GetSeconds() * scale),
+                                         &TopicPublisher::Publish, this);
+}
+
+// Consumer: registers its filters with the broker (refreshed periodically,
+// since subscriptions travel over UDP) and records per-message latency
+class TopicSubscriber : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    TopicSubscriber();
+    virtual ~TopicSubscriber();
+
+    void Setup(Address broker, uint16_t port, const std::vector<std::string>& filters);
+
+    uint32_t GetReceived(void) const;
+    const SampleStats& GetEndToEndLatency(void) const;
+    const SampleStats& GetAddedLatency(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void Subscribe(void);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    Address m_broker;
+    uint16_t m_port;
+    std::vector<std::string> m_filters;
+    EventId m_subscribeEvent;
+    uint32_t m_received;
+    SampleStats m_endToEnd;   // ms, publisher to subscriber
+    SampleStats m_added;      // ms, broker to subscriber
+};
+
+TypeId
+TopicSubscriber::GetTypeId(void)
+{
+    static TypeId tid = TypeId("TopicSubscriber")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<TopicSubscriber>();
+    return tid;
+}
+
+TopicSubscriber::TopicSubscriber()
+    : m_socket(0),
+      m_port(0),
+      m_received(0)
+{
+}
+
+TopicSubscriber::~TopicSubscriber()
+{
+    m_socket = 0;
+}
+
+void
+TopicSubscriber::Setup(Address broker, uint16_t port, const std::vector<std::string>& filters)
+{
+    m_broker = broker;
+    m_port = port;
+    m_filters = filters;
+}
+
+uint32_t
+TopicSubscriber::GetReceived(void) const
+{
+    return m_received;
+}
+
+const SampleStats&
+TopicSubscriber::GetEndToEndLatency(void) const
+{
+    return m_endToEnd;
+}
+
+const SampleStats&
+TopicSubscriber::GetAddedLatency(void) const
+{
+    return m_added;
+}
+
+void
+TopicSubscriber::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&TopicSubscriber::HandleRead, this));
+    }
+    Subscribe();
+}
+
+void
+TopicSubscriber::StopApplication(void)
+{
+    Simulator::Cancel(m_subscribeEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+TopicSubscriber::Subscribe(void)
+{
+    for (uint32_t i = 0; i < m_filters.size(); ++i)
+    {
+        PubSubHeader header;
+        header.SetType(PubSubHeader::SUBSCRIBE);
+        header.SetTopic(m_filters[i]);
+        Ptr<Packet> packet = Create<Packet>(0);
+        packet->AddHeader(header);
+        m_socket->SendTo(packet, 0, m_broker);
+    }
+    m_subscribeEvent = Simulator::Schedule(Seconds(10.0), &TopicSubscriber::Subscribe, this);
+}
+
+void
+TopicSubscriber::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        ++m_received;
+        PubSubHeader header;
+        packet->RemoveHeader(header);
+        Time now = Simulator::Now();
+        m_endToEnd.Add((now - header.GetPublishTime()).GetSeconds() * 1000.0);
+        m_added.Add((now - header.GetForwardTime()).GetSeconds() * 1000.0);
+    }
+}
+
+// ============================================================================
+// FIRMWARE DISTRIBUTION
+// ============================================================================
+//
+// The central station pushes a firmware image, cut into fixed-size blocks,
+// to the micro-grid controllers. In multicast mode a single paced stream is
+// sent to a group address and replicated by the routers along a static
+// multicast tree; in unicast mode one paced stream is sent per controller.
+// After each pass the sender emits END markers; receivers answer with a NACK
+// listing missing blocks (which the sender repairs on the same stream) or
+// with DONE once the image is complete.
+
+class FirmwareHeader : public Header
+{
+public:
+    enum MessageType
+    {
+        DATA = 1,
+        END = 2,
+        NACK = 3,
+        DONE = 4
+    };
+
+    // Upper bound on block indices carried by a single NACK
+    static const uint32_t MAX_NACK_BLOCKS = 128;
+
+    FirmwareHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetType(MessageType type);
+    MessageType GetType(void) const;
+    void SetBlock(uint32_t block);
+    uint32_t GetBlock(void) const;
+    void SetTotalBlocks(uint32_t total);
+    uint32_t GetTotalBlocks(void) const;
+    void SetMissing(const std::vector<uint32_t>& missing);
+    const std::vector<uint32_t>& GetMissing(void) const;
+
+private:
+    uint8_t m_type;
+    uint32_t m_block;
+    uint32_t m_totalBlocks;
+    std::vector<uint32_t> m_missing;   // NACK only
+};
+
+FirmwareHeader::FirmwareHeader()
+    : m_type(DATA),
+      m_block(0),
+      m_totalBlocks(0)
+{
+}
+
+TypeId
+FirmwareHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("FirmwareHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<FirmwareHeader>();
+    return tid;
+}
+
+TypeId
+FirmwareHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+FirmwareHeader::GetSerializedSize(void) const
+{
+    return 1 + 4 + 4 + 2 + 4 * m_missing.size();
+}
+
+void
+FirmwareHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteU8(m_type);
+    i.WriteHtonU32(m_block);
+    i.WriteHtonU32(m_totalBlocks);
+    i.WriteHtonU16(m_missing.size());
+    for (uint32_t j = 0; j < m_missing.size(); ++j)
+    {
+        i.WriteHtonU32(m_missing[j]);
+    }
+}
+
+uint32_t
+FirmwareHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_type = i.ReadU8();
+    m_block = i.ReadNtohU32();
+    m_totalBlocks = i.ReadNtohU32();
+    uint16_t nMissing = i.ReadNtohU16();
+    m_missing.resize(nMissing);
+    for (uint32_t j = 0; j < nMissing; ++j)
+    {
+        m_missing[j] = i.ReadNtohU32();
+    }
+    return GetSerializedSize();
+}
+
+void
+FirmwareHeader::Print(std::ostream& os) const
+{
+    os << "type=" << uint32_t(m_type) << " block=" << m_block << "/" << m_totalBlocks
+       << " missing=" << m_missing.size();
+}
+
+void
+FirmwareHeader::SetType(MessageType type)
+{
+    m_type = type;
+}
+
+FirmwareHeader::MessageType
+FirmwareHeader::GetType(void) const
+{
+    return static_cast<MessageType>(m_type);
+}
+
+void
+FirmwareHeader::SetBlock(uint32_t block)
+{
+    m_block = block;
+}
+
+uint32_t
+FirmwareHeader::GetBlock(void) const
+{
+    return m_block;
+}
+
+void
+FirmwareHeader::SetTotalBlocks(uint32_t total)
+{
+    m_totalBlocks = total;
+}
+
+uint32_t
+FirmwareHeader::GetTotalBlocks(void) const
+{
+    return m_totalBlocks;
+}
+
+void
+FirmwareHeader::SetMissing(const std::vector<uint32_t>& missing)
+{
+    m_missing = missing;
+}
+
+const std::vector<uint32_t>&
+FirmwareHeader::GetMissing(void) const
+{
+    return m_missing;
+}
+
+class FirmwareSender : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    FirmwareSender();
+    virtual ~FirmwareSender();
+
+    // With multicast set, one stream goes to 'group'; otherwise one stream
+    // per receiver. 'rate' paces each stream.
+    void Setup(const std::vector<Ipv4Address>& receivers, bool multicast, Ipv4Address group,
+               uint16_t port, uint32_t imageSize, uint32_t blockSize, DataRate rate);
+
+    uint32_t GetTotalBlocks(void) const;
+    uint32_t GetBlocksSent(void) const;
+    uint32_t GetRepairsSent(void) const;
+    uint32_t GetNacksReceived(void) const;
+    uint32_t GetDoneCount(void) const;
+
+private:
+    struct Stream
+    {
+        Address destination;
+        std::deque<uint32_t> queue;        // Blocks waiting to be (re)sent
+        std::set<uint32_t> queued;         // Same blocks, for duplicate checks
+        std::vector<uint32_t> receivers;   // Receiver indices served
+        uint32_t firstPassLeft;            // Blocks of the initial pass still to send
+        EventId sendEvent;
+        EventId endEvent;
+    };
+
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void SendNext(uint32_t stream);
+    void SendEnd(uint32_t stream);
+    bool StreamDone(uint32_t stream) const;
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    std::vector<Ipv4Address> m_receivers;
+    std::map<Ipv4Address, uint32_t> m_receiverIndex;
+    std::vector<uint32_t> m_streamOf;      // Receiver index -> stream index
+    std::vector<bool> m_done;
+    bool m_multicast;
+    Ipv4Address m_group;
+    uint16_t m_port;
+    uint32_t m_blockSize;
+    uint32_t m_totalBlocks;
+    DataRate m_rate;
+    Time m_endInterval;
+    std::vector<Stream> m_streams;
+
+    uint32_t m_blocksSent;
+    uint32_t m_repairsSent;
+    uint32_t m_nacksReceived;
+    uint32_t m_doneCount;
+};
+
+TypeId
+FirmwareSender::GetTypeId(void)
+{
+    static TypeId tid = TypeId("FirmwareSender")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<FirmwareSender>();
+    return tid;
+}
+
+FirmwareSender::FirmwareSender()
+    : m_socket(0),
+      m_multicast(true),
+      m_port(0),
+      m_blockSize(1024),
+      m_totalBlocks(0),
+      m_endInterval(MilliSeconds(500)),
+      m_blocksSent(0),
+      m_repairsSent(0),
+      m_nacksReceived(0),
+      m_doneCount(0)
+{
+}
+
+FirmwareSender::~FirmwareSender()
+{
+    m_socket = 0;
+}
+
+void
+FirmwareSender::Setup(const std::vector<Ipv4Address>& receivers, bool multicast, Ipv4Address group,
+                      uint16_t port, uint32_t imageSize, uint32_t blockSize, DataRate rate)
+{
+    m_receivers = receivers;
+    m_multicast = multicast;
+    m_group = group;
+    m_port = port;
+    m_blockSize = blockSize;
+    m_totalBlocks = (imageSize + blockSize - 1) / blockSize;
+    m_rate = rate;
+    m_done.assign(receivers.size(), false);
+    m_streamOf.assign(receivers.size(), 0);
+
+    m_streams.clear();
+    m_streams.resize(multicast ? 1 : receivers.size());
+    for (uint32_t r = 0; r < receivers.size(); ++r)
+    {
+        m_receiverIndex[receivers[r]] = r;
+        m_streamOf[r] = multicast ? 0 : r;
+        m_streams[m_streamOf[r]].receivers.push_back(r);
+        if (!multicast)
+        {
+            m_streams[r].destination = InetSocketAddress(receivers[r], port);
+        }
+    }
+    if (multicast && !m_streams.empty())
+    {
+        m_streams[0].destination = InetSocketAddress(group, port);
+    }
+}
+
+uint32_t
+FirmwareSender::GetTotalBlocks(void) const
+{
+    return m_totalBlocks;
+}
+
+uint32_t
+FirmwareSender::GetBlocksSent(void) const
+{
+    return m_blocksSent;
+}
+
+uint32_t
+FirmwareSender::GetRepairsSent(void) const
+{
+    return m_repairsSent;
+}
+
+uint32_t
+FirmwareSender::GetNacksReceived(void) const
+{
+    return m_nacksReceived;
+}
+
+uint32_t
+FirmwareSender::GetDoneCount(void) const
+{
+    return m_doneCount;
+}
+
+void
+FirmwareSender::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->SetRecvCallback(MakeCallback(&FirmwareSender::HandleRead, this));
+    }
+    for (uint32_t s = 0; s < m_streams.size(); ++s)
+    {
+        for (uint32_t b = 0; b < m_totalBlocks; ++b)
+        {
+            m_streams[s].queue.push_back(b);
+            m_streams[s].queued.insert(b);
+        }
+        m_streams[s].firstPassLeft = m_totalBlocks;
+        SendNext(s);
+    }
+}
+
+void
+FirmwareSender::StopApplication(void)
+{
+    for (uint32_t s = 0; s < m_streams.size(); ++s)
+    {
+        Simulator::Cancel(m_streams[s].sendEvent);
+        Simulator::Cancel(m_streams[s].endEvent);
+    }
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+FirmwareSender::SendNext(uint32_t stream)
+{
+    Stream& st = m_streams[stream];
+    if (st.queue.empty())
+    {
+        SendEnd(stream);
+        return;
+    }
+
+    uint32_t block = st.queue.front();
+    st.queue.pop_front();
+    st.queued.erase(block);
+
+    FirmwareHeader header;
+    header.SetType(FirmwareHeader::DATA);
+    header.SetBlock(block);
+    header.SetTotalBlocks(m_totalBlocks);
+    Ptr<Packet> packet = Create<Packet>(m_blockSize);
+    packet->AddHeader(header);
+    m_socket->SendTo(packet, 0, st.destination);
+    if (st.firstPassLeft > 0)
+    {
+        --st.firstPassLeft;
+    }
+    else
+    {
+        ++m_repairsSent;
+    }
+    ++m_blocksSent;
+
+    Time gap = Seconds(m_rate.CalculateBytesTxTime(packet->GetSize()));
+    st.sendEvent = Simulator::Schedule(gap, &FirmwareSender::SendNext, this, stream);
+}
+
+void
+FirmwareSender::SendEnd(uint32_t stream)
+{
+    if (StreamDone(stream))
+    {
+        return;
+    }
+    FirmwareHeader header;
+    header.SetType(FirmwareHeader::END);
+    header.SetTotalBlocks(m_totalBlocks);
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(header);
+    m_socket->SendTo(packet, 0, m_streams[stream].destination);
+    // Keep prompting until every receiver on the stream reports DONE
+    m_streams[stream].endEvent = Simulator::Schedule(m_endInterval, &FirmwareSender::SendEnd, this, stream);
+}
+
+bool
+FirmwareSender::StreamDone(uint32_t stream) const
+{
+    const std::vector<uint32_t>& receivers = m_streams[stream].receivers;
+    for (uint32_t i = 0; i < receivers.size(); ++i)
+    {
+        if (!m_done[receivers[i]])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+FirmwareSender::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        std::map<Ipv4Address, uint32_t>::const_iterator it =
+            m_receiverIndex.find(InetSocketAddress::ConvertFrom(from).GetIpv4());
+        if (it == m_receiverIndex.end())
+        {
+            continue;
+        }
+        uint32_t receiver = it->second;
+        uint32_t stream = m_streamOf[receiver];
+        Stream& st = m_streams[stream];
+
+        FirmwareHeader header;
+        packet->RemoveHeader(header);
+        if (header.GetType() == FirmwareHeader::DONE)
+        {
+            if (!m_done[receiver])
+            {
+                m_done[receiver] = true;
+                ++m_doneCount;
+            }
+            if (StreamDone(stream))
+            {
+                Simulator::Cancel(st.endEvent);
+            }
+        }
+        else if (header.GetType() == FirmwareHeader::NACK)
+        {
+            ++m_nacksReceived;
+            const std::vector<uint32_t>& missing = header.GetMissing();
+            for (uint32_t i = 0; i < missing.size(); ++i)
+            {
+                if (missing[i] < m_totalBlocks && st.queued.insert(missing[i]).second)
+                {
+                    st.queue.push_back(missing[i]);
+                }
+            }
+            if (!st.queue.empty() && !st.sendEvent.IsRunning())
+            {
+                Simulator::Cancel(st.endEvent);
+                SendNext(stream);
+            }
+        }
+    }
+}
+
+class FirmwareReceiver : public SiteApplication
+{
+public:
+    static TypeId GetTypeId(void);
+
+    FirmwareReceiver();
+    virtual ~FirmwareReceiver();
+
+    void Setup(uint16_t port);
+
+    bool IsComplete(void) const;
+    Time GetCompletionTime(void) const;
+    uint32_t GetNacksSent(void) const;
+    uint32_t GetDuplicates(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+    void Reply(Ptr<Socket> socket, const Address& sender);
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+    std::vector<bool> m_have;
+    uint32_t m_received;
+    uint32_t m_duplicates;
+    uint32_t m_nacksSent;
+    Time m_completionTime;
+};
+
+TypeId
+FirmwareReceiver::GetTypeId(void)
+{
+    static TypeId tid = TypeId("FirmwareReceiver")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<FirmwareReceiver>();
+    return tid;
+}
+
+FirmwareReceiver::FirmwareReceiver()
+    : m_socket(0),
+      m_port(0),
+      m_received(0),
+      m_duplicates(0),
+      m_nacksSent(0)
+{
+}
+
+FirmwareReceiver::~FirmwareReceiver()
+{
+    m_socket = 0;
+}
+
+void
+FirmwareReceiver::Setup(uint16_t port)
+{
+    m_port = port;
+}
+
+bool
+FirmwareReceiver::IsComplete(void) const
+{
+    return !m_have.empty() && m_received == m_have.size();
+}
+
+Time
+FirmwareReceiver::GetCompletionTime(void) const
+{
+    return m_completionTime;
+}
+
+uint32_t
+FirmwareReceiver::GetNacksSent(void) const
+{
+    return m_nacksSent;
+}
+
+uint32_t
+FirmwareReceiver::GetDuplicates(void) const
+{
+    return m_duplicates;
+}
+
+void
+FirmwareReceiver::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        // Bound to the wildcard address so both unicast and group traffic arrive
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&FirmwareReceiver::HandleRead, this));
+    }
+}
+
+void
+FirmwareReceiver::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+FirmwareReceiver::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        if (!IsPowered())
+        {
+            continue;
+        }
+        FirmwareHeader header;
+        packet->RemoveHeader(header);
+        if (m_have.empty())
+        {
+            m_have.assign(header.GetTotalBlocks(), false);
+        }
+
+        if (header.GetType() == FirmwareHeader::DATA)
+        {
+            uint32_t block = header.GetBlock();
+            if (block >= m_have.size())
+            {
+                continue;
+            }
+            if (m_have[block])
+            {
+                ++m_duplicates;
+                continue;
+            }
+            m_have[block] = true;
+            ++m_received;
+            if (IsComplete())
+            {
+                m_completionTime = Simulator::Now();
+                Reply(socket, from);
+            }
+        }
+        else if (header.GetType() == FirmwareHeader::END)
+        {
+            Reply(socket, from);
+        }
+    }
+}
+
+void
+FirmwareReceiver::Reply(Ptr<Socket> socket, const Address& sender)
+{
+    FirmwareHeader reply;
+    reply.SetTotalBlocks(m_have.size());
+    if (IsComplete())
+    {
+        reply.SetType(FirmwareHeader::DONE);
+    }
+    else
+    {
+        std::vector<uint32_t> missing;
+        for (uint32_t b = 0; b < m_have.size() && missing.size() < FirmwareHeader::MAX_NACK_BLOCKS; ++b)
+        {
+            if (!m_have[b])
+            {
+                missing.push_back(b);
+            }
+        }
+        reply.SetType(FirmwareHeader::NACK);
+        reply.SetMissing(missing);
+        ++m_nacksSent;
+    }
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(reply);
+    socket->SendTo(packet, 0, sender);
+}
+
+// ============================================================================
+// LINK TRAFFIC ACCOUNTING
+// ============================================================================
+
+// Strip the PPP and IPv4 headers from a copy of a frame seen at a
+// point-to-point device and read the transport ports (zero when the frame
+// is not UDP/TCP or is a trailing fragment). Returns false for non-IPv4.
+static bool
+ParsePppFrame(Ptr<const Packet> frame, Ipv4Header& ip, uint16_t& srcPort, uint16_t& dstPort)
+{
+    Ptr<Packet> copy = frame->Copy();
+    PppHeader ppp;
+    copy->RemoveHeader(ppp);
+    if (ppp.GetProtocol() != 0x0021)
+    {
+        return false;
+    }
+    uint8_t versionIhl = 0;
+    copy->CopyData(&versionIhl, 1);
+    if ((versionIhl >> 4) != 4)
+    {
+        return false; // Header-compressed frame
+    }
+    copy->RemoveHeader(ip);
+    srcPort = 0;
+    dstPort = 0;
+    if (ip.GetFragmentOffset() != 0)
+    {
+        return true;
+    }
+    if (ip.GetProtocol() == UdpL4Protocol::PROT_NUMBER)
+    {
+        UdpHeader udp;
+        copy->PeekHeader(udp);
+        srcPort = udp.GetSourcePort();
+        dstPort = udp.GetDestinationPort();
+    }
+    else if (ip.GetProtocol() == TcpL4Protocol::PROT_NUMBER)
+    {
+        TcpHeader tcp;
+        copy->PeekHeader(tcp);
+        srcPort = tcp.GetSourcePort();
+        dstPort = tcp.GetDestinationPort();
+    }
+    return true;
+}
+
+// Frames and bytes sent on a set of devices that belong to one UDP/TCP port
+struct PortTrafficCounter
+{
+    uint16_t port;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+static void
+CountPortTraffic(PortTrafficCounter* counter, Ptr<const Packet> frame)
+{
+    Ipv4Header ip;
+    uint16_t srcPort, dstPort;
+    if (ParsePppFrame(frame, ip, srcPort, dstPort)
+        && (srcPort == counter->port || dstPort == counter->port))
+    {
+        ++counter->packets;
+        counter->bytes += frame->GetSize();
+    }
+}
+
+static void
+WatchPortTraffic(const NetDeviceContainer& devices, PortTrafficCounter* counter)
+{
+    for (uint32_t i = 0; i < devices.GetN(); ++i)
+    {
+        devices.Get(i)->TraceConnectWithoutContext("PhyTxBegin",
+                                                   MakeBoundCallback(&CountPortTraffic, counter));
+    }
+}
+
+// ============================================================================
+// SITE OUTAGES
+// ============================================================================
+
+// A site named as "<class>:<n>" (n counts from 1, matching the node names)
+struct SiteRef
+{
+    std::string siteClass;   // "school", "clinic" or "microgrid"
+    uint32_t index;          // Zero-based index within the class
+};
+
+static SiteRef
+ParseSiteRef(const std::string& text)
+{
+    std::vector<std::string> fields = SplitString(text, ':');
+    NS_ABORT_MSG_IF(fields.size() != 2, "Malformed site reference: " << text);
+    NS_ABORT_MSG_IF(fields[0] != "school" && fields[0] != "clinic" && fields[0] != "microgrid",
+                    "Unknown site class: " << fields[0]);
+    SiteRef ref;
+    ref.siteClass = fields[0];
+    ref.index = std::atoi(fields[1].c_str());
+    NS_ABORT_MSG_IF(ref.index < 1, "Site numbers start at 1: " << text);
+    --ref.index;
+    return ref;
+}
+
+// Uplink outage of one site, given as "<class>:<n>@<start>-<end>"
+struct SiteOutage
+{
+    SiteRef site;
+    double start;
+    double end;
+};
+
+static std::vector<SiteOutage>
+ParseOutages(const std::string& spec)
+{
+    std::vector<SiteOutage> outages;
+    std::vector<std::string> entries = SplitString(spec, ';');
+    for (uint32_t i = 0; i < entries.size(); ++i)
+    {
+        std::vector<std::string> parts = SplitString(entries[i], '@');
+        NS_ABORT_MSG_IF(parts.size() != 2, "Malformed outage: " << entries[i]);
+        std::vector<std::string> times = SplitString(parts[1], '-');
+        NS_ABORT_MSG_IF(times.size() != 2, "Malformed outage window: " << entries[i]);
+        SiteOutage outage;
+        outage.site = ParseSiteRef(parts[0]);
+        outage.start = std::atof(times[0].c_str());
+        outage.end = std::atof(times[1].c_str());
+        NS_ABORT_MSG_IF(outage.end <= outage.start, "Outage must end after it starts: " << entries[i]);
+        outages.push_back(outage);
+    }
+    return outages;
+}
+
+// Bring both ends of a point-to-point link administratively up or down
+static void
+SetLinkState(NetDeviceContainer link, bool up)
+{
+    for (uint32_t i = 0; i < link.GetN(); ++i)
+    {
+        Ptr<Ipv4> ipv4 = link.Get(i)->GetNode()->GetObject<Ipv4>();
+        int32_t interface = ipv4->GetInterfaceForDevice(link.Get(i));
+        if (interface < 0)
+        {
+            continue;
+        }
+        if (up)
+        {
+            ipv4->SetUp(interface);
+        }
+        else
+        {
+            ipv4->SetDown(interface);
+        }
+    }
+}
+
+// Split a client's RTT samples by whether they were sent inside any window
+static void
+SplitRttByWindows(Ptr<TelemetryClient> client, const std::vector<std::pair<Time, Time> >& windows,
+                  SampleStats& inside, SampleStats& outside)
+{
+    const std::vector<TelemetryClient::RttSample>& samples = client->GetRttSamples();
+    for (uint32_t i = 0; i < samples.size(); ++i)
+    {
+        bool within = false;
+        for (uint32_t w = 0; w < windows.size() && !within; ++w)
+        {
+            within = samples[i].sent >= windows[w].first.GetSeconds()
+                     && samples[i].sent <= windows[w].second.GetSeconds();
+        }
+        (within ? inside : outside).Add(samples[i].rtt);
+    }
+}
+
+// ============================================================================
+// SOLAR POWER
+// ============================================================================
+//
+// Battery model of a site, in units of the site's own load: the load draws
+// 1 per hour, a full battery holds batteryHours and the panels deliver
+// pvRatio x sin() over a 06:00-18:00 day, scaled by that day's cloud cover.
+// When the battery runs flat the low-voltage disconnect cuts the site off;
+// it reconnects once the panels have recharged the battery to
+// reconnectLevel of its capacity, which is what lines the recoveries up
+// shortly after sunrise. Simulated time is mapped onto the day through
+// dayLength (seconds per modelled day).
+//
+// The network does not feed back into the battery, so the outage windows of
+// every site are worked out before the run and scheduled like any other
+// outage.
+
+struct SolarModel
+{
+    double dayLength;           // Simulated seconds per modelled day
+    double startHour;           // Hour of day at t = 0
+    double pvRatio;             // Peak panel output over load
+    double batteryHours;        // Mean battery capacity in hours of load
+    double cloudyProbability;   // Probability that a site's day is overcast
+    double reconnectLevel;      // Fraction of capacity needed to reconnect
+};
+
+static std::vector<SiteOutage>
+SimulateSolarOutages(const std::string& siteClass, uint32_t count, const SolarModel& model,
+                     double duration, Ptr<UniformRandomVariable> rng)
+{
+    const double pi = 3.14159265358979323846;
+    const double step = model.dayLength / 1440.0;           // One modelled minute
+    const double hoursPerStep = 24.0 / 1440.0;
+    uint32_t days = static_cast<uint32_t>(std::ceil((model.startHour / 24.0) + duration / model.dayLength)) + 1;
+
+    std::vector<SiteOutage> outages;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        std::vector<double> sun(days);
+        for (uint32_t d = 0; d < days; ++d)
+        {
+            sun[d] = rng->GetValue() < model.cloudyProbability ? rng->GetValue(0.1, 0.4) : rng->GetValue(0.8, 1.0);
+        }
+        double capacity = model.batteryHours * rng->GetValue(0.7, 1.3);
+        double charge = capacity * rng->GetValue(0.2, 0.8);
+        bool on = true;
+        SiteOutage outage;
+        outage.site.siteClass = siteClass;
+        outage.site.index = i;
+        outage.start = 0.0;
+        outage.end = 0.0;
+        for (double t = 0.0; t < duration; t += step)
+        {
+            double hours = model.startHour + t / model.dayLength * 24.0;
+            double hour = std::fmod(hours, 24.0);
+            uint32_t day = static_cast<uint32_t>(hours / 24.0);
+            double pv = (hour > 6.0 && hour < 18.0) ? model.pvRatio * std::sin(pi * (hour - 6.0) / 12.0) * sun[day] : 0.0;
+            if (on)
+            {
+                charge = std::min(capacity, charge + (pv - 1.0) * hoursPerStep);
+                if (charge <= 0.0)
+                {
+                    charge = 0.0;
+                    on = false;
+                    outage.start = t;
+                }
+            }
+            else
+            {
+                charge = std::min(capacity, charge + pv * hoursPerStep);
+                if (charge >= model.reconnectLevel * capacity)
+                {
+                    on = true;
+                    outage.end = t;
+                    outages.push_back(outage);
+                }
+            }
+        }
+        if (!on)
+        {
+            // Still dark when the run ends
+            outage.end = duration + step;
+            outages.push_back(outage);
+        }
+    }
+    return outages;
+}
+
+// Cut or restore a site's power: its access link and every application on
+// the site that runs on the site's own power
+static void
+SetSitePower(Ptr<Node> node, NetDeviceContainer link, bool on)
+{
+    SetLinkState(link, on);
+    for (uint32_t a = 0; a < node->GetNApplications(); ++a)
+    {
+        Ptr<SiteApplication> app = DynamicCast<SiteApplication>(node->GetApplication(a));
+        if (app)
+        {
+            app->SetPowered(on);
+        }
+    }
+}
+
+// ============================================================================
+// LINK WEATHER
+// ============================================================================
+//
+// Capacity timeline of the access links. A change sets a site's link to a
+// fraction of its nominal rate, or to an absolute rate for the site's
+// uplink direction; either way both directions scale by the same fraction,
+// so asymmetric links stay asymmetric.
+// Changes come from a file with one "<time_s> <class:n> <factor|rate>" line
+// each ('#' starts a comment), e.g.
+//   12.5 school:2 0.25
+//   20   school:2 50Mbps
+// or from a rain process: fades arrive on each link independently with an
+// exponential gap, last an exponential time and cut the link to a random
+// fraction between minFactor and 0.75 of its rate (adaptive modulation
+// stepping down), after which the link is back at full rate.
+
+struct CapacityChange
+{
+    SiteRef site;
+    double time;
+    double factor;          // Fraction of the nominal rate, used when rate is empty
+    std::string rate;
+};
+
+static std::vector<CapacityChange>
+ReadCapacityFile(const std::string& fileName)
+{
+    std::ifstream in(fileName.c_str());
+    NS_ABORT_MSG_IF(!in, "Cannot open capacity file " << fileName);
+    std::vector<CapacityChange> changes;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string site, value;
+        CapacityChange change;
+        if (!(fields >> change.time))
+        {
+            continue;
+        }
+        NS_ABORT_MSG_IF(!(fields >> site >> value), "Malformed capacity line: " << line);
+        change.site = ParseSiteRef(site);
+        change.factor = 0.0;
+        if (value.find("bps") != std::string::npos)
+        {
+            change.rate = value;
+        }
+        else
+        {
+            change.factor = std::atof(value.c_str());
+            NS_ABORT_MSG_IF(change.factor <= 0.0, "Capacity factor must be positive: " << line);
+        }
+        changes.push_back(change);
+    }
+    return changes;
+}
+
+static std::vector<CapacityChange>
+SimulateRainFades(const std::string& siteClass, uint32_t count, double meanGap, double meanFade,
+                  double minFactor, double duration, Ptr<UniformRandomVariable> depth,
+                  Ptr<ExponentialRandomVariable> timing)
+{
+    std::vector<CapacityChange> changes;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        CapacityChange change;
+        change.site.siteClass = siteClass;
+        change.site.index = i;
+        double t = timing->GetValue(meanGap, 10.0 * meanGap);
+        while (t < duration)
+        {
+            change.time = t;
+            change.factor = depth->GetValue(minFactor, 0.75);
+            changes.push_back(change);
+            t += timing->GetValue(meanFade, 10.0 * meanFade);
+            change.time = t;
+            change.factor = 1.0;
+            changes.push_back(change);
+            t += timing->GetValue(meanGap, 10.0 * meanGap);
+        }
+    }
+    return changes;
+}
+
+// Fraction of nominal capacity at time t on a sorted (time, fraction) timeline
+static double
+CapacityFactorAt(const std::vector<std::pair<double, double> >& timeline, double t)
+{
+    double factor = 1.0;
+    for (uint32_t i = 0; i < timeline.size() && timeline[i].first <= t; ++i)
+    {
+        factor = timeline[i].second;
+    }
+    return factor;
+}
+
+static void
+SetDeviceRate(Ptr<NetDevice> device, DataRate rate)
+{
+    DynamicCast<PointToPointNetDevice>(device)->SetDataRate(rate);
+}
+
+// Bytes received per fixed-width time bin
+struct ThroughputBins
+{
+    double width;
+    std::vector<uint64_t> bytes;
+};
+
+static void
+CountBinBytes(ThroughputBins* bins, Ptr<const Packet> packet)
+{
+    uint32_t bin = static_cast<uint32_t>(Simulator::Now().GetSeconds() / bins->width);
+    if (bin < bins->bytes.size())
+    {
+        bins->bytes[bin] += packet->GetSize();
+    }
+}
+
+// ============================================================================
+// LINK ERRORS
+// ============================================================================
+//
+// Gilbert-Elliott burst loss: a two-state Markov chain stepped once per
+// packet. The link moves from good to bad with probability pGoodBad and
+// back with pBadGood, and loses a packet with lossGood or lossBad depending
+// on the state it is in. The mean burst (time in the bad state) is
+// 1 / pBadGood packets.
+
+class GilbertElliottErrorModel : public ErrorModel
+{
+public:
+    static TypeId GetTypeId(void);
+
+    GilbertElliottErrorModel();
+
+    void Setup(double pGoodBad, double pBadGood, double lossGood, double lossBad);
+
+private:
+    virtual bool DoCorrupt(Ptr<Packet> packet);
+    virtual void DoReset(void);
+
+    double m_pGoodBad;
+    double m_pBadGood;
+    double m_lossGood;
+    double m_lossBad;
+    bool m_bad;
+    Ptr<UniformRandomVariable> m_rng;
+};
+
+TypeId
+GilbertElliottErrorModel::GetTypeId(void)
+{
+    static TypeId tid = TypeId("GilbertElliottErrorModel")
+        .SetParent<ErrorModel>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<GilbertElliottErrorModel>();
+    return tid;
+}
+
+GilbertElliottErrorModel::GilbertElliottErrorModel()
+    : m_pGoodBad(0.0),
+      m_pBadGood(1.0),
+      m_lossGood(0.0),
+      m_lossBad(0.0),
+      m_bad(false)
+{
+    m_rng = CreateObject<UniformRandomVariable>();
+}
+
+void
+GilbertElliottErrorModel::Setup(double pGoodBad, double pBadGood, double lossGood, double lossBad)
+{
+    m_pGoodBad = pGoodBad;
+    m_pBadGood = pBadGood;
+    m_lossGood = lossGood;
+    m_lossBad = lossBad;
+}
+
+bool
+GilbertElliottErrorModel::DoCorrupt(Ptr<Packet> /* packet */)
+{
+    m_bad = m_bad ? m_rng->GetValue() >= m_pBadGood : m_rng->GetValue() < m_pGoodBad;
+    return m_rng->GetValue() < (m_bad ? m_lossBad : m_lossGood);
+}
+
+void
+GilbertElliottErrorModel::DoReset(void)
+{
+    m_bad = false;
+}
+
+// Frames and bytes discarded by a receive error model
+struct ErrorLoss
+{
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+static void
+CountErrorLoss(ErrorLoss* loss, Ptr<const Packet> packet)
+{
+    ++loss->packets;
+    loss->bytes += packet->GetSize();
+}
+
+// ============================================================================
+// SATELLITE BACKHAUL
+// ============================================================================
+//
+// Access link for schools beyond terrestrial reach. Rates are asymmetric
+// (the school's uplink is the narrow side) and the one-way delay is redrawn
+// every period within [baseDelay, baseDelay + delaySpread]: small jitter
+// every second for GEO, a new path at each handover (about every 15 s) for
+// LEO. A shorter delay after a handover can reorder packets in flight, as a
+// real handover does.
+
+struct SatelliteProfile
+{
+    std::string uplink;         // School -> ground station
+    std::string downlink;       // Ground station -> school
+    double baseDelay;           // ms, one way
+    double delaySpread;         // ms
+    double period;              // s between delay changes
+};
+
+static SatelliteProfile
+GetSatelliteProfile(const std::string& type)
+{
+    SatelliteProfile geo = { "2Mbps", "10Mbps", 270.0, 30.0, 1.0 };
+    SatelliteProfile leo = { "10Mbps", "50Mbps", 20.0, 30.0, 15.0 };
+    return type == "leo" ? leo : geo;
+}
+
+static void
+VarySatelliteDelay(Ptr<PointToPointChannel> channel, SatelliteProfile profile, Ptr<UniformRandomVariable> rng)
+{
+    double delay = profile.baseDelay + rng->GetValue(0.0, profile.delaySpread);
+    channel->SetAttribute("Delay", TimeValue(MilliSeconds(delay)));
+    Simulator::Schedule(Seconds(profile.period), &VarySatelliteDelay, channel, profile, rng);
+}
+
+// ============================================================================
+// BULK UPLOADS
+// ============================================================================
+//
+// Bulk TCP transfers (log uploads, backups) are sent with BulkSend to a
+// PacketSink on the central station. The sink's Rx trace is used to work out
+// when each sender's transfer has been fully received.
+
+struct BulkTransferTracker
+{
+    uint64_t target;                          // Bytes per transfer
+    std::map<Ipv4Address, uint64_t> received;
+    std::map<Ipv4Address, Time> completed;
+};
+
+static void
+TrackBulkRx(BulkTransferTracker* tracker, Ptr<const Packet> packet, const Address& from)
+{
+    Ipv4Address sender = InetSocketAddress::ConvertFrom(from).GetIpv4();
+    uint64_t& received = tracker->received[sender];
+    received += packet->GetSize();
+    if (received >= tracker->target && tracker->completed.find(sender) == tracker->completed.end())
+    {
+        tracker->completed[sender] = Simulator::Now();
+    }
+}
+
+// ============================================================================
+// TELEMEDICINE VIDEO
+// ============================================================================
+//
+// Teleconsultation video from the clinics. Frames follow a GOP pattern such
+// as "IBBPBBPBBPBB"; frame sizes scale with the frame type (I:P:B = 5:2:1),
+// with log-normal variation, so the mean matches the configured bit rate.
+// Each frame is cut into datagrams that leave back-to-back at capture time,
+// which reproduces the bursty arrival of real encoders. The receiver
+// reassembles frames and counts a frame as lost if any fragment is missing
+// or it completes after the playout deadline. Frames still incomplete at the
+// deadline are dropped from reassembly and counted as late, and stragglers
+// for them are discarded.
+
+class VideoHeader : public Header
+{
+public:
+    VideoHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetSession(uint32_t session);
+    uint32_t GetSession(void) const;
+    void SetFrame(uint32_t frame, char frameType);
+    uint32_t GetFrame(void) const;
+    char GetFrameType(void) const;
+    void SetFragment(uint16_t index, uint16_t count);
+    uint16_t GetFragmentIndex(void) const;
+    uint16_t GetFragmentCount(void) const;
+    void SetCaptureTime(Time t);
+    Time GetCaptureTime(void) const;
+
+private:
+    uint32_t m_session;
+    uint32_t m_frame;
+    uint8_t m_frameType;
+    uint16_t m_fragIndex;
+    uint16_t m_fragCount;
+    uint64_t m_captureTs;
+};
+
+VideoHeader::VideoHeader()
+    : m_session(0),
+      m_frame(0),
+      m_frameType('P'),
+      m_fragIndex(0),
+      m_fragCount(1),
+      m_captureTs(0)
+{
+}
+
+TypeId
+VideoHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("VideoHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<VideoHeader>();
+    return tid;
+}
+
+TypeId
+VideoHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+VideoHeader::GetSerializedSize(void) const
+{
+    return 4 + 4 + 1 + 2 + 2 + 8;
+}
+
+void
+VideoHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteHtonU32(m_session);
+    i.WriteHtonU32(m_frame);
+    i.WriteU8(m_frameType);
+    i.WriteHtonU16(m_fragIndex);
+    i.WriteHtonU16(m_fragCount);
+    i.WriteHtonU64(m_captureTs);
+}
+
+uint32_t
+VideoHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_session = i.ReadNtohU32();
+    m_frame = i.ReadNtohU32();
+    m_frameType = i.ReadU8();
+    m_fragIndex = i.ReadNtohU16();
+    m_fragCount = i.ReadNtohU16();
+    m_captureTs = i.ReadNtohU64();
+    return GetSerializedSize();
+}
+
+void
+VideoHeader::Print(std::ostream& os) const
+{
+    os << "session=" << m_session << " frame=" << m_frame << " (" << char(m_frameType) << ") frag="
+       << m_fragIndex << "/" << m_fragCount;
+}
+
+void
+VideoHeader::SetSession(uint32_t session)
+{
+    m_session = session;
+}
+
+uint32_t
+VideoHeader::GetSession(void) const
+{
+    return m_session;
+}
+
+void
+VideoHeader::SetFrame(uint32_t frame, char frameType)
+{
+    m_frame = frame;
+    m_frameType = frameType;
+}
+
+uint32_t
+VideoHeader::GetFrame(void) const
+{
+    return m_frame;
+}
+
+char
+VideoHeader::GetFrameType(void) const
+{
+    return m_frameType;
+}
+
+void
+VideoHeader::SetFragment(uint16_t index, uint16_t count)
+{
+    m_fragIndex = index;
+    m_fragCount = count;
+}
+
+uint16_t
+VideoHeader::GetFragmentIndex(void) const
+{
+    return m_fragIndex;
+}
+
+uint16_t
+VideoHeader::GetFragmentCount(void) const
+{
+    return m_fragCount;
+}
+
+void
+VideoHeader::SetCaptureTime(Time t)
+{
+    m_captureTs = t.GetTimeStep();
+}
+
+Time
+VideoHeader::GetCaptureTime(void) const
+{
+    return TimeStep(m_captureTs);
+}
+
+class VideoSender : public SiteApplication
+{
+public:
+    static TypeId GetTypeId(void);
+
+    VideoSender();
+    virtual ~VideoSender();
+
+    void Setup(Address peer, uint32_t session, DataRate bitRate, double fps,
+               const std::string& gop, uint32_t maxPayload);
+
+    uint32_t GetFramesSent(void) const;
+    uint64_t GetBytesSent(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void SendFrame(void);
+    static double FrameWeight(char frameType);
+
+    Ptr<Socket> m_socket;
+    Address m_peer;
+    uint32_t m_session;
+    double m_fps;
+    std::string m_gop;
+    uint32_t m_maxPayload;
+    double m_unitBytes;                   // Size of a weight-1 (B) frame
+    Ptr<LogNormalRandomVariable> m_sizeNoise;
+    EventId m_frameEvent;
+    uint32_t m_frame;
+    uint64_t m_bytesSent;
+};
+
+TypeId
+VideoSender::GetTypeId(void)
+{
+    static TypeId tid = TypeId("VideoSender")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<VideoSender>();
+    return tid;
+}
+
+VideoSender::VideoSender()
+    : m_socket(0),
+      m_session(0),
+      m_fps(25.0),
+      m_gop("IBBPBBPBBPBB"),
+      m_maxPayload(1400),
+      m_unitBytes(0.0),
+      m_frame(0),
+      m_bytesSent(0)
+{
+    m_sizeNoise = CreateObject<LogNormalRandomVariable>();
+}
+
+VideoSender::~VideoSender()
+{
+    m_socket = 0;
+}
+
+double
+VideoSender::FrameWeight(char frameType)
+{
+    return frameType == 'I' ? 5.0 : frameType == 'P' ? 2.0 : 1.0;
+}
+
+void
+VideoSender::Setup(Address peer, uint32_t session, DataRate bitRate, double fps,
+                   const std::string& gop, uint32_t maxPayload)
+{
+    NS_ABORT_MSG_IF(gop.empty(), "Empty GOP pattern");
+    m_peer = peer;
+    m_session = session;
+    m_fps = fps;
+    m_gop = gop;
+    m_maxPayload = maxPayload;
+
+    double gopWeight = 0.0;
+    for (uint32_t i = 0; i < gop.size(); ++i)
+    {
+        gopWeight += FrameWeight(gop[i]);
+    }
+    double gopBytes = bitRate.GetBitRate() / 8.0 / fps * gop.size();
+    m_unitBytes = gopBytes / gopWeight;
+}
+
+uint32_t
+VideoSender::GetFramesSent(void) const
+{
+    return m_frame;
+}
+
+uint64_t
+VideoSender::GetBytesSent(void) const
+{
+    return m_bytesSent;
+}
+
+void
+VideoSender::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->Connect(m_peer);
+    }
+    SendFrame();
+}
+
+void
+VideoSender::StopApplication(void)
+{
+    Simulator::Cancel(m_frameEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+    }
+}
+
+void
+VideoSender::SendFrame(void)
+{
+    m_frameEvent = Simulator::Schedule(Seconds(1.0 / m_fps), &VideoSender::SendFrame, this);
+    if (!IsPowered())
+    {
+        return;
+    }
+
+    char frameType = m_gop[m_frame % m_gop.size()];
+    // Log-normal noise with unit mean (mu = -sigma^2 / 2)
+    const double sigma = 0.25;
+    double noise = m_sizeNoise->GetValue(-sigma * sigma / 2.0, sigma);
+    uint32_t frameBytes = std::max<uint32_t>(1, FrameWeight(frameType) * m_unitBytes * noise);
+    uint16_t fragments = (frameBytes + m_maxPayload - 1) / m_maxPayload;
+
+    for (uint16_t f = 0; f < fragments; ++f)
+    {
+        uint32_t payload = std::min<uint32_t>(m_maxPayload, frameBytes - f * m_maxPayload);
+        VideoHeader header;
+        header.SetSession(m_session);
+        header.SetFrame(m_frame, frameType);
+        header.SetFragment(f, fragments);
+        header.SetCaptureTime(Simulator::Now());
+        Ptr<Packet> packet = Create<Packet>(payload);
+        packet->AddHeader(header);
+        m_socket->Send(packet);
+        m_bytesSent += payload;
+    }
+    ++m_frame;
+}
+
+class VideoReceiver : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    VideoReceiver();
+    virtual ~VideoReceiver();
+
+    void Setup(uint16_t port, Time deadline);
+
+    uint32_t GetFramesOnTime(uint32_t session) const;
+    uint32_t GetFramesLate(uint32_t session) const;
+    const SampleStats& GetFrameLatency(uint32_t session) const;
+
+private:
+    struct FrameState
+    {
+        FrameState() : fragments(0) {}
+        uint16_t fragments;
+        Time capture;
+    };
+
+    struct SessionState
+    {
+        SessionState() : expired(0), onTime(0), late(0) {}
+        std::map<uint32_t, FrameState> partial;   // Frames still being reassembled
+        uint32_t expired;                          // Frames below this id are past the deadline
+        uint32_t onTime;
+        uint32_t late;
+        SampleStats latency;                       // ms, complete frames
+    };
+
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+    const SessionState* FindSession(uint32_t session) const;
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+    Time m_deadline;
+    std::map<uint32_t, SessionState> m_sessions;
+    SampleStats m_empty;
+};
+
+TypeId
+VideoReceiver::GetTypeId(void)
+{
+    static TypeId tid = TypeId("VideoReceiver")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<VideoReceiver>();
+    return tid;
+}
+
+VideoReceiver::VideoReceiver()
+    : m_socket(0),
+      m_port(0),
+      m_deadline(MilliSeconds(150))
+{
+}
+
+VideoReceiver::~VideoReceiver()
+{
+    m_socket = 0;
+}
+
+void
+VideoReceiver::Setup(uint16_t port, Time deadline)
+{
+    m_port = port;
+    m_deadline = deadline;
+}
+
+const VideoReceiver::SessionState*
+VideoReceiver::FindSession(uint32_t session) const
+{
+    std::map<uint32_t, SessionState>::const_iterator it = m_sessions.find(session);
+    return it == m_sessions.end() ? 0 : &it->second;
+}
+
+uint32_t
+VideoReceiver::GetFramesOnTime(uint32_t session) const
+{
+    const SessionState* state = FindSession(session);
+    return state ? state->onTime : 0;
+}
+
+uint32_t
+VideoReceiver::GetFramesLate(uint32_t session) const
+{
+    const SessionState* state = FindSession(session);
+    return state ? state->late : 0;
+}
+
+const SampleStats&
+VideoReceiver::GetFrameLatency(uint32_t session) const
+{
+    const SessionState* state = FindSession(session);
+    return state ? state->latency : m_empty;
+}
+
+void
+VideoReceiver::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&VideoReceiver::HandleRead, this));
+    }
+}
+
+void
+VideoReceiver::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+VideoReceiver::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        VideoHeader header;
+        packet->RemoveHeader(header);
+        SessionState& session = m_sessions[header.GetSession()];
+
+        // Give up on frames that can no longer make their playout deadline.
+        // Frame ids grow with capture time, so the oldest entries go first.
+        std::map<uint32_t, FrameState>::iterator it = session.partial.begin();
+        while (it != session.partial.end() && Simulator::Now() - it->second.capture > m_deadline)
+        {
+            session.expired = it->first + 1;
+            ++session.late;
+            session.partial.erase(it++);
+        }
+        if (header.GetFrame() < session.expired)
+        {
+            continue;
+        }
+
+        FrameState& frame = session.partial[header.GetFrame()];
+        if (frame.fragments == 0)
+        {
+            frame.capture = header.GetCaptureTime();
+        }
+        if (++frame.fragments < header.GetFragmentCount())
+        {
+            continue;
+        }
+
+        Time latency = Simulator::Now() - frame.capture;
+        session.latency.Add(latency.GetSeconds() * 1000.0);
+        if (latency <= m_deadline)
+        {
+            ++session.onTime;
+        }
+        else
+        {
+            ++session.late;
+        }
+        session.partial.erase(header.GetFrame());
+    }
+}
+
+// ============================================================================
+// DEMAND RESPONSE
+// ============================================================================
+//
+// The central station periodically issues a curtailment command to every
+// micro-grid controller. Each controller applies it after a fixed actuation
+// delay and acknowledges; unacknowledged controllers are re-sent the command
+// after a retry timeout. Per round the controller records when the last
+// acknowledgement arrived and how many sites acknowledged within the
+// deadline.
+
+class DemandResponseHeader : public Header
+{
+public:
+    enum MessageType
+    {
+        COMMAND = 1,
+        ACK = 2
+    };
+
+    DemandResponseHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetType(MessageType type);
+    MessageType GetType(void) const;
+    void SetCommand(uint32_t command);
+    uint32_t GetCommand(void) const;
+    void SetCurtailment(uint16_t percent);
+    uint16_t GetCurtailment(void) const;
+
+private:
+    uint8_t m_type;
+    uint32_t m_command;
+    uint16_t m_curtailment;   // Requested load reduction (%)
+};
+
+DemandResponseHeader::DemandResponseHeader()
+    : m_type(COMMAND),
+      m_command(0),
+      m_curtailment(0)
+{
+}
+
+TypeId
+DemandResponseHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("DemandResponseHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<DemandResponseHeader>();
+    return tid;
+}
+
+TypeId
+DemandResponseHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+DemandResponseHeader::GetSerializedSize(void) const
+{
+    return 1 + 4 + 2;
+}
+
+void
+DemandResponseHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteU8(m_type);
+    i.WriteHtonU32(m_command);
+    i.WriteHtonU16(m_curtailment);
+}
+
+uint32_t
+DemandResponseHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_type = i.ReadU8();
+    m_command = i.ReadNtohU32();
+    m_curtailment = i.ReadNtohU16();
+    return GetSerializedSize();
+}
+
+void
+DemandResponseHeader::Print(std::ostream& os) const
+{
+    os << (m_type == COMMAND ? "COMMAND " : "ACK ") << m_command << " curtail=" << m_curtailment << "%";
+}
+
+void
+DemandResponseHeader::SetType(MessageType type)
+{
+    m_type = type;
+}
+
+DemandResponseHeader::MessageType
+DemandResponseHeader::GetType(void) const
+{
+    return static_cast<MessageType>(m_type);
+}
+
+void
+DemandResponseHeader::SetCommand(uint32_t command)
+{
+    m_command = command;
+}
+
+uint32_t
+DemandResponseHeader::GetCommand(void) const
+{
+    return m_command;
+}
+
+void
+DemandResponseHeader::SetCurtailment(uint16_t percent)
+{
+    m_curtailment = percent;
+}
+
+uint16_t
+DemandResponseHeader::GetCurtailment(void) const
+{
+    return m_curtailment;
+}
+
+class DemandResponseController : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    DemandResponseController();
+    virtual ~DemandResponseController();
+
+    void Setup(const std::vector<Address>& targets, Time interval, Time deadline, Time retry);
+
+    uint32_t GetRounds(void) const;
+    uint32_t GetRetransmissions(void) const;
+    const SampleStats& GetTimeToAllAcked(void) const;
+    const SampleStats& GetAckLatency(void) const;
+    const SampleStats& GetReachedWithinDeadline(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void IssueCommand(void);
+    void CloseRound(void);
+    void Retry(void);
+    void SendCommand(uint32_t target);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    std::vector<Address> m_targets;
+    Time m_interval;
+    Time m_deadline;
+    Time m_retry;
+    EventId m_issueEvent;
+    EventId m_retryEvent;
+    Ptr<UniformRandomVariable> m_curtailmentRng;
+
+    uint32_t m_command;         // Current round
+    uint16_t m_curtailment;
+    Time m_issued;
+    std::vector<bool> m_acked;
+    uint32_t m_ackCount;
+    uint32_t m_withinDeadline;
+    bool m_roundClosed;
+
+    uint32_t m_rounds;
+    uint32_t m_retransmissions;
+    SampleStats m_timeToAllAcked;   // ms
+    SampleStats m_ackLatency;       // ms, command to acknowledged actuation
+    SampleStats m_reached;          // % of sites acked within the deadline
+};
+
+TypeId
+DemandResponseController::GetTypeId(void)
+{
+    static TypeId tid = TypeId("DemandResponseController")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<DemandResponseController>();
+    return tid;
+}
+
+DemandResponseController::DemandResponseController()
+    : m_socket(0),
+      m_command(0),
+      m_curtailment(0),
+      m_ackCount(0),
+      m_withinDeadline(0),
+      m_roundClosed(true),
+      m_rounds(0),
+      m_retransmissions(0)
+{
+    m_curtailmentRng = CreateObject<UniformRandomVariable>();
+}
+
+DemandResponseController::~DemandResponseController()
+{
+    m_socket = 0;
+}
+
+void
+DemandResponseController::Setup(const std::vector<Address>& targets, Time interval,
+                                Time deadline, Time retry)
+{
+    m_targets = targets;
+    m_interval = interval;
+    m_deadline = deadline;
+    m_retry = retry;
+}
+
+uint32_t
+DemandResponseController::GetRounds(void) const
+{
+    return m_rounds;
+}
+
+uint32_t
+DemandResponseController::GetRetransmissions(void) const
+{
+    return m_retransmissions;
+}
+
+const SampleStats&
+DemandResponseController::GetTimeToAllAcked(void) const
+{
+    return m_timeToAllAcked;
+}
+
+const SampleStats&
+DemandResponseController::GetAckLatency(void) const
+{
+    return m_ackLatency;
+}
+
+const SampleStats&
+DemandResponseController::GetReachedWithinDeadline(void) const
+{
+    return m_reached;
+}
+
+void
+DemandResponseController::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->SetRecvCallback(MakeCallback(&DemandResponseController::HandleRead, this));
+    }
+    IssueCommand();
+}
+
+void
+DemandResponseController::StopApplication(void)
+{
+    Simulator::Cancel(m_issueEvent);
+    Simulator::Cancel(m_retryEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+DemandResponseController::IssueCommand(void)
+{
+    CloseRound();
+    if (m_targets.empty())
+    {
+        return;
+    }
+    ++m_rounds;
+    ++m_command;
+    m_curtailment = m_curtailmentRng->GetInteger(10, 50);
+    m_issued = Simulator::Now();
+    m_acked.assign(m_targets.size(), false);
+    m_ackCount = 0;
+    m_withinDeadline = 0;
+    m_roundClosed = false;
+    for (uint32_t t = 0; t < m_targets.size(); ++t)
+    {
+        SendCommand(t);
+    }
+    Simulator::Cancel(m_retryEvent);
+    m_retryEvent = Simulator::Schedule(m_retry, &DemandResponseController::Retry, this);
+    m_issueEvent = Simulator::Schedule(m_interval, &DemandResponseController::IssueCommand, this);
+}
+
+void
+DemandResponseController::CloseRound(void)
+{
+    // Called when the last site acknowledges, or when the next command is
+    // issued before that happened; a round cut off by the end of the run is
+    // not counted
+    if (!m_roundClosed)
+    {
+        m_reached.Add(100.0 * m_withinDeadline / m_targets.size());
+        m_roundClosed = true;
+    }
+}
+
+void
+DemandResponseController::Retry(void)
+{
+    if (m_ackCount == m_targets.size())
+    {
+        return;
+    }
+    for (uint32_t t = 0; t < m_targets.size(); ++t)
+    {
+        if (!m_acked[t])
+        {
+            SendCommand(t);
+            ++m_retransmissions;
+        }
+    }
+    m_retryEvent = Simulator::Schedule(m_retry, &DemandResponseController::Retry, this);
+}
+
+void
+DemandResponseController::SendCommand(uint32_t target)
+{
+    DemandResponseHeader header;
+    header.SetType(DemandResponseHeader::COMMAND);
+    header.SetCommand(m_command);
+    header.SetCurtailment(m_curtailment);
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(header);
+    m_socket->SendTo(packet, 0, m_targets[target]);
+}
+
+void
+DemandResponseController::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        DemandResponseHeader header;
+        packet->RemoveHeader(header);
+        if (header.GetType() != DemandResponseHeader::ACK || header.GetCommand() != m_command)
+        {
+            continue; // Stale acknowledgement from an earlier round
+        }
+        for (uint32_t t = 0; t < m_targets.size(); ++t)
+        {
+            if (m_targets[t] != from || m_acked[t])
+            {
+                continue;
+            }
+            m_acked[t] = true;
+            ++m_ackCount;
+            Time latency = Simulator::Now() - m_issued;
+            m_ackLatency.Add(latency.GetSeconds() * 1000.0);
+            if (latency <= m_deadline)
+            {
+                ++m_withinDeadline;
+            }
+            if (m_ackCount == m_targets.size())
+            {
+                m_timeToAllAcked.Add(latency.GetSeconds() * 1000.0);
+                Simulator::Cancel(m_retryEvent);
+                CloseRound();
+            }
+            break;
+        }
+    }
+}
+
+// Micro-grid side: applies each command after the actuation delay, then
+// acknowledges it (again, if the command is repeated)
+class DemandResponseAgent : public SiteApplication
+{
+public:
+    static TypeId GetTypeId(void);
+
+    DemandResponseAgent();
+    virtual ~DemandResponseAgent();
+
+    void Setup(uint16_t port, Time actuationDelay);
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+    void Acknowledge(uint32_t command, Address controller);
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+    Time m_actuationDelay;
+    uint32_t m_applied;      // Last command applied
+};
+
+TypeId
+DemandResponseAgent::GetTypeId(void)
+{
+    static TypeId tid = TypeId("DemandResponseAgent")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<DemandResponseAgent>();
+    return tid;
+}
+
+DemandResponseAgent::DemandResponseAgent()
+    : m_socket(0),
+      m_port(0),
+      m_applied(0)
+{
+}
+
+DemandResponseAgent::~DemandResponseAgent()
+{
+    m_socket = 0;
+}
+
+void
+DemandResponseAgent::Setup(uint16_t port, Time actuationDelay)
+{
+    m_port = port;
+    m_actuationDelay = actuationDelay;
+}
+
+void
+DemandResponseAgent::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&DemandResponseAgent::HandleRead, this));
+    }
+}
+
+void
+DemandResponseAgent::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+DemandResponseAgent::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        DemandResponseHeader header;
+        packet->RemoveHeader(header);
+        if (header.GetType() != DemandResponseHeader::COMMAND)
+        {
+            continue;
+        }
+        // A repeated command that was already applied is acknowledged at once
+        Time delay = (header.GetCommand() == m_applied) ? Seconds(0.0) : m_actuationDelay;
+        Simulator::Schedule(delay, &DemandResponseAgent::Acknowledge, this, header.GetCommand(), from);
+    }
+}
+
+void
+DemandResponseAgent::Acknowledge(uint32_t command, Address controller)
+{
+    if (!IsPowered())
+    {
+        return;
+    }
+    m_applied = std::max(m_applied, command);
+    DemandResponseHeader header;
+    header.SetType(DemandResponseHeader::ACK);
+    header.SetCommand(command);
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(header);
+    m_socket->SendTo(packet, 0, controller);
+}
+
+// ============================================================================
+// PEER-TO-PEER ENERGY TRADING
+// ============================================================================
+//
+// Community micro-grids trade surplus energy in periodic market rounds. At
+// each gate closure every trader sends its order (offer of surplus or bid
+// for energy, with a limit price) to every other trader. Once a trader holds
+// the orders of all peers for a round it clears the market locally with a
+// uniform-price double auction: all matched energy changes hands at one
+// price, the midpoint of the last matched bid and offer. Every trader
+// reaches the same result, so the round is cleared when the last trader
+// has heard from all its peers. A round still missing orders at the next
+// gate closure is cleared with the orders received so far, and orders that
+// turn up after that are dropped.
+
+class TradeHeader : public Header
+{
+public:
+    enum Side
+    {
+        OFFER = 1,
+        BID = 2
+    };
+
+    TradeHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetOrder(uint32_t round, uint32_t trader, Side side, uint32_t quantityWh, uint32_t price);
+    uint32_t GetRound(void) const;
+    uint32_t GetTrader(void) const;
+    Side GetSide(void) const;
+    uint32_t GetQuantity(void) const;
+    uint32_t GetPrice(void) const;
+    void SetSendTime(Time t);
+    Time GetSendTime(void) const;
+
+private:
+    uint32_t m_round;
+    uint32_t m_trader;
+    uint8_t m_side;
+    uint32_t m_quantity;   // Wh
+    uint32_t m_price;      // Price per kWh, in thousandths of a currency unit
+    uint64_t m_sendTs;
+};
+
+TradeHeader::TradeHeader()
+    : m_round(0),
+      m_trader(0),
+      m_side(OFFER),
+      m_quantity(0),
+      m_price(0),
+      m_sendTs(0)
+{
+}
+
+TypeId
+TradeHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("TradeHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<TradeHeader>();
+    return tid;
+}
+
+TypeId
+TradeHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+TradeHeader::GetSerializedSize(void) const
+{
+    return 4 + 4 + 1 + 4 + 4 + 8;
+}
+
+void
+TradeHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteHtonU32(m_round);
+    i.WriteHtonU32(m_trader);
+    i.WriteU8(m_side);
+    i.WriteHtonU32(m_quantity);
+    i.WriteHtonU32(m_price);
+    i.WriteHtonU64(m_sendTs);
+}
+
+uint32_t
+TradeHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_round = i.ReadNtohU32();
+    m_trader = i.ReadNtohU32();
+    m_side = i.ReadU8();
+    m_quantity = i.ReadNtohU32();
+    m_price = i.ReadNtohU32();
+    m_sendTs = i.ReadNtohU64();
+    return GetSerializedSize();
+}
+
+void
+TradeHeader::Print(std::ostream& os) const
+{
+    os << "round=" << m_round << " trader=" << m_trader << (m_side == OFFER ? " OFFER " : " BID ")
+       << m_quantity << "Wh @" << m_price;
+}
+
+void
+TradeHeader::SetOrder(uint32_t round, uint32_t trader, Side side, uint32_t quantityWh, uint32_t price)
+{
+    m_round = round;
+    m_trader = trader;
+    m_side = side;
+    m_quantity = quantityWh;
+    m_price = price;
+}
+
+uint32_t
+TradeHeader::GetRound(void) const
+{
+    return m_round;
+}
+
+uint32_t
+TradeHeader::GetTrader(void) const
+{
+    return m_trader;
+}
+
+TradeHeader::Side
+TradeHeader::GetSide(void) const
+{
+    return static_cast<Side>(m_side);
+}
+
+uint32_t
+TradeHeader::GetQuantity(void) const
+{
+    return m_quantity;
+}
+
+uint32_t
+TradeHeader::GetPrice(void) const
+{
+    return m_price;
+}
+
+void
+TradeHeader::SetSendTime(Time t)
+{
+    m_sendTs = t.GetTimeStep();
+}
+
+Time
+TradeHeader::GetSendTime(void) const
+{
+    return TimeStep(m_sendTs);
+}
+
+class EnergyTrader : public SiteApplication
+{
+public:
+    struct Order
+    {
+        TradeHeader::Side side;
+        uint32_t quantity;
+        uint32_t price;
+    };
+
+    static TypeId GetTypeId(void);
+
+    EnergyTrader();
+    virtual ~EnergyTrader();
+
+    // 'peers' holds every trader's address, including this one at 'self'
+    void Setup(uint32_t self, const std::vector<Address>& peers, uint16_t port,
+               Time firstRound, Time interval);
+
+    const std::map<uint32_t, Time>& GetClearTimes(void) const;
+    uint64_t GetClearedVolume(void) const;
+    const std::map<uint32_t, double>& GetClearingPrices(void) const;
+    const std::set<uint32_t>& GetShortRounds(void) const;
+    const SampleStats& GetOrderLatency(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void OpenRound(void);
+    void HandleRead(Ptr<Socket> socket);
+    void Clear(uint32_t round);
+
+    Ptr<Socket> m_socket;
+    uint32_t m_self;
+    std::vector<Address> m_peers;
+    uint16_t m_port;
+    Time m_firstRound;
+    Time m_interval;
+    EventId m_roundEvent;
+    Ptr<UniformRandomVariable> m_orderRng;
+
+    uint32_t m_round;
+    std::map<uint32_t, std::map<uint32_t, Order> > m_book;   // round -> trader -> order
+    std::map<uint32_t, Time> m_clearTimes;                   // round -> local clearing time
+    uint64_t m_clearedVolume;                                // Wh, all rounds
+    std::map<uint32_t, double> m_clearingPrices;             // round -> price, rounds with trades only
+    std::set<uint32_t> m_shortRounds;                        // Rounds cleared with orders missing
+    SampleStats m_orderLatency;                              // ms, one-way
+};
+
+TypeId
+EnergyTrader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("EnergyTrader")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<EnergyTrader>();
+    return tid;
+}
+
+EnergyTrader::EnergyTrader()
+    : m_socket(0),
+      m_self(0),
+      m_port(0),
+      m_round(0),
+      m_clearedVolume(0)
+{
+    m_orderRng = CreateObject<UniformRandomVariable>();
+}
+
+EnergyTrader::~EnergyTrader()
+{
+    m_socket = 0;
+}
+
+void
+EnergyTrader::Setup(uint32_t self, const std::vector<Address>& peers, uint16_t port,
+                    Time firstRound, Time interval)
+{
+    m_self = self;
+    m_peers = peers;
+    m_port = port;
+    m_firstRound = firstRound;
+    m_interval = interval;
+}
+
+const std::map<uint32_t, Time>&
+EnergyTrader::GetClearTimes(void) const
+{
+    return m_clearTimes;
+}
+
+uint64_t
+EnergyTrader::GetClearedVolume(void) const
+{
+    return m_clearedVolume;
+}
+
+const std::map<uint32_t, double>&
+EnergyTrader::GetClearingPrices(void) const
+{
+    return m_clearingPrices;
+}
+
+const std::set<uint32_t>&
+EnergyTrader::GetShortRounds(void) const
+{
+    return m_shortRounds;
+}
+
+const SampleStats&
+EnergyTrader::GetOrderLatency(void) const
+{
+    return m_orderLatency;
+}
+
+void
+EnergyTrader::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&EnergyTrader::HandleRead, this));
+    }
+    // Gate closures are aligned across traders on the shared market clock
+    Time wait = m_firstRound > Simulator::Now() ? m_firstRound - Simulator::Now() : Seconds(0.0);
+    m_roundEvent = Simulator::Schedule(wait, &EnergyTrader::OpenRound, this);
+}
+
+void
+EnergyTrader::StopApplication(void)
+{
+    Simulator::Cancel(m_roundEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+EnergyTrader::OpenRound(void)
+{
+    uint32_t round = m_round++;
+
+    // Close earlier rounds whose missing orders were lost on the way
+    while (!m_book.empty() && m_book.begin()->first < round)
+    {
+        uint32_t stale = m_book.begin()->first;
+        m_shortRounds.insert(stale);
+        Clear(stale);
+    }
+    m_roundEvent = Simulator::Schedule(m_interval, &EnergyTrader::OpenRound, this);
+    if (!IsPowered())
+    {
+        return;
+    }
+
+    // Surplus sites offer, deficit sites bid; sellers ask low, buyers pay more
+    Order order;
+    order.side = m_orderRng->GetValue() < 0.5 ? TradeHeader::OFFER : TradeHeader::BID;
+    order.quantity = m_orderRng->GetInteger(500, 5000);
+    order.price = (order.side == TradeHeader::OFFER) ? m_orderRng->GetInteger(80, 160)
+                                                     : m_orderRng->GetInteger(100, 200);
+    m_book[round][m_self] = order;
+
+    for (uint32_t p = 0; p < m_peers.size(); ++p)
+    {
+        if (p == m_self)
+        {
+            continue;
+        }
+        TradeHeader header;
+        header.SetOrder(round, m_self, order.side, order.quantity, order.price);
+        header.SetSendTime(Simulator::Now());
+        Ptr<Packet> packet = Create<Packet>(0);
+        packet->AddHeader(header);
+        m_socket->SendTo(packet, 0, m_peers[p]);
+    }
+    if (m_peers.size() == 1)
+    {
+        Clear(round);
+    }
+}
+
+void
+EnergyTrader::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        TradeHeader header;
+        packet->RemoveHeader(header);
+        m_orderLatency.Add((Simulator::Now() - header.GetSendTime()).GetSeconds() * 1000.0);
+        if (!IsPowered() || m_clearTimes.find(header.GetRound()) != m_clearTimes.end())
+        {
+            continue;
+        }
+
+        Order order;
+        order.side = header.GetSide();
+        order.quantity = header.GetQuantity();
+        order.price = header.GetPrice();
+        std::map<uint32_t, Order>& orders = m_book[header.GetRound()];
+        orders[header.GetTrader()] = order;
+        if (orders.size() == m_peers.size())
+        {
+            Clear(header.GetRound());
+        }
+    }
+}
+
+void
+EnergyTrader::Clear(uint32_t round)
+{
+    // Uniform-price double auction: match the cheapest offers against the
+    // highest bids while the bid still covers the ask, then price every
+    // matched Wh at the midpoint of the last matched bid and offer
+    std::vector<std::pair<uint32_t, uint32_t> > offers, bids;   // (price, quantity)
+    const std::map<uint32_t, Order>& orders = m_book[round];
+    for (std::map<uint32_t, Order>::const_iterator it = orders.begin(); it != orders.end(); ++it)
+    {
+        std::pair<uint32_t, uint32_t> entry(it->second.price, it->second.quantity);
+        (it->second.side == TradeHeader::OFFER ? offers : bids).push_back(entry);
+    }
+    std::sort(offers.begin(), offers.end());
+    std::sort(bids.rbegin(), bids.rend());
+
+    uint64_t volume = 0;
+    uint32_t lastBid = 0, lastOffer = 0;
+    uint32_t o = 0, b = 0;
+    while (o < offers.size() && b < bids.size() && bids[b].first >= offers[o].first)
+    {
+        uint32_t traded = std::min(offers[o].second, bids[b].second);
+        volume += traded;
+        lastBid = bids[b].first;
+        lastOffer = offers[o].first;
+        offers[o].second -= traded;
+        bids[b].second -= traded;
+        if (offers[o].second == 0)
+        {
+            ++o;
+        }
+        if (bids[b].second == 0)
+        {
+            ++b;
+        }
+    }
+
+    m_clearedVolume += volume;
+    if (volume > 0)
+    {
+        m_clearingPrices[round] = (lastBid + lastOffer) / 2.0;
+    }
+    m_clearTimes[round] = Simulator::Now();
+    m_book.erase(round);
+}
+
+// ============================================================================
+// SCHOOL WEB TRAFFIC
+// ============================================================================
+//
+// Web-like browsing from the school Wi-Fi LANs. Each station alternates
+// exponentially distributed think times with page fetches; a page is a
+// heavy-tailed (log-normal) number of bytes that the web server returns as
+// a burst of datagrams. A page has loaded once every fragment has arrived
+// and is abandoned if that takes longer than the page timeout.
+
+class WebHeader : public Header
+{
+public:
+    enum Type
+    {
+        REQUEST = 1,
+        RESPONSE = 2
+    };
+
+    WebHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void SetType(Type type);
+    Type GetType(void) const;
+    void SetPage(uint32_t page);
+    uint32_t GetPage(void) const;
+    void SetPageSize(uint32_t bytes);
+    uint32_t GetPageSize(void) const;
+    void SetFragment(uint16_t index, uint16_t count);
+    uint16_t GetFragmentIndex(void) const;
+    uint16_t GetFragmentCount(void) const;
+
+private:
+    uint8_t m_type;
+    uint32_t m_page;
+    uint32_t m_pageSize;
+    uint16_t m_fragIndex;
+    uint16_t m_fragCount;
+};
+
+WebHeader::WebHeader()
+    : m_type(REQUEST),
+      m_page(0),
+      m_pageSize(0),
+      m_fragIndex(0),
+      m_fragCount(0)
+{
+}
+
+TypeId
+WebHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("WebHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<WebHeader>();
+    return tid;
+}
+
+TypeId
+WebHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+WebHeader::GetSerializedSize(void) const
+{
+    return 1 + 4 + 4 + 2 + 2;
+}
+
+void
+WebHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteU8(m_type);
+    i.WriteHtonU32(m_page);
+    i.WriteHtonU32(m_pageSize);
+    i.WriteHtonU16(m_fragIndex);
+    i.WriteHtonU16(m_fragCount);
+}
+
+uint32_t
+WebHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_type = i.ReadU8();
+    m_page = i.ReadNtohU32();
+    m_pageSize = i.ReadNtohU32();
+    m_fragIndex = i.ReadNtohU16();
+    m_fragCount = i.ReadNtohU16();
+    return GetSerializedSize();
+}
+
+void
+WebHeader::Print(std::ostream& os) const
+{
+    os << (m_type == REQUEST ? "REQUEST" : "RESPONSE") << " page=" << m_page
+       << " size=" << m_pageSize << " frag=" << m_fragIndex << "/" << m_fragCount;
+}
+
+void
+WebHeader::SetType(Type type)
+{
+    m_type = type;
+}
+
+WebHeader::Type
+WebHeader::GetType(void) const
+{
+    return static_cast<Type>(m_type);
+}
+
+void
+WebHeader::SetPage(uint32_t page)
+{
+    m_page = page;
+}
+
+uint32_t
+WebHeader::GetPage(void) const
+{
+    return m_page;
+}
+
+void
+WebHeader::SetPageSize(uint32_t bytes)
+{
+    m_pageSize = bytes;
+}
+
+uint32_t
+WebHeader::GetPageSize(void) const
+{
+    return m_pageSize;
+}
+
+void
+WebHeader::SetFragment(uint16_t index, uint16_t count)
+{
+    m_fragIndex = index;
+    m_fragCount = count;
+}
+
+uint16_t
+WebHeader::GetFragmentIndex(void) const
+{
+    return m_fragIndex;
+}
+
+uint16_t
+WebHeader::GetFragmentCount(void) const
+{
+    return m_fragCount;
+}
+
+// Returns a page to 'to' as a burst of fragments of at most maxPayload bytes
+static void
+SendPage(Ptr<Socket> socket, const Address& to, uint32_t page, uint32_t pageSize, uint32_t maxPayload)
+{
+    uint32_t remaining = pageSize;
+    uint32_t fragments = std::max<uint32_t>((remaining + maxPayload - 1) / maxPayload, 1);
+    NS_ABORT_MSG_IF(fragments > 0xffff, "Page " << page << " needs more fragments than WebHeader can count");
+    uint16_t count = fragments;
+    for (uint16_t f = 0; f < count; ++f)
+    {
+        uint32_t bytes = std::min(remaining, maxPayload);
+        remaining -= bytes;
+        WebHeader response;
+        response.SetType(WebHeader::RESPONSE);
+        response.SetPage(page);
+        response.SetPageSize(pageSize);
+        response.SetFragment(f, count);
+        Ptr<Packet> fragment = Create<Packet>(bytes);
+        fragment->AddHeader(response);
+        socket->SendTo(fragment, 0, to);
+    }
+}
+
+class WebServer : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    WebServer();
+    virtual ~WebServer();
+
+    void Setup(uint16_t port, uint32_t maxPayload);
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+    uint32_t m_maxPayload;
+};
+
+TypeId
+WebServer::GetTypeId(void)
+{
+    static TypeId tid = TypeId("WebServer")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<WebServer>();
+    return tid;
+}
+
+WebServer::WebServer()
+    : m_socket(0),
+      m_port(80),
+      m_maxPayload(1400)
+{
+}
+
+WebServer::~WebServer()
+{
+    m_socket = 0;
+}
+
+void
+WebServer::Setup(uint16_t port, uint32_t maxPayload)
+{
+    m_port = port;
+    m_maxPayload = maxPayload;
+}
+
+void
+WebServer::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&WebServer::HandleRead, this));
+    }
+}
+
+void
+WebServer::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+WebServer::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        WebHeader request;
+        packet->RemoveHeader(request);
+        if (request.GetType() == WebHeader::REQUEST)
+        {
+            SendPage(socket, from, request.GetPage(), request.GetPageSize(), m_maxPayload);
+        }
+    }
+}
+
+class WebClient : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    WebClient();
+    virtual ~WebClient();
+
+    void Setup(Address server, uint32_t meanPageSize, Time meanThink, Time pageTimeout);
+
+    uint32_t GetPagesLoaded(void) const;
+    uint32_t GetPagesFailed(void) const;
+    uint64_t GetBytesReceived(void) const;
+    const SampleStats& GetLoadTimes(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void ScheduleNextPage(void);
+    void RequestPage(void);
+    void PageTimeout(void);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    Address m_server;
+    uint32_t m_meanPageSize;
+    Time m_meanThink;
+    Time m_pageTimeout;
+    Ptr<LogNormalRandomVariable> m_pageSize;
+    Ptr<ExponentialRandomVariable> m_think;
+    EventId m_nextEvent;
+    EventId m_timeoutEvent;
+
+    uint32_t m_page;            // Page currently being fetched
+    bool m_fetching;
+    uint16_t m_fragments;       // Fragments of the current page received
+    Time m_pageStart;
+
+    uint32_t m_loaded;
+    uint32_t m_failed;
+    uint64_t m_bytesReceived;
+    SampleStats m_loadTimes;    // ms
+};
+
+TypeId
+WebClient::GetTypeId(void)
+{
+    static TypeId tid = TypeId("WebClient")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<WebClient>();
+    return tid;
+}
+
+WebClient::WebClient()
+    : m_socket(0),
+      m_meanPageSize(100000),
+      m_page(0),
+      m_fetching(false),
+      m_fragments(0),
+      m_loaded(0),
+      m_failed(0),
+      m_bytesReceived(0)
+{
+    m_pageSize = CreateObject<LogNormalRandomVariable>();
+    m_think = CreateObject<ExponentialRandomVariable>();
+}
+
+WebClient::~WebClient()
+{
+    m_socket = 0;
+}
+
+void
+WebClient::Setup(Address server, uint32_t meanPageSize, Time meanThink, Time pageTimeout)
+{
+    m_server = server;
+    m_meanPageSize = meanPageSize;
+    m_meanThink = meanThink;
+    m_pageTimeout = pageTimeout;
+}
+
+uint32_t
+WebClient::GetPagesLoaded(void) const
+{
+    return m_loaded;
+}
+
+uint32_t
+WebClient::GetPagesFailed(void) const
+{
+    return m_failed;
+}
+
+uint64_t
+WebClient::GetBytesReceived(void) const
+{
+    return m_bytesReceived;
+}
+
+const SampleStats&
+WebClient::GetLoadTimes(void) const
+{
+    return m_loadTimes;
+}
+
+void
+WebClient::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->SetRecvCallback(MakeCallback(&WebClient::HandleRead, this));
+    }
+    ScheduleNextPage();
+}
+
+void
+WebClient::StopApplication(void)
+{
+    Simulator::Cancel(m_nextEvent);
+    Simulator::Cancel(m_timeoutEvent);
+    m_fetching = false;
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+WebClient::ScheduleNextPage(void)
+{
+    m_fetching = false;
+    Time think = Seconds(m_think->GetValue(m_meanThink.GetSeconds(), 10.0 * m_meanThink.GetSeconds()));
+    m_nextEvent = Simulator::Schedule(think, &WebClient::RequestPage, this);
+}
+
+void
+WebClient::RequestPage(void)
+{
+    // Log-normal with sigma 1 keeps the configured mean while giving the
+    // heavy tail of real page weights; capped so one page stays bounded
+    const double sigma = 1.0;
+    double mu = std::log(static_cast<double>(m_meanPageSize)) - sigma * sigma / 2.0;
+    uint32_t size = static_cast<uint32_t>(std::min(m_pageSize->GetValue(mu, sigma), 20.0 * m_meanPageSize));
+
+    WebHeader request;
+    request.SetType(WebHeader::REQUEST);
+    request.SetPage(++m_page);
+    request.SetPageSize(std::max<uint32_t>(size, 1));
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(request);
+    m_socket->SendTo(packet, 0, m_server);
+
+    m_fetching = true;
+    m_fragments = 0;
+    m_pageStart = Simulator::Now();
+    m_timeoutEvent = Simulator::Schedule(m_pageTimeout, &WebClient::PageTimeout, this);
+}
+
+void
+WebClient::PageTimeout(void)
+{
+    ++m_failed;
+    ScheduleNextPage();
+}
+
+void
+WebClient::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        WebHeader response;
+        packet->RemoveHeader(response);
+        m_bytesReceived += packet->GetSize();
+        if (!m_fetching || response.GetPage() != m_page)
+        {
+            continue; // Straggler from an abandoned page
+        }
+        if (++m_fragments == response.GetFragmentCount())
+        {
+            Simulator::Cancel(m_timeoutEvent);
+            m_loadTimes.Add((Simulator::Now() - m_pageStart).GetSeconds() * 1000.0);
+            ++m_loaded;
+            ScheduleNextPage();
+        }
+    }
+}
+
+// ============================================================================
+// CONTENT CACHE
+// ============================================================================
+//
+// Caching proxy on router 1 in front of the content origin on the central
+// station. Schools request objects from a shared catalogue with Zipf
+// popularity, using the web wire format with the object id as the page.
+// A hit is answered from the router; a miss is fetched once from the origin
+// (concurrent misses for the same object wait on the same fetch), stored if
+// it fits, and then returned to every waiting school. Eviction is either
+// least-recently-used or least-frequently-used with recency breaking ties.
+//
+// With prefetching enabled the proxy also pulls popular objects it does not
+// hold yet while the backbone is quiet. Every period it reads the bytes sent
+// on the backbone link (as an SNMP interface counter would give them), and
+// outside the peak window it spends the capacity left below a target
+// utilisation on the most requested uncached objects that fit in free cache
+// space. Prefetching never evicts.
+
+class ContentCache : public Application
+{
+public:
+    enum Policy
+    {
+        LRU,
+        LFU
+    };
+
+    static TypeId GetTypeId(void);
+
+    ContentCache();
+    virtual ~ContentCache();
+
+    void Setup(uint16_t port, Address origin, uint64_t capacity, Policy policy,
+               uint32_t maxPayload, Time fetchTimeout);
+    // 'catalogue' holds the size of every object (ids are 1-based);
+    // 'backbone' is the link whose utilisation limits prefetching
+    void EnablePrefetch(const std::vector<uint32_t>* catalogue, Ptr<NetDevice> backbone,
+                        DataRate backboneRate, double targetUtilization, Time period,
+                        Time peakStart, Time peakEnd);
+
+    uint32_t GetRequests(void) const;
+    uint32_t GetHits(void) const;
+    uint64_t GetHitBytes(void) const;
+    uint64_t GetFetchedBytes(void) const;
+    uint32_t GetEvictions(void) const;
+    uint32_t GetPrefetches(void) const;
+    uint64_t GetPrefetchedBytes(void) const;
+    uint64_t GetPrefetchHitBytes(void) const;
+
+private:
+    // Eviction order: (frequency, last use); frequency is always 0 under LRU
+    typedef std::pair<uint64_t, uint64_t> RankKey;
+
+    struct Entry
+    {
+        uint32_t size;
+        uint64_t uses;
+        RankKey rank;
+        bool prefetched;        // Prefetched and not yet requested
+    };
+
+    struct Fetch
+    {
+        uint32_t size;
+        uint16_t fragments;
+        std::vector<Address> waiting;
+        EventId timeout;
+        bool prefetch;
+    };
+
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRequest(Ptr<Socket> socket);
+    void HandleOrigin(Ptr<Socket> socket);
+    void FetchTimeout(uint32_t object);
+    void Touch(uint32_t object, Entry& entry);
+    void Store(uint32_t object, uint32_t size, bool prefetched);
+    void StartFetch(uint32_t object, uint32_t size, bool prefetch);
+    void BackboneTx(Ptr<const Packet> packet);
+    void Prefetch(void);
+
+    Ptr<Socket> m_socket;           // Towards the schools
+    Ptr<Socket> m_originSocket;     // Towards the origin
+    uint16_t m_port;
+    Address m_origin;
+    uint64_t m_capacity;
+    Policy m_policy;
+    uint32_t m_maxPayload;
+    Time m_fetchTimeout;
+
+    std::map<uint32_t, Entry> m_entries;
+    std::map<RankKey, uint32_t> m_rank;     // Eviction candidate first
+    std::map<uint32_t, Fetch> m_fetches;
+    uint64_t m_used;
+    uint64_t m_clock;
+    std::map<uint32_t, uint32_t> m_demand;  // Requests seen per object
+
+    const std::vector<uint32_t>* m_catalogue;
+    DataRate m_backboneRate;
+    double m_targetUtilization;
+    Time m_prefetchPeriod;
+    Time m_peakStart;
+    Time m_peakEnd;
+    EventId m_prefetchEvent;
+    uint64_t m_backboneBytes;
+    uint64_t m_lastBackboneBytes;
+    uint64_t m_prefetchInFlight;            // Bytes of prefetches not yet stored
+
+    uint32_t m_requests;
+    uint32_t m_hits;
+    uint64_t m_hitBytes;
+    uint64_t m_fetchedBytes;
+    uint32_t m_evictions;
+    uint32_t m_prefetches;
+    uint64_t m_prefetchedBytes;
+    uint64_t m_prefetchHitBytes;
+};
+
+TypeId
+ContentCache::GetTypeId(void)
+{
+    static TypeId tid = TypeId("ContentCache")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<ContentCache>();
+    return tid;
+}
+
+ContentCache::ContentCache()
+    : m_socket(0),
+      m_originSocket(0),
+      m_port(3128),
+      m_capacity(0),
+      m_policy(LRU),
+      m_maxPayload(1400),
+      m_used(0),
+      m_clock(0),
+      m_catalogue(0),
+      m_targetUtilization(0.0),
+      m_backboneBytes(0),
+      m_lastBackboneBytes(0),
+      m_prefetchInFlight(0),
+      m_requests(0),
+      m_hits(0),
+      m_hitBytes(0),
+      m_fetchedBytes(0),
+      m_evictions(0),
+      m_prefetches(0),
+      m_prefetchedBytes(0),
+      m_prefetchHitBytes(0)
+{
+}
+
+ContentCache::~ContentCache()
+{
+    m_socket = 0;
+    m_originSocket = 0;
+}
+
+void
+ContentCache::Setup(uint16_t port, Address origin, uint64_t capacity, Policy policy,
+                    uint32_t maxPayload, Time fetchTimeout)
+{
+    m_port = port;
+    m_origin = origin;
+    m_capacity = capacity;
+    m_policy = policy;
+    m_maxPayload = maxPayload;
+    m_fetchTimeout = fetchTimeout;
+}
+
+void
+ContentCache::EnablePrefetch(const std::vector<uint32_t>* catalogue, Ptr<NetDevice> backbone,
+                             DataRate backboneRate, double targetUtilization, Time period,
+                             Time peakStart, Time peakEnd)
+{
+    m_catalogue = catalogue;
+    m_backboneRate = backboneRate;
+    m_targetUtilization = targetUtilization;
+    m_prefetchPeriod = period;
+    m_peakStart = peakStart;
+    m_peakEnd = peakEnd;
+    backbone->TraceConnectWithoutContext("PhyTxEnd", MakeCallback(&ContentCache::BackboneTx, this));
+}
+
+uint32_t
+ContentCache::GetRequests(void) const
+{
+    return m_requests;
+}
+
+uint32_t
+ContentCache::GetHits(void) const
+{
+    return m_hits;
+}
+
+uint64_t
+ContentCache::GetHitBytes(void) const
+{
+    return m_hitBytes;
+}
+
+uint64_t
+ContentCache::GetFetchedBytes(void) const
+{
+    return m_fetchedBytes;
+}
+
+uint32_t
+ContentCache::GetEvictions(void) const
+{
+    return m_evictions;
+}
+
+uint32_t
+ContentCache::GetPrefetches(void) const
+{
+    return m_prefetches;
+}
+
+uint64_t
+ContentCache::GetPrefetchedBytes(void) const
+{
+    return m_prefetchedBytes;
+}
+
+uint64_t
+ContentCache::GetPrefetchHitBytes(void) const
+{
+    return m_prefetchHitBytes;
+}
+
+void
+ContentCache::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&ContentCache::HandleRequest, this));
+    }
+    if (!m_originSocket)
+    {
+        m_originSocket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_originSocket->Bind();
+        m_originSocket->SetRecvCallback(MakeCallback(&ContentCache::HandleOrigin, this));
+    }
+    if (m_catalogue)
+    {
+        m_lastBackboneBytes = m_backboneBytes;
+        m_prefetchEvent = Simulator::Schedule(m_prefetchPeriod, &ContentCache::Prefetch, this);
+    }
+}
+
+void
+ContentCache::StopApplication(void)
+{
+    Simulator::Cancel(m_prefetchEvent);
+    for (std::map<uint32_t, Fetch>::iterator it = m_fetches.begin(); it != m_fetches.end(); ++it)
+    {
+        Simulator::Cancel(it->second.timeout);
+    }
+    m_fetches.clear();
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+    if (m_originSocket)
+    {
+        m_originSocket->Close();
+        m_originSocket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+ContentCache::HandleRequest(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        WebHeader request;
+        packet->RemoveHeader(request);
+        if (request.GetType() != WebHeader::REQUEST)
+        {
+            continue;
+        }
+        ++m_requests;
+        uint32_t object = request.GetPage();
+        ++m_demand[object];
+
+        std::map<uint32_t, Entry>::iterator cached = m_entries.find(object);
+        if (cached != m_entries.end())
+        {
+            ++m_hits;
+            m_hitBytes += cached->second.size;
+            if (cached->second.prefetched)
+            {
+                m_prefetchHitBytes += cached->second.size;
+                cached->second.prefetched = false;
+            }
+            Touch(object, cached->second);
+            SendPage(m_socket, from, object, cached->second.size, m_maxPayload);
+            continue;
+        }
+
+        std::map<uint32_t, Fetch>::iterator pending = m_fetches.find(object);
+        if (pending != m_fetches.end())
+        {
+            pending->second.waiting.push_back(from);
+            continue;
+        }
+
+        StartFetch(object, request.GetPageSize(), false);
+        m_fetches[object].waiting.push_back(from);
+    }
+}
+
+void
+ContentCache::StartFetch(uint32_t object, uint32_t size, bool prefetch)
+{
+    Fetch& fetch = m_fetches[object];
+    fetch.size = size;
+    fetch.fragments = 0;
+    fetch.prefetch = prefetch;
+    fetch.timeout = Simulator::Schedule(m_fetchTimeout, &ContentCache::FetchTimeout, this, object);
+    if (prefetch)
+    {
+        m_prefetchInFlight += size;
+    }
+
+    WebHeader request;
+    request.SetType(WebHeader::REQUEST);
+    request.SetPage(object);
+    request.SetPageSize(size);
+    Ptr<Packet> upstream = Create<Packet>(0);
+    upstream->AddHeader(request);
+    m_originSocket->SendTo(upstream, 0, m_origin);
+}
+
+void
+ContentCache::HandleOrigin(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        WebHeader response;
+        packet->RemoveHeader(response);
+        m_fetchedBytes += packet->GetSize();
+        std::map<uint32_t, Fetch>::iterator it = m_fetches.find(response.GetPage());
+        if (it == m_fetches.end() || ++it->second.fragments < response.GetFragmentCount())
+        {
+            continue;
+        }
+
+        // Object complete: keep a copy, then serve everyone who asked for it
+        uint32_t object = it->first;
+        Fetch fetch = it->second;
+        Simulator::Cancel(fetch.timeout);
+        m_fetches.erase(it);
+        if (fetch.prefetch)
+        {
+            m_prefetchInFlight -= fetch.size;
+            ++m_prefetches;
+            m_prefetchedBytes += fetch.size;
+        }
+        Store(object, fetch.size, fetch.prefetch && fetch.waiting.empty());
+        for (uint32_t w = 0; w < fetch.waiting.size(); ++w)
+        {
+            SendPage(m_socket, fetch.waiting[w], object, fetch.size, m_maxPayload);
+        }
+    }
+}
+
+void
+ContentCache::FetchTimeout(uint32_t object)
+{
+    // The requesters time out on their own; a later request refetches
+    std::map<uint32_t, Fetch>::iterator it = m_fetches.find(object);
+    if (it != m_fetches.end() && it->second.prefetch)
+    {
+        m_prefetchInFlight -= it->second.size;
+    }
+    m_fetches.erase(object);
+}
+
+void
+ContentCache::Touch(uint32_t object, Entry& entry)
+{
+    m_rank.erase(entry.rank);
+    ++entry.uses;
+    entry.rank = RankKey(m_policy == LFU ? entry.uses : 0, ++m_clock);
+    m_rank[entry.rank] = object;
+}
+
+void
+ContentCache::Store(uint32_t object, uint32_t size, bool prefetched)
+{
+    if (size > m_capacity || m_entries.count(object))
+    {
+        return;
+    }
+    while (m_used + size > m_capacity)
+    {
+        std::map<RankKey, uint32_t>::iterator victim = m_rank.begin();
+        m_used -= m_entries[victim->second].size;
+        m_entries.erase(victim->second);
+        m_rank.erase(victim);
+        ++m_evictions;
+    }
+    Entry& entry = m_entries[object];
+    entry.size = size;
+    entry.uses = 0;
+    entry.rank = RankKey(0, 0);
+    entry.prefetched = prefetched;
+    m_rank[entry.rank] = object;
+    Touch(object, entry);
+    m_used += size;
+}
+
+void
+ContentCache::BackboneTx(Ptr<const Packet> packet)
+{
+    m_backboneBytes += packet->GetSize();
+}
+
+void
+ContentCache::Prefetch(void)
+{
+    m_prefetchEvent = Simulator::Schedule(m_prefetchPeriod, &ContentCache::Prefetch, this);
+
+    uint64_t sent = m_backboneBytes - m_lastBackboneBytes;
+    m_lastBackboneBytes = m_backboneBytes;
+    Time now = Simulator::Now();
+    if (now >= m_peakStart && now < m_peakEnd)
+    {
+        return;
+    }
+    double periodBytes = m_backboneRate.GetBitRate() / 8.0 * m_prefetchPeriod.GetSeconds();
+    double budget = m_targetUtilization * periodBytes - static_cast<double>(sent);
+    if (budget <= 0.0)
+    {
+        return;
+    }
+
+    // Most requested first; catalogue order (publisher ranking) breaks ties
+    std::vector<std::pair<int64_t, uint32_t> > candidates;
+    for (uint32_t object = 1; object <= m_catalogue->size(); ++object)
+    {
+        if (m_entries.count(object) == 0 && m_fetches.count(object) == 0)
+        {
+            std::map<uint32_t, uint32_t>::const_iterator seen = m_demand.find(object);
+            int64_t requests = (seen != m_demand.end()) ? seen->second : 0;
+            candidates.push_back(std::make_pair(-requests, object));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    for (uint32_t c = 0; c < candidates.size() && budget > 0.0; ++c)
+    {
+        uint32_t object = candidates[c].second;
+        uint32_t size = (*m_catalogue)[object - 1];
+        if (m_used + m_prefetchInFlight + size > m_capacity || size > budget)
+        {
+            continue;
+        }
+        StartFetch(object, size, true);
+        budget -= size;
+    }
+}
+
+class ContentClient : public SiteApplication
+{
+public:
+    static TypeId GetTypeId(void);
+
+    ContentClient();
+    virtual ~ContentClient();
+
+    // 'catalogue' holds the size of every object; object ids are 1-based
+    void Setup(Address proxy, const std::vector<uint32_t>* catalogue, double zipfAlpha,
+               Time meanInterval, Time timeout);
+    // Requests arrive 'factor' times as often inside [start, end)
+    void SetPeakWindow(Time start, Time end, double factor);
+
+    uint32_t GetFetched(void) const;
+    uint32_t GetFailed(void) const;
+    const SampleStats& GetFetchLatency(void) const;
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void ScheduleNext(void);
+    void Request(void);
+    void Timeout(void);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    Address m_proxy;
+    const std::vector<uint32_t>* m_catalogue;
+    double m_zipfAlpha;
+    Time m_meanInterval;
+    Time m_timeout;
+    Time m_peakStart;
+    Time m_peakEnd;
+    double m_peakFactor;
+    Ptr<ZipfRandomVariable> m_popularity;
+    Ptr<ExponentialRandomVariable> m_gap;
+    EventId m_nextEvent;
+    EventId m_timeoutEvent;
+
+    uint32_t m_object;          // Object being fetched, 0 when idle
+    uint16_t m_fragments;
+    Time m_requestTime;
+
+    uint32_t m_fetched;
+    uint32_t m_failed;
+    SampleStats m_latency;      // ms
+};
+
+TypeId
+ContentClient::GetTypeId(void)
+{
+    static TypeId tid = TypeId("ContentClient")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<ContentClient>();
+    return tid;
+}
+
+ContentClient::ContentClient()
+    : m_socket(0),
+      m_catalogue(0),
+      m_zipfAlpha(0.8),
+      m_peakFactor(1.0),
+      m_object(0),
+      m_fragments(0),
+      m_fetched(0),
+      m_failed(0)
+{
+    m_popularity = CreateObject<ZipfRandomVariable>();
+    m_gap = CreateObject<ExponentialRandomVariable>();
+}
+
+ContentClient::~ContentClient()
+{
+    m_socket = 0;
+}
+
+void
+ContentClient::Setup(Address proxy, const std::vector<uint32_t>* catalogue, double zipfAlpha,
+                     Time meanInterval, Time timeout)
+{
+    m_proxy = proxy;
+    m_catalogue = catalogue;
+    m_zipfAlpha = zipfAlpha;
+    m_meanInterval = meanInterval;
+    m_timeout = timeout;
+}
+
+void
+ContentClient::SetPeakWindow(Time start, Time end, double factor)
+{
+    m_peakStart = start;
+    m_peakEnd = end;
+    m_peakFactor = factor;
+}
+
+uint32_t
+ContentClient::GetFetched(void) const
+{
+    return m_fetched;
+}
+
+uint32_t
+ContentClient::GetFailed(void) const
+{
+    return m_failed;
+}
+
+const SampleStats&
+ContentClient::GetFetchLatency(void) const
+{
+    return m_latency;
+}
+
+void
+ContentClient::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->SetRecvCallback(MakeCallback(&ContentClient::HandleRead, this));
+    }
+    ScheduleNext();
+}
+
+void
+ContentClient::StopApplication(void)
+{
+    Simulator::Cancel(m_nextEvent);
+    Simulator::Cancel(m_timeoutEvent);
+    m_object = 0;
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+ContentClient::ScheduleNext(void)
+{
+    m_object = 0;
+    Time now = Simulator::Now();
+    double mean = m_meanInterval.GetSeconds();
+    if (now >= m_peakStart && now < m_peakEnd)
+    {
+        mean /= m_peakFactor;
+    }
+    Time gap = Seconds(m_gap->GetValue(mean, 10.0 * mean));
+    m_nextEvent = Simulator::Schedule(gap, &ContentClient::Request, this);
+}
+
+void
+ContentClient::Request(void)
+{
+    if (!IsPowered())
+    {
+        ScheduleNext();
+        return;
+    }
+    m_object = m_popularity->GetInteger(m_catalogue->size(), m_zipfAlpha);
+    m_fragments = 0;
+    m_requestTime = Simulator::Now();
+
+    WebHeader request;
+    request.SetType(WebHeader::REQUEST);
+    request.SetPage(m_object);
+    request.SetPageSize((*m_catalogue)[m_object - 1]);
+    Ptr<Packet> packet = Create<Packet>(0);
+    packet->AddHeader(request);
+    m_socket->SendTo(packet, 0, m_proxy);
+    m_timeoutEvent = Simulator::Schedule(m_timeout, &ContentClient::Timeout, this);
+}
+
+void
+ContentClient::Timeout(void)
+{
+    if (IsPowered())
+    {
+        ++m_failed;
+    }
+    ScheduleNext();
+}
+
+void
+ContentClient::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        WebHeader response;
+        packet->RemoveHeader(response);
+        if (m_object == 0 || response.GetPage() != m_object)
+        {
+            continue;
+        }
+        if (++m_fragments == response.GetFragmentCount())
+        {
+            Simulator::Cancel(m_timeoutEvent);
+            m_latency.Add((Simulator::Now() - m_requestTime).GetSeconds() * 1000.0);
+            ++m_fetched;
+            ScheduleNext();
+        }
+    }
+}
+
+// Origin bytes on the backbone and prefetch-served bytes at one instant;
+// taken at both edges of the peak window
+struct PeakLoadSample
+{
+    uint64_t originBytes;
+    uint64_t prefetchHitBytes;
+};
+
+static void
+SamplePeakLoad(PeakLoadSample* sample, const PortTrafficCounter* origin, Ptr<ContentCache> cache)
+{
+    sample->originBytes = origin->bytes;
+    sample->prefetchHitBytes = cache->GetPrefetchHitBytes();
+}
+
+// ============================================================================
+// SITE TIME SYNCHRONISATION
+// ============================================================================
+//
+// NTP-style client/server exchange between the sites and the central
+// station, whose clock is the reference. Every site clock starts with an
+// initial offset, runs at a constant frequency error and wanders as a random
+// walk. Each poll yields the usual four timestamps, from which the client
+// derives an offset and a round-trip delay; the clock filter keeps the last
+// few samples and trusts the one with the smallest delay, since queueing on
+// the path is what makes the two directions asymmetric. The client steps its
+// phase by the filtered offset and slowly trims its frequency.
+
+class NtpHeader : public Header
+{
+public:
+    NtpHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    // Timestamps in nanoseconds of the clock that took them; signed, since a
+    // site clock running behind can read before zero early in the run
+    void SetOriginate(int64_t t);
+    int64_t GetOriginate(void) const;
+    void SetReceive(int64_t t);
+    int64_t GetReceive(void) const;
+    void SetTransmit(int64_t t);
+    int64_t GetTransmit(void) const;
+
+private:
+    int64_t m_originate;
+    int64_t m_receive;
+    int64_t m_transmit;
+};
+
+NtpHeader::NtpHeader()
+    : m_originate(0),
+      m_receive(0),
+      m_transmit(0)
+{
+}
+
+TypeId
+NtpHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("NtpHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<NtpHeader>();
+    return tid;
+}
+
+TypeId
+NtpHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+NtpHeader::GetSerializedSize(void) const
+{
+    return 3 * 8;
+}
+
+void
+NtpHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteHtonU64(static_cast<uint64_t>(m_originate));
+    i.WriteHtonU64(static_cast<uint64_t>(m_receive));
+    i.WriteHtonU64(static_cast<uint64_t>(m_transmit));
+}
+
+uint32_t
+NtpHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    m_originate = static_cast<int64_t>(i.ReadNtohU64());
+    m_receive = static_cast<int64_t>(i.ReadNtohU64());
+    m_transmit = static_cast<int64_t>(i.ReadNtohU64());
+    return GetSerializedSize();
+}
+
+void
+NtpHeader::Print(std::ostream& os) const
+{
+    os << "t1=" << m_originate << " t2=" << m_receive << " t3=" << m_transmit;
+}
+
+void
+NtpHeader::SetOriginate(int64_t t)
+{
+    m_originate = t;
+}
+
+int64_t
+NtpHeader::GetOriginate(void) const
+{
+    return m_originate;
+}
+
+void
+NtpHeader::SetReceive(int64_t t)
+{
+    m_receive = t;
+}
+
+int64_t
+NtpHeader::GetReceive(void) const
+{
+    return m_receive;
+}
+
+void
+NtpHeader::SetTransmit(int64_t t)
+{
+    m_transmit = t;
+}
+
+int64_t
+NtpHeader::GetTransmit(void) const
+{
+    return m_transmit;
+}
+
+class NtpServer : public Application
+{
+public:
+    static TypeId GetTypeId(void);
+
+    NtpServer();
+    virtual ~NtpServer();
+
+    void Setup(uint16_t port);
+
+private:
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    uint16_t m_port;
+};
+
+TypeId
+NtpServer::GetTypeId(void)
+{
+    static TypeId tid = TypeId("NtpServer")
+        .SetParent<Application>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<NtpServer>();
+    return tid;
+}
+
+NtpServer::NtpServer()
+    : m_socket(0),
+      m_port(123)
+{
+}
+
+NtpServer::~NtpServer()
+{
+    m_socket = 0;
+}
+
+void
+NtpServer::Setup(uint16_t port)
+{
+    m_port = port;
+}
+
+void
+NtpServer::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+        m_socket->SetRecvCallback(MakeCallback(&NtpServer::HandleRead, this));
+    }
+}
+
+void
+NtpServer::StopApplication(void)
+{
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void
+NtpServer::HandleRead(Ptr<Socket> socket)
+{
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        NtpHeader header;
+        packet->RemoveHeader(header);
+        header.SetReceive(Simulator::Now().GetNanoSeconds());
+        header.SetTransmit(Simulator::Now().GetNanoSeconds());
+        Ptr<Packet> reply = Create<Packet>(0);
+        reply->AddHeader(header);
+        socket->SendTo(reply, 0, from);
+    }
+}
+
+class NtpClient : public SiteApplication
+{
+public:
+    // One completed exchange: round-trip delay and its excess over the best
+    // delay seen so far (ms), and the error of the raw and filtered offset
+    // estimates against the true clock offset (us, absolute)
+    struct SyncSample
+    {
+        double delay;
+        double queueing;
+        double rawError;
+        double filteredError;
+    };
+
+    static TypeId GetTypeId(void);
+
+    NtpClient();
+    virtual ~NtpClient();
+
+    // Clock model: initial offset (s), frequency error (ppm) and random-walk
+    // wander (us per square-root second)
+    void Setup(Address server, Time pollInterval, double offset, double skewPpm, double wanderUs);
+
+    const std::vector<SyncSample>& GetSamples(void) const;
+
+private:
+    struct FilterEntry
+    {
+        double offset;          // s
+        double delay;           // s
+        double corrected;       // Total correction applied when it was taken
+    };
+
+    virtual void StartApplication(void);
+    virtual void StopApplication(void);
+
+    double ReadClock(void);
+    void Poll(void);
+    void HandleRead(Ptr<Socket> socket);
+
+    Ptr<Socket> m_socket;
+    Address m_server;
+    Time m_pollInterval;
+    EventId m_pollEvent;
+    Ptr<NormalRandomVariable> m_wanderRng;
+
+    double m_phase;             // Local minus true time (s)
+    double m_skew;              // s/s
+    double m_frequency;         // Frequency correction (s/s)
+    double m_wander;            // Wander variance per second (s^2)
+    double m_lastRead;          // True time of the last clock read (s)
+    double m_corrected;         // Sum of the phase corrections applied (s)
+
+    std::deque<FilterEntry> m_filter;
+    double m_minDelay;
+    std::vector<SyncSample> m_samples;
+};
+
+TypeId
+NtpClient::GetTypeId(void)
+{
+    static TypeId tid = TypeId("NtpClient")
+        .SetParent<SiteApplication>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<NtpClient>();
+    return tid;
+}
+
+NtpClient::NtpClient()
+    : m_socket(0),
+      m_phase(0.0),
+      m_skew(0.0),
+      m_frequency(0.0),
+      m_wander(0.0),
+      m_lastRead(0.0),
+      m_corrected(0.0),
+      m_minDelay(0.0)
+{
+    m_wanderRng = CreateObject<NormalRandomVariable>();
+}
+
+NtpClient::~NtpClient()
+{
+    m_socket = 0;
+}
+
+void
+NtpClient::Setup(Address server, Time pollInterval, double offset, double skewPpm, double wanderUs)
+{
+    m_server = server;
+    m_pollInterval = pollInterval;
+    m_phase = offset;
+    m_skew = skewPpm * 1e-6;
+    m_wander = (wanderUs * 1e-6) * (wanderUs * 1e-6);
+}
+
+const std::vector<NtpClient::SyncSample>&
+NtpClient::GetSamples(void) const
+{
+    return m_samples;
+}
+
+void
+NtpClient::StartApplication(void)
+{
+    if (!m_socket)
+    {
+        m_socket = Socket::CreateSocket(GetNode(), UdpSocketFactory::GetTypeId());
+        m_socket->Bind();
+        m_socket->SetRecvCallback(MakeCallback(&NtpClient::HandleRead, this));
+    }
+    m_lastRead = Simulator::Now().GetSeconds();
+    Poll();
+}
+
+void
+NtpClient::StopApplication(void)
+{
+    Simulator::Cancel(m_pollEvent);
+    if (m_socket)
+    {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+double
+NtpClient::ReadClock(void)
+{
+    // Advance the clock model to now, then read it
+    double now = Simulator::Now().GetSeconds();
+    double elapsed = now - m_lastRead;
+    if (elapsed > 0.0)
+    {
+        m_phase += (m_skew + m_frequency) * elapsed;
+        if (m_wander > 0.0)
+        {
+            double variance = m_wander * elapsed;
+            m_phase += m_wanderRng->GetValue(0.0, variance, 5.0 * std::sqrt(variance));
+        }
+        m_lastRead = now;
+    }
+    return now + m_phase;
+}
+
+void
+NtpClient::Poll(void)
+{
+    if (IsPowered())
+    {
+        NtpHeader header;
+        header.SetOriginate(static_cast<int64_t>(ReadClock() * 1e9));
+        Ptr<Packet> packet = Create<Packet>(0);
+        packet->AddHeader(header);
+        m_socket->SendTo(packet, 0, m_server);
+    }
+    m_pollEvent = Simulator::Schedule(m_pollInterval, &NtpClient::Poll, this);
+}
+
+void
+NtpClient::HandleRead(Ptr<Socket> socket)
+{
+    const uint32_t filterDepth = 8;
+    const double frequencyGain = 0.25;
+
+    Ptr<Packet> packet;
+    Address from;
+    while ((packet = socket->RecvFrom(from)))
+    {
+        NtpHeader header;
+        packet->RemoveHeader(header);
+        double t1 = header.GetOriginate() * 1e-9;
+        double t2 = header.GetReceive() * 1e-9;
+        double t3 = header.GetTransmit() * 1e-9;
+        double t4 = ReadClock();
+        double offset = ((t2 - t1) + (t3 - t4)) / 2.0;
+        double delay = (t4 - t1) - (t3 - t2);
+        double trueOffset = -m_phase;
+
+        FilterEntry entry;
+        entry.offset = offset;
+        entry.delay = delay;
+        entry.corrected = m_corrected;
+        m_filter.push_back(entry);
+        if (m_filter.size() > filterDepth)
+        {
+            m_filter.pop_front();
+        }
+        if (m_samples.empty() || delay < m_minDelay)
+        {
+            m_minDelay = delay;
+        }
+
+        // Older samples predate corrections already applied; remove those
+        uint32_t best = 0;
+        for (uint32_t f = 1; f < m_filter.size(); ++f)
+        {
+            if (m_filter[f].delay < m_filter[best].delay)
+            {
+                best = f;
+            }
+        }
+        double filtered = m_filter[best].offset - (m_corrected - m_filter[best].corrected);
+
+        SyncSample sample;
+        sample.delay = delay * 1000.0;
+        sample.queueing = (delay - m_minDelay) * 1000.0;
+        sample.rawError = std::fabs(offset - trueOffset) * 1e6;
+        sample.filteredError = std::fabs(filtered - trueOffset) * 1e6;
+        m_samples.push_back(sample);
+
+        // Step the phase, and trim the frequency once the initial offset
+        // has been removed
+        m_phase += filtered;
+        m_corrected += filtered;
+        if (m_samples.size() > 1)
+        {
+            m_frequency += frequencyGain * filtered / m_pollInterval.GetSeconds();
+        }
+    }
+}
+
+// ============================================================================
+// HEADER COMPRESSION
+// ============================================================================
+//
+// ROHC-style compression of IPv4/UDP headers on a point-to-point link, after
+// the UDP/IP profile in bidirectional optimistic mode. The compressor keeps
+// one context per flow (up to 16 CIDs) and sends its first packets as IR,
+// which carries the full headers. After that it sends UO-0, which carries
+// only the CID and four bits of sequence number. When the IP-ID no longer
+// follows the sequence number it sends UOR-2 with the full SN and IP-ID.
+// The decompressor rebuilds the headers from its context. If the SN window
+// is exceeded after a loss burst, the check that real ROHC makes with a
+// 3-bit CRC fails. Here a packet tag carrying the true SN stands in for that
+// CRC. On failure the packet is dropped and a NACK travels back over the
+// same link, so the compressor re-sends IR (IR_REPEAT times) and
+// resynchronises. A NACK that is not answered within about a round trip is
+// repeated on the next failure, so a lost NACK or lost IRs cannot leave a
+// context broken for the rest of the run.
+//
+// Compressed frames still travel as PPP/IPv4 and are told apart from plain
+// IPv4 by their first octet, whose high nibble is never 4.
+
+class RohcHeader : public Header
+{
+public:
+    enum Type
+    {
+        IR = 0xFD,
+        UOR2 = 0xC0,
+        UO0 = 0x10,             // Low nibble carries the SN bits
+        NACK = 0xF1
+    };
+
+    RohcHeader();
+
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(Buffer::Iterator start) const;
+    virtual uint32_t Deserialize(Buffer::Iterator start);
+    virtual void Print(std::ostream& os) const;
+
+    void Set(Type type, uint8_t cid, uint16_t sn, uint16_t ipId);
+    Type GetType(void) const;
+    uint8_t GetCid(void) const;
+    // Full SN for IR/UOR-2, the low four bits for UO-0
+    uint16_t GetSn(void) const;
+    uint16_t GetIpId(void) const;
+
+private:
+    uint8_t m_type;
+    uint8_t m_cid;
+    uint16_t m_sn;
+    uint16_t m_ipId;
+};
+
+RohcHeader::RohcHeader()
+    : m_type(IR),
+      m_cid(0),
+      m_sn(0),
+      m_ipId(0)
+{
+}
+
+TypeId
+RohcHeader::GetTypeId(void)
+{
+    static TypeId tid = TypeId("RohcHeader")
+        .SetParent<Header>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<RohcHeader>();
+    return tid;
+}
+
+TypeId
+RohcHeader::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+RohcHeader::GetSerializedSize(void) const
+{
+    switch (m_type)
+    {
+    case IR:
+        return 4;
+    case UOR2:
+        return 6;
+    default:
+        return 2;
+    }
+}
+
+void
+RohcHeader::Serialize(Buffer::Iterator start) const
+{
+    Buffer::Iterator i = start;
+    i.WriteU8(m_type == UO0 ? (UO0 | (m_sn & 0x0F)) : m_type);
+    i.WriteU8(m_cid);
+    if (m_type == IR || m_type == UOR2)
+    {
+        i.WriteHtonU16(m_sn);
+    }
+    if (m_type == UOR2)
+    {
+        i.WriteHtonU16(m_ipId);
+    }
+}
+
+uint32_t
+RohcHeader::Deserialize(Buffer::Iterator start)
+{
+    Buffer::Iterator i = start;
+    uint8_t first = i.ReadU8();
+    if ((first & 0xF0) == UO0)
+    {
+        m_type = UO0;
+        m_sn = first & 0x0F;
+    }
+    else
+    {
+        m_type = first;
+    }
+    m_cid = i.ReadU8();
+    if (m_type == IR || m_type == UOR2)
+    {
+        m_sn = i.ReadNtohU16();
+    }
+    if (m_type == UOR2)
+    {
+        m_ipId = i.ReadNtohU16();
+    }
+    return GetSerializedSize();
+}
+
+void
+RohcHeader::Print(std::ostream& os) const
+{
+    os << "type=0x" << std::hex << static_cast<uint32_t>(m_type) << std::dec
+       << " cid=" << static_cast<uint32_t>(m_cid) << " sn=" << m_sn;
+}
+
+void
+RohcHeader::Set(Type type, uint8_t cid, uint16_t sn, uint16_t ipId)
+{
+    m_type = type;
+    m_cid = cid;
+    m_sn = sn;
+    m_ipId = ipId;
+}
+
+RohcHeader::Type
+RohcHeader::GetType(void) const
+{
+    return static_cast<Type>(m_type);
+}
+
+uint8_t
+RohcHeader::GetCid(void) const
+{
+    return m_cid;
+}
+
+uint16_t
+RohcHeader::GetSn(void) const
+{
+    return m_sn;
+}
+
+uint16_t
+RohcHeader::GetIpId(void) const
+{
+    return m_ipId;
+}
+
+// True sequence number of a compressed packet; plays the role of the ROHC
+// CRC so the decompressor can tell a wrong reconstruction
+class RohcCrcTag : public Tag
+{
+public:
+    static TypeId GetTypeId(void);
+    virtual TypeId GetInstanceTypeId(void) const;
+    virtual uint32_t GetSerializedSize(void) const;
+    virtual void Serialize(TagBuffer i) const;
+    virtual void Deserialize(TagBuffer i);
+    virtual void Print(std::ostream& os) const;
+
+    uint16_t sn;
+};
+
+TypeId
+RohcCrcTag::GetTypeId(void)
+{
+    static TypeId tid = TypeId("RohcCrcTag")
+        .SetParent<Tag>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<RohcCrcTag>();
+    return tid;
+}
+
+TypeId
+RohcCrcTag::GetInstanceTypeId(void) const
+{
+    return GetTypeId();
+}
+
+uint32_t
+RohcCrcTag::GetSerializedSize(void) const
+{
+    return 4;
+}
+
+void
+RohcCrcTag::Serialize(TagBuffer i) const
+{
+    i.WriteU32(sn);
+}
+
+void
+RohcCrcTag::Deserialize(TagBuffer i)
+{
+    sn = i.ReadU32();
+}
+
+void
+RohcCrcTag::Print(std::ostream& os) const
+{
+    os << "sn=" << sn;
+}
+
+class RohcPointToPointNetDevice : public PointToPointNetDevice
+{
+public:
+    static const uint32_t MAX_CONTEXTS = 16;
+    static const uint32_t IR_REPEAT = 3;        // Optimistic IR count per context
+
+    // Compressor statistics are for this end's transmit direction,
+    // decompressor statistics for its receive direction
+    struct Stats
+    {
+        uint64_t ir;
+        uint64_t uo0;
+        uint64_t uor2;
+        uint64_t uncompressed;          // Not UDP/IPv4, or no free context
+        uint64_t headerBytesIn;         // IPv4+UDP header bytes handed to the compressor
+        uint64_t headerBytesOut;        // Compressed header bytes that replaced them
+        uint64_t frameBytes;            // Network-layer bytes actually sent
+        uint32_t failures;              // Packets lost to a failed reconstruction
+        uint32_t nacks;                 // NACKs sent by the decompressor
+        uint32_t resyncs;               // NACKs acted on by the compressor
+    };
+
+    static TypeId GetTypeId(void);
+
+    RohcPointToPointNetDevice();
+
+    virtual bool Send(Ptr<Packet> packet, const Address& dest, uint16_t protocolNumber);
+    virtual void SetReceiveCallback(NetDevice::ReceiveCallback cb);
+
+    const Stats& GetStats(void) const;
+    uint32_t GetContextCount(void) const;
+    uint32_t GetStateBytes(void) const;
+
+private:
+    typedef std::pair<std::pair<uint32_t, uint32_t>, uint32_t> FlowKey;
+
+    struct CompressorContext
+    {
+        uint8_t cid;
+        uint16_t sn;
+        uint16_t ipIdOffset;    // IP-ID minus SN
+        uint32_t irLeft;
+        Ipv4Header ip;
+    };
+
+    struct DecompressorContext
+    {
+        bool valid;
+        bool nackSent;
+        uint16_t sn;
+        uint16_t ipIdOffset;
+        Ipv4Header ip;
+        UdpHeader udp;
+    };
+
+    bool ReceiveFromLink(Ptr<NetDevice> /* device */, Ptr<const Packet> packet, uint16_t protocol,
+                         const Address& from);
+    bool Deliver(Ptr<Packet> packet, uint16_t protocol, const Address& from);
+    void SendNack(uint8_t cid);
+    void ExpireNack(uint8_t cid);
+
+    NetDevice::ReceiveCallback m_upperRx;
+    std::map<FlowKey, CompressorContext> m_compressor;
+    std::map<uint8_t, DecompressorContext> m_decompressor;
+    Stats m_stats;
+};
+
+TypeId
+RohcPointToPointNetDevice::GetTypeId(void)
+{
+    static TypeId tid = TypeId("RohcPointToPointNetDevice")
+        .SetParent<PointToPointNetDevice>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<RohcPointToPointNetDevice>();
+    return tid;
+}
+
+RohcPointToPointNetDevice::RohcPointToPointNetDevice()
+{
+    Stats zero = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    m_stats = zero;
+}
+
+const RohcPointToPointNetDevice::Stats&
+RohcPointToPointNetDevice::GetStats(void) const
+{
+    return m_stats;
+}
+
+uint32_t
+RohcPointToPointNetDevice::GetContextCount(void) const
+{
+    return m_compressor.size() + m_decompressor.size();
+}
+
+uint32_t
+RohcPointToPointNetDevice::GetStateBytes(void) const
+{
+    return m_compressor.size() * sizeof(CompressorContext)
+           + m_decompressor.size() * sizeof(DecompressorContext);
+}
+
+bool
+RohcPointToPointNetDevice::Send(Ptr<Packet> packet, const Address& dest, uint16_t protocolNumber)
+{
+    if (protocolNumber != Ipv4L3Protocol::PROT_NUMBER)
+    {
+        return PointToPointNetDevice::Send(packet, dest, protocolNumber);
+    }
+
+    Ptr<Packet> frame = packet->Copy();
+    Ipv4Header ip;
+    frame->RemoveHeader(ip);
+    if (ip.GetProtocol() != UdpL4Protocol::PROT_NUMBER || ip.GetFragmentOffset() != 0 || !ip.IsLastFragment())
+    {
+        ++m_stats.uncompressed;
+        m_stats.frameBytes += packet->GetSize();
+        return PointToPointNetDevice::Send(packet, dest, protocolNumber);
+    }
+    UdpHeader udp;
+    frame->RemoveHeader(udp);
+
+    FlowKey key(std::make_pair(ip.GetSource().Get(), ip.GetDestination().Get()),
+                (static_cast<uint32_t>(udp.GetSourcePort()) << 16) | udp.GetDestinationPort());
+    std::map<FlowKey, CompressorContext>::iterator it = m_compressor.find(key);
+    if (it == m_compressor.end())
+    {
+        if (m_compressor.size() >= MAX_CONTEXTS)
+        {
+            ++m_stats.uncompressed;
+            m_stats.frameBytes += packet->GetSize();
+            return PointToPointNetDevice::Send(packet, dest, protocolNumber);
+        }
+        CompressorContext context;
+        context.cid = m_compressor.size();
+        context.sn = 0;
+        context.ipIdOffset = 0;
+        context.irLeft = IR_REPEAT;
+        context.ip = ip;
+        it = m_compressor.insert(std::make_pair(key, context)).first;
+    }
+    CompressorContext& context = it->second;
+
+    // Fields the decompressor cannot infer force a fresh IR
+    if (ip.GetTos() != context.ip.GetTos() || ip.GetTtl() != context.ip.GetTtl()
+        || ip.IsDontFragment() != context.ip.IsDontFragment())
+    {
+        context.irLeft = std::max<uint32_t>(context.irLeft, 1);
+    }
+
+    uint16_t sn = context.sn++;
+    uint16_t ipIdOffset = ip.GetIdentification() - sn;
+    RohcHeader rohc;
+    if (context.irLeft > 0)
+    {
+        --context.irLeft;
+        frame->AddHeader(udp);
+        frame->AddHeader(ip);
+        rohc.Set(RohcHeader::IR, context.cid, sn, 0);
+        ++m_stats.ir;
+    }
+    else if (ipIdOffset != context.ipIdOffset)
+    {
+        rohc.Set(RohcHeader::UOR2, context.cid, sn, ip.GetIdentification());
+        ++m_stats.uor2;
+    }
+    else
+    {
+        rohc.Set(RohcHeader::UO0, context.cid, sn, 0);
+        ++m_stats.uo0;
+    }
+    context.ipIdOffset = ipIdOffset;
+    context.ip = ip;
+    frame->AddHeader(rohc);
+
+    RohcCrcTag crc;
+    crc.sn = sn;
+    frame->AddPacketTag(crc);
+
+    uint32_t headerBytes = ip.GetSerializedSize() + udp.GetSerializedSize();
+    m_stats.headerBytesIn += headerBytes;
+    m_stats.headerBytesOut += frame->GetSize() - (packet->GetSize() - headerBytes);
+    m_stats.frameBytes += frame->GetSize();
+    return PointToPointNetDevice::Send(frame, dest, protocolNumber);
+}
+
+void
+RohcPointToPointNetDevice::SetReceiveCallback(NetDevice::ReceiveCallback cb)
+{
+    m_upperRx = cb;
+    PointToPointNetDevice::SetReceiveCallback(MakeCallback(&RohcPointToPointNetDevice::ReceiveFromLink, this));
+}
+
+bool
+RohcPointToPointNetDevice::ReceiveFromLink(Ptr<NetDevice> /* device */, Ptr<const Packet> packet,
+                                           uint16_t protocol, const Address& from)
+{
+    uint8_t first = 0;
+    packet->CopyData(&first, 1);
+    if (protocol != Ipv4L3Protocol::PROT_NUMBER || (first >> 4) == 4)
+    {
+        return m_upperRx(this, packet, protocol, from);
+    }
+
+    Ptr<Packet> frame = packet->Copy();
+    RohcHeader rohc;
+    frame->RemoveHeader(rohc);
+
+    if (rohc.GetType() == RohcHeader::NACK)
+    {
+        // Our compressor's context for this CID is out of step at the peer;
+        // repeat the IR so one lost copy does not leave it broken
+        for (std::map<FlowKey, CompressorContext>::iterator it = m_compressor.begin();
+             it != m_compressor.end(); ++it)
+        {
+            if (it->second.cid == rohc.GetCid())
+            {
+                it->second.irLeft = std::max<uint32_t>(it->second.irLeft, IR_REPEAT);
+                ++m_stats.resyncs;
+            }
+        }
+        return true;
+    }
+
+    RohcCrcTag crc;
+    frame->RemovePacketTag(crc);
+    DecompressorContext& context = m_decompressor[rohc.GetCid()];
+
+    if (rohc.GetType() == RohcHeader::IR)
+    {
+        frame->RemoveHeader(context.ip);
+        frame->PeekHeader(context.udp);
+        context.valid = true;
+        context.nackSent = false;
+        context.sn = rohc.GetSn();
+        context.ipIdOffset = context.ip.GetIdentification() - context.sn;
+        frame->AddHeader(context.ip);
+        return Deliver(frame, protocol, from);
+    }
+
+    uint16_t sn;
+    if (rohc.GetType() == RohcHeader::UOR2)
+    {
+        sn = rohc.GetSn();
+    }
+    else
+    {
+        // The next SN after the last one that ends in the received bits
+        sn = context.sn + 1 + ((rohc.GetSn() - (context.sn + 1)) & 0x0F);
+    }
+    if (!context.valid || sn != crc.sn)
+    {
+        // At most one NACK per context per round trip; once it expires the
+        // next failure asks again, in case the NACK or the IRs were lost
+        ++m_stats.failures;
+        context.valid = false;
+        if (!context.nackSent)
+        {
+            context.nackSent = true;
+            SendNack(rohc.GetCid());
+        }
+        return true;
+    }
+
+    context.sn = sn;
+    if (rohc.GetType() == RohcHeader::UOR2)
+    {
+        context.ipIdOffset = rohc.GetIpId() - sn;
+    }
+    Ipv4Header ip = context.ip;
+    ip.SetIdentification(sn + context.ipIdOffset);
+    ip.SetPayloadSize(frame->GetSize() + context.udp.GetSerializedSize());
+    frame->AddHeader(context.udp);
+    frame->AddHeader(ip);
+    return Deliver(frame, protocol, from);
+}
+
+bool
+RohcPointToPointNetDevice::Deliver(Ptr<Packet> packet, uint16_t protocol, const Address& from)
+{
+    return m_upperRx(this, packet, protocol, from);
+}
+
+void
+RohcPointToPointNetDevice::SendNack(uint8_t cid)
+{
+    ++m_stats.nacks;
+    RohcHeader nack;
+    nack.Set(RohcHeader::NACK, cid, 0, 0);
+    Ptr<Packet> feedback = Create<Packet>(0);
+    feedback->AddHeader(nack);
+    PointToPointNetDevice::Send(feedback, GetBroadcast(), Ipv4L3Protocol::PROT_NUMBER);
+
+    // Roughly one round trip of the link before the NACK may be repeated
+    TimeValue delay;
+    GetChannel()->GetAttribute("Delay", delay);
+    Simulator::Schedule(delay.Get() + delay.Get() + MilliSeconds(10),
+                        &RohcPointToPointNetDevice::ExpireNack, this, cid);
+}
+
+void
+RohcPointToPointNetDevice::ExpireNack(uint8_t cid)
+{
+    m_decompressor[cid].nackSent = false;
+}
+
+// Point-to-point link between two nodes with header compression at both
+// ends, built the way PointToPointHelper::Install builds its devices
+static NetDeviceContainer
+InstallRohcLink(Ptr<Node> a, Ptr<Node> b, const std::string& dataRate, const std::string& delay)
+{
+    NetDeviceContainer devices;
+    Ptr<PointToPointChannel> channel = CreateObject<PointToPointChannel>();
+    channel->SetAttribute("Delay", StringValue(delay));
+    Ptr<Node> ends[] = { a, b };
+    for (uint32_t e = 0; e < 2; ++e)
+    {
+        Ptr<RohcPointToPointNetDevice> device = CreateObject<RohcPointToPointNetDevice>();
+        device->SetAttribute("DataRate", StringValue(dataRate));
+        device->SetAddress(Mac48Address::Allocate());
+        ends[e]->AddDevice(device);
+        Ptr<Queue<Packet> > queue = CreateObject<DropTailQueue<Packet> >();
+        device->SetQueue(queue);
+        device->Attach(channel);
+
+        Ptr<NetDeviceQueueInterface> ndqi = CreateObject<NetDeviceQueueInterface>();
+        ndqi->GetTxQueue(0)->ConnectQueueTraces(queue);
+        device->AggregateObject(ndqi);
+        devices.Add(device);
+    }
+    return devices;
+}
+
+// ============================================================================
+// BACKGROUND TRAFFIC
+// ============================================================================
+
+// Constant-rate UDP flood from 'source' to 'sink' (which needs a sink
+// application listening on its port)
+static void
+InstallFlood(Ptr<Node> source, Address sink, DataRate rate, Time start, Time stop)
+{
+    OnOffHelper flood("ns3::UdpSocketFactory", sink);
+    flood.SetConstantRate(rate, 1400);
+    ApplicationContainer apps = flood.Install(source);
+    apps.Start(start);
+    apps.Stop(stop);
+}
+
+// ============================================================================
+// CLINIC PRIORITISATION
+// ============================================================================
+//
+// Two-band strict priority at the routers on the clinic path: band 0 for
+// clinical traffic, band 1 for everything else. Clinical traffic is found
+// either by address (source or destination in the healthcare network
+// 172.17.0.0/16) or by DSCP (EF and AF4x, once sites mark their traffic).
+
+class ClinicPacketFilter : public Ipv4PacketFilter
+{
+public:
+    enum Mode
+    {
+        BY_SUBNET,
+        BY_DSCP
+    };
+
+    static TypeId GetTypeId(void);
+
+    ClinicPacketFilter();
+
+    void SetMode(Mode mode);
+
+private:
+    virtual int32_t DoClassify(Ptr<QueueDiscItem> item) const;
+
+    Mode m_mode;
+    Ipv4Address m_network;
+    Ipv4Mask m_mask;
+};
+
+TypeId
+ClinicPacketFilter::GetTypeId(void)
+{
+    static TypeId tid = TypeId("ClinicPacketFilter")
+        .SetParent<Ipv4PacketFilter>()
+        .SetGroupName("SolarEnergyWAN")
+        .AddConstructor<ClinicPacketFilter>();
+    return tid;
+}
+
+ClinicPacketFilter::ClinicPacketFilter()
+    : m_mode(BY_SUBNET),
+      m_network("172.17.0.0"),
+      m_mask("255.255.0.0")
+{
+}
+
+void
+ClinicPacketFilter::SetMode(Mode mode)
+{
+    m_mode = mode;
+}
+
+int32_t
+ClinicPacketFilter::DoClassify(Ptr<QueueDiscItem> item) const
+{
+    const Ipv4Header& header = DynamicCast<Ipv4QueueDiscItem>(item)->GetHeader();
+    bool clinical;
+    if (m_mode == BY_SUBNET)
+    {
+        clinical = m_mask.IsMatch(header.GetSource(), m_network)
+                   || m_mask.IsMatch(header.GetDestination(), m_network);
+    }
+    else
+    {
+        Ipv4Header::DscpType dscp = header.GetDscp();
+        clinical = dscp == Ipv4Header::DSCP_EF || dscp == Ipv4Header::DSCP_AF41
+                   || dscp == Ipv4Header::DSCP_AF42 || dscp == Ipv4Header::DSCP_AF43;
+    }
+    return clinical ? 0 : 1;
+}
+
+// ============================================================================
+// ACCESS SHAPING
+// ============================================================================
+//
+// Token-bucket shaper on a site uplink. A packet that finds enough tokens
+// leaves the shaper at the instant it arrives; anything that has to wait for
+// tokens (or behind packets that did) is counted as delayed, together with
+// how long it waited.
+
+struct ShaperStats
+{
+    uint64_t dequeued;
+    uint64_t delayed;
+    SampleStats delay;      // ms, delayed packets only
+};
+
+static void
+RecordShaperDequeue(ShaperStats* stats, Ptr<const QueueDiscItem> item)
+{
+    ++stats->dequeued;
+    Time wait = Simulator::Now() - item->GetTimeStamp();
+    if (wait.IsStrictlyPositive())
+    {
+        ++stats->delayed;
+        stats->delay.Add(wait.GetSeconds() * 1000.0);
+    }
+}
+
+// ============================================================================
+// ACTIVE QUEUE MANAGEMENT
+// ============================================================================
+//
+// CoDel or FQ-CoDel on the devices of a link class. Every dequeue reports
+// the packet's sojourn time; besides the full distribution, the minimum
+// sojourn over each 100 ms window is kept as the standing queue delay (the
+// quantity CoDel itself controls). Windows in which nothing was dequeued
+// had no queue and count as zero.
+
+struct SojournTracker
+{
+    SampleStats* sojourn;       // ms, every dequeued packet
+    SampleStats* standing;      // ms, one sample per window
+    Time windowEnd;
+    double windowMin;
+};
+
+static void
+RecordSojourn(SojournTracker* tracker, Time sojourn)
+{
+    const Time window = MilliSeconds(100);
+    Time now = Simulator::Now();
+    double ms = sojourn.GetSeconds() * 1000.0;
+    tracker->sojourn->Add(ms);
+    if (tracker->windowEnd.IsZero())
+    {
+        tracker->windowEnd = now + window;
+        tracker->windowMin = ms;
+        return;
+    }
+    if (now >= tracker->windowEnd)
+    {
+        tracker->standing->Add(tracker->windowMin);
+        tracker->windowEnd = tracker->windowEnd + window;
+        while (now >= tracker->windowEnd)
+        {
+            tracker->standing->Add(0.0);
+            tracker->windowEnd = tracker->windowEnd + window;
+        }
+        tracker->windowMin = ms;
+    }
+    tracker->windowMin = std::min(tracker->windowMin, ms);
+}
+
+// Root queue disc installed on the device, if any
+static Ptr<QueueDisc>
+RootQueueDisc(Ptr<NetDevice> device)
+{
+    Ptr<TrafficControlLayer> tc = device->GetNode()->GetObject<TrafficControlLayer>();
+    if (!tc)
+    {
+        return 0;
+    }
+    return tc->GetRootQueueDiscOnDevice(device);
+}
+
+// True when a root queue disc is already installed on the device
+static bool
+HasRootQueueDisc(Ptr<NetDevice> device)
+{
+    return RootQueueDisc(device) != 0;
+}
+
+// ============================================================================
+// QUEUE SIZING
+// ============================================================================
+//
+// Bandwidth-delay product of a point-to-point link in full-size packets,
+// from the device's own data rate and its channel's one-way delay.
+//
+// Buffer-induced latency is estimated per packet as it enters the root queue
+// disc: the bytes already waiting in the queue disc and the device queue,
+// drained at the line rate. Measured the same way with or without sizing,
+// so the two runs compare directly.
+
+static uint32_t
+BdpPackets(Ptr<NetDevice> device, double factor)
+{
+    DataRateValue rate;
+    device->GetAttribute("DataRate", rate);
+    TimeValue delay;
+    device->GetChannel()->GetAttribute("Delay", delay);
+    double bytes = rate.Get().GetBitRate() * 2.0 * delay.Get().GetSeconds() / 8.0 * factor;
+    return std::max<uint32_t>(1, static_cast<uint32_t>(std::ceil(bytes / device->GetMtu())));
+}
+
+struct BufferTracker
+{
+    Ptr<QueueDisc> disc;
+    Ptr<Queue<Packet> > deviceQueue;
+    double bitRate;
+    SampleStats* delay;     // ms
+};
+
+static void
+RecordBufferDelay(BufferTracker* tracker, Ptr<const QueueDiscItem> item)
+{
+    uint64_t ahead = tracker->disc->GetNBytes() - item->GetSize() + tracker->deviceQueue->GetNBytes();
+    tracker->delay->Add(ahead * 8.0 / tracker->bitRate * 1000.0);
+}
+
+// ============================================================================
+// PER-DSCP ACCOUNTING
+// ============================================================================
+//
+// Packets, bytes and drops per DSCP on one router interface, taken from the
+// root queue disc of the device: every packet leaving the interface is
+// dequeued from it and every drop on the way out (including drops inside
+// child queue discs) is reported by it.
+
+struct DscpCounters
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;
+    uint64_t dropBytes;
+};
+
+struct DscpAccount
+{
+    std::string name;
+    std::map<Ipv4Header::DscpType, DscpCounters> classes;
+};
+
+static DscpCounters&
+DscpEntry(DscpAccount* account, Ptr<const QueueDiscItem> item)
+{
+    Ptr<const Ipv4QueueDiscItem> ipItem = DynamicCast<const Ipv4QueueDiscItem>(item);
+    Ipv4Header::DscpType dscp = ipItem ? ipItem->GetHeader().GetDscp() : Ipv4Header::DscpDefault;
+    std::map<Ipv4Header::DscpType, DscpCounters>::iterator it = account->classes.find(dscp);
+    if (it == account->classes.end())
+    {
+        DscpCounters zero = { 0, 0, 0, 0 };
+        it = account->classes.insert(std::make_pair(dscp, zero)).first;
+    }
+    return it->second;
+}
+
+static void
+CountDscpDequeue(DscpAccount* account, Ptr<const QueueDiscItem> item)
+{
+    DscpCounters& c = DscpEntry(account, item);
+    ++c.packets;
+    c.bytes += item->GetSize();
+}
+
+static void
+CountDscpDrop(DscpAccount* account, Ptr<const QueueDiscItem> item)
+{
+    DscpCounters& c = DscpEntry(account, item);
+    ++c.drops;
+    c.dropBytes += item->GetSize();
+}
+
+// ============================================================================
+// QUEUE OCCUPANCY SAMPLER
+// ============================================================================
+//
+// Samples the backlog (queue disc plus device queue, in packets and bytes)
+// of a set of interfaces at a fixed interval. Records go into a buffer
+// allocated once up front, which is written out whenever it fills and when
+// the sampler is closed, so the cost per sample is a few reads and a store.
+//
+// CSV output has one row per interface and sample:
+//   time_s,interface,packets,bytes
+// Binary output starts with "QOCC", a uint32 version, a uint32 interface
+// count and each interface name (uint16 length, then the characters),
+// followed by 18-byte records in host byte order:
+//   int64 time (ns), uint16 interface, uint32 packets, uint32 bytes
+
+class QueueOccupancySampler
+{
+public:
+    enum Format
+    {
+        CSV,
+        BINARY
+    };
+
+    QueueOccupancySampler();
+
+    void AddInterface(const std::string& name, Ptr<QueueDisc> disc, Ptr<Queue<Packet> > deviceQueue);
+    bool Open(const std::string& fileName, Format format, uint32_t capacity);
+    void Start(Time interval, Time stop);
+    void Close(void);
+
+    uint64_t GetSampleCount(void) const;
+    uint32_t GetNInterfaces(void) const;
+    const std::string& GetName(uint32_t i) const;
+    uint32_t GetMaxPackets(uint32_t i) const;
+    uint32_t GetMaxBytes(uint32_t i) const;
+
+private:
+    struct Interface
+    {
+        std::string name;
+        Ptr<QueueDisc> disc;
+        Ptr<Queue<Packet> > deviceQueue;
+        uint32_t maxPackets;
+        uint32_t maxBytes;
+    };
+
+    struct Record
+    {
+        int64_t time;
+        uint16_t interface;
+        uint32_t packets;
+        uint32_t bytes;
+    };
+
+    void Sample(void);
+    void Flush(void);
+
+    std::vector<Interface> m_interfaces;
+    std::vector<Record> m_records;
+    uint32_t m_used;
+    std::ofstream m_out;
+    Format m_format;
+    Time m_interval;
+    Time m_stop;
+    uint64_t m_samples;
+};
+
+QueueOccupancySampler::QueueOccupancySampler()
+    : m_used(0),
+      m_format(CSV),
+      m_samples(0)
+{
+}
+
+void
+QueueOccupancySampler::AddInterface(const std::string& name, Ptr<QueueDisc> disc, Ptr<Queue<Packet> > deviceQueue)
+{
+    Interface iface = { name, disc, deviceQueue, 0, 0 };
+    m_interfaces.push_back(iface);
+}
+
+bool
+QueueOccupancySampler::Open(const std::string& fileName, Format format, uint32_t capacity)
+{
+    m_format = format;
+    m_records.resize(std::max<uint32_t>(capacity, 1));
+    m_used = 0;
+    m_out.open(fileName.c_str(), format == BINARY ? std::ios::out | std::ios::binary : std::ios::out);
+    if (!m_out)
+    {
+        return false;
+    }
+    if (m_format == CSV)
+    {
+        m_out << std::fixed << std::setprecision(6) << "time_s,interface,packets,bytes\n";
+        return true;
+    }
+    const uint32_t version = 1;
+    uint32_t count = m_interfaces.size();
+    m_out.write("QOCC", 4);
+    m_out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    m_out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint16_t length = m_interfaces[i].name.size();
+        m_out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        m_out.write(m_interfaces[i].name.data(), length);
+    }
+    return true;
+}
+
+void
+QueueOccupancySampler::Start(Time interval, Time stop)
+{
+    m_interval = interval;
+    m_stop = stop;
+    Simulator::Schedule(Seconds(0.0), &QueueOccupancySampler::Sample, this);
+}
+
+void
+QueueOccupancySampler::Close(void)
+{
+    if (m_out.is_open())
+    {
+        Flush();
+        m_out.close();
+    }
+}
+
+uint64_t
+QueueOccupancySampler::GetSampleCount(void) const
+{
+    return m_samples;
+}
+
+uint32_t
+QueueOccupancySampler::GetNInterfaces(void) const
+{
+    return m_interfaces.size();
+}
+
+const std::string&
+QueueOccupancySampler::GetName(uint32_t i) const
+{
+    return m_interfaces[i].name;
+}
+
+uint32_t
+QueueOccupancySampler::GetMaxPackets(uint32_t i) const
+{
+    return m_interfaces[i].maxPackets;
+}
+
+uint32_t
+QueueOccupancySampler::GetMaxBytes(uint32_t i) const
+{
+    return m_interfaces[i].maxBytes;
+}
+
+void
+QueueOccupancySampler::Sample(void)
+{
+    int64_t now = Simulator::Now().GetNanoSeconds();
+    for (uint32_t i = 0; i < m_interfaces.size(); ++i)
+    {
+        Interface& iface = m_interfaces[i];
+        if (m_used == m_records.size())
+        {
+            Flush();
+        }
+        Record& record = m_records[m_used++];
+        record.time = now;
+        record.interface = i;
+        record.packets = iface.disc->GetNPackets() + iface.deviceQueue->GetNPackets();
+        record.bytes = iface.disc->GetNBytes() + iface.deviceQueue->GetNBytes();
+        iface.maxPackets = std::max(iface.maxPackets, record.packets);
+        iface.maxBytes = std::max(iface.maxBytes, record.bytes);
+    }
+    ++m_samples;
+    if (Simulator::Now() + m_interval <= m_stop)
+    {
+        Simulator::Schedule(m_interval, &QueueOccupancySampler::Sample, this);
+    }
+}
+
+void
+QueueOccupancySampler::Flush(void)
+{
+    for (uint32_t r = 0; r < m_used; ++r)
+    {
+        const Record& record = m_records[r];
+        if (m_format == CSV)
+        {
+            m_out << record.time / 1e9 << "," << m_interfaces[record.interface].name << ","
+                  << record.packets << "," << record.bytes << "\n";
+        }
+        else
+        {
+            m_out.write(reinterpret_cast<const char*>(&record.time), sizeof(record.time));
+            m_out.write(reinterpret_cast<const char*>(&record.interface), sizeof(record.interface));
+            m_out.write(reinterpret_cast<const char*>(&record.packets), sizeof(record.packets));
+            m_out.write(reinterpret_cast<const char*>(&record.bytes), sizeof(record.bytes));
+        }
+    }
+    m_used = 0;
+}
 
 int main(int argc, char* argv[])
 {
@@ -58,6 +7222,107 @@ int main(int argc, char* argv[])
     uint32_t nClinics = 3;              // Solar-powered health clinics
     uint32_t nMicrogrids = 4;           // Community solar micro-grids
     double simulationTime = 30.0;       // Simulation duration (seconds)
+    double appStart = 1.5;              // Earliest site application start (seconds)
+    double startWindow = 2.0;           // Width of the random start window (seconds)
+    double sendJitter = 0.1;            // Per-send jitter (fraction of interval)
+    bool enablePoller = false;          // Active polling from the monitoring center
+    double pollInterval = 5.0;          // Poll cycle period (seconds)
+    uint32_t pollConcurrency = 8;       // Outstanding poll requests
+    double pollTimeout = 1.0;           // Per-request poll timeout (seconds)
+    bool enableScada = false;           // Modbus-style SCADA polling of the micro-grids
+    double scadaInterval = 1.0;         // SCADA scan-cycle interval (seconds)
+    uint32_t scadaRegisters = 64;       // Holding registers read per poll
+    uint32_t scadaOutstanding = 1;      // Outstanding SCADA transactions
+    double scadaTimeout = 0.5;          // SCADA transaction timeout (seconds)
+    bool enablePubSub = false;          // Topic broker on the central station
+    std::string subscriberSpec = "dashboard=#;billing=microgrid/+/energy;analytics=school/#,clinic/#";
+    bool enableFirmware = false;        // Firmware push to the micro-grids
+    std::string firmwareMode = "multicast";
+    uint32_t firmwareSize = 1000000;    // Firmware image size (bytes)
+    std::string firmwareRate = "8Mbps"; // Pacing rate of each firmware stream
+    double firmwareStart = 5.0;         // Firmware push start (seconds)
+    std::string outageSpec = "";        // Site uplink outages
+    uint32_t satSchools = 0;            // Last schools reached over satellite instead of p2pRemote
+    std::string satType = "geo";        // Satellite class: geo or leo
+    std::string satUp = "";             // Satellite uplink rate (empty = class default)
+    std::string satDown = "";           // Satellite downlink rate (empty = class default)
+    uint32_t satBulk = 0;               // Satellite schools (counted from the last) running a TCP bulk upload
+    std::string linkErrors = "off";     // Errors on school/clinic and micro-grid links: off, rate or ge
+    double errorRate = 0.01;            // Packet error rate for linkErrors=rate
+    double gePGoodBad = 0.01;           // Gilbert-Elliott: good -> bad per packet
+    double gePBadGood = 0.2;            // Gilbert-Elliott: bad -> good per packet
+    double geLossGood = 0.0;            // Gilbert-Elliott: loss probability in the good state
+    double geLossBad = 0.5;             // Gilbert-Elliott: loss probability in the bad state
+    std::string weatherMode = "off";    // Access link capacity timeline: off, file or rain
+    std::string weatherFile = "";       // Capacity timeline for weatherMode=file
+    double rainGap = 20.0;              // Mean time between rain fades per link (seconds)
+    double rainFade = 5.0;              // Mean rain fade duration (seconds)
+    double rainMinFactor = 0.2;         // Deepest fade as a fraction of the link rate
+    double weatherBin = 1.0;            // Width of the weather report time bins (seconds)
+    std::string powerMode = "off";      // Site power outages: off, schedule or solar
+    std::string powerSchedule = "";     // Power outages for powerMode=schedule (class:n@start-end;...)
+    double dayLength = 24.0;            // Simulated seconds per modelled day
+    double dayStartHour = 18.0;         // Hour of day at the start of the run
+    double pvRatio = 3.0;               // Peak panel output over site load
+    double batteryHours = 8.0;          // Mean battery capacity (hours of load)
+    double cloudyDays = 0.3;            // Probability that a site's day is overcast
+    double reconnectLevel = 0.2;        // Battery fraction at which a site reconnects
+    bool storeForward = false;          // On-site buffering during outages
+    uint32_t bufferSize = 500;          // On-site buffer capacity (readings)
+    double drainRate = 20.0;            // Replay rate after recovery (readings/s)
+    uint32_t bulkSchools = 0;           // Schools running a TCP bulk upload
+    uint32_t bulkBytes = 5000000;       // Bytes per bulk upload
+    double bulkStart = 5.0;             // Bulk upload start (seconds)
+    uint32_t videoClinics = 0;          // Clinics running teleconsultation video
+    uint32_t videoSessions = 1;         // Concurrent video sessions per clinic
+    std::string videoRate = "2Mbps";    // Mean video bit rate per session
+    double videoFps = 25.0;             // Video frame rate
+    std::string videoGop = "IBBPBBPBBPBB";
+    double videoDeadline = 150.0;       // Frame playout deadline (ms)
+    bool enableDemandResponse = false;  // Curtailment commands to micro-grids
+    double drInterval = 5.0;            // Time between commands (seconds)
+    double drDeadline = 200.0;          // Acknowledgement deadline (ms)
+    double drActuation = 20.0;          // Controller actuation delay (ms)
+    double drRetry = 100.0;             // Command retry timeout (ms)
+    uint32_t wifiSchools = 0;           // Schools with a local Wi-Fi LAN
+    uint32_t wifiStations = 8;          // Stations per school Wi-Fi LAN
+    uint32_t webPageSize = 100000;      // Mean web page size (bytes)
+    double webThink = 5.0;              // Mean think time between pages (seconds)
+    bool enableContentCache = false;    // Zipf content fetches through a cache at router 1
+    uint64_t cacheSize = 50000000;      // Cache capacity (bytes, 0 disables caching)
+    std::string cachePolicy = "lru";    // Cache eviction policy: lru or lfu
+    uint32_t contentObjects = 1000;     // Objects in the content catalogue
+    uint32_t contentMeanSize = 200000;  // Mean object size (bytes)
+    double zipfAlpha = 0.8;             // Zipf popularity exponent
+    double contentInterval = 2.0;       // Mean gap between a school's fetches (seconds)
+    std::string contentPeak = "";       // Peak demand window "start-end" (seconds)
+    double peakFactor = 4.0;            // Request-rate multiplier inside the peak window
+    bool enablePrefetch = false;        // Off-peak prefetching into the content cache
+    double prefetchUtil = 0.5;          // Backbone utilisation prefetching may fill up to
+    bool enableTimeSync = false;        // NTP-style clock synchronisation of the sites
+    double ntpPoll = 4.0;               // Time-sync poll interval (seconds)
+    double clockOffset = 0.1;           // Maximum initial site clock offset (seconds)
+    double clockSkew = 50.0;            // Maximum site clock frequency error (ppm)
+    double clockWander = 1.0;           // Site clock random-walk wander (us per sqrt(s))
+    bool enableRohc = false;            // Header compression on the micro-grid links
+    std::string clinicPriority = "off"; // Clinic prioritisation: off, subnet or dscp
+    std::string backgroundRate = "";    // Background flood across router 2 and central (e.g. 120Mbps)
+    std::string queueSizing = "";       // Queue sizing: empty, default or bdp (the latter two add a buffer report)
+    double bdpFactor = 1.0;             // Queue limit as a multiple of the link BDP
+    std::string queueTrace = "";        // Router queue occupancy output file (empty = off)
+    std::string queueTraceFormat = "csv"; // Queue occupancy file format: csv or binary
+    double queueTraceInterval = 0.01;   // Queue occupancy sampling interval (seconds)
+    uint32_t queueTraceBuffer = 65536;  // Queue occupancy records held before each write
+    bool dscpMarking = false;           // DSCP per site class and per-DSCP router accounting
+    std::string shapeRate = "";         // Token-bucket rate on every site uplink (e.g. 5Mbps)
+    uint32_t shapeBurst = 15000;        // Token-bucket depth (bytes)
+    std::string siteFlood = "";         // UDP flood from one school during the middle third (e.g. 40Mbps)
+    uint32_t siteFloodSchool = 0;       // School that floods
+    std::string aqmWan = "none";        // Queue disc on backbone links: none, codel or fq_codel
+    std::string aqmRemote = "none";     // Queue disc on school/clinic links
+    std::string aqmMicrogrid = "none";  // Queue disc on micro-grid links
+    bool enableTrading = false;         // Peer-to-peer energy trading
+    double marketInterval = 2.0;        // Market clearing interval (seconds)
     bool verbose = true;
 
     CommandLine cmd;
@@ -65,9 +7330,206 @@ int main(int argc, char* argv[])
     cmd.AddValue("clinics", "Number of solar clinics", nClinics);
     cmd.AddValue("microgrids", "Number of community microgrids", nMicrogrids);
     cmd.AddValue("time", "Simulation time", simulationTime);
+    cmd.AddValue("appStart", "Earliest start time of site applications (s)", appStart);
+    cmd.AddValue("startWindow", "Width of the random site start window (s)", startWindow);
+    cmd.AddValue("jitter", "Per-send jitter as a fraction of the send interval [0,1)", sendJitter);
+    cmd.AddValue("poll", "Enable the monitoring center site poller", enablePoller);
+    cmd.AddValue("pollInterval", "Poll cycle period (s)", pollInterval);
+    cmd.AddValue("pollConcurrency", "Maximum outstanding poll requests", pollConcurrency);
+    cmd.AddValue("pollTimeout", "Per-request poll timeout (s)", pollTimeout);
+    cmd.AddValue("scada", "Enable Modbus-style SCADA polling of the micro-grids", enableScada);
+    cmd.AddValue("scadaInterval", "SCADA scan-cycle interval (s)", scadaInterval);
+    cmd.AddValue("scadaRegisters", "Holding registers read per SCADA poll", scadaRegisters);
+    cmd.AddValue("scadaOutstanding", "Maximum outstanding SCADA transactions", scadaOutstanding);
+    cmd.AddValue("scadaTimeout", "SCADA transaction timeout (s)", scadaTimeout);
+    cmd.AddValue("pubsub", "Enable the topic pub/sub broker on the central station", enablePubSub);
+    cmd.AddValue("subscribers", "Subscribers as name=filter[,filter];...", subscriberSpec);
+    cmd.AddValue("firmware", "Push a firmware image to every micro-grid", enableFirmware);
+    cmd.AddValue("firmwareMode", "Firmware distribution mode: multicast or unicast", firmwareMode);
+    cmd.AddValue("firmwareSize", "Firmware image size (bytes)", firmwareSize);
+    cmd.AddValue("firmwareRate", "Pacing rate of each firmware stream", firmwareRate);
+    cmd.AddValue("firmwareStart", "Firmware push start time (s)", firmwareStart);
+    cmd.AddValue("outages", "Site uplink outages as class:n@start-end;...", outageSpec);
+    cmd.AddValue("satSchools", "Number of schools (counted from the last) on a satellite link", satSchools);
+    cmd.AddValue("satType", "Satellite link class: geo or leo", satType);
+    cmd.AddValue("satUp", "Satellite uplink rate (default 2Mbps GEO, 10Mbps LEO)", satUp);
+    cmd.AddValue("satDown", "Satellite downlink rate (default 10Mbps GEO, 50Mbps LEO)", satDown);
+    cmd.AddValue("satBulk", "Number of satellite schools (counted from the last) running a TCP bulk upload", satBulk);
+    cmd.AddValue("linkErrors", "Errors on school/clinic and micro-grid links: off, rate or ge", linkErrors);
+    cmd.AddValue("errorRate", "Packet error rate for --linkErrors=rate", errorRate);
+    cmd.AddValue("gePGoodBad", "Gilbert-Elliott good to bad transition probability per packet", gePGoodBad);
+    cmd.AddValue("gePBadGood", "Gilbert-Elliott bad to good transition probability per packet", gePBadGood);
+    cmd.AddValue("geLossGood", "Gilbert-Elliott loss probability in the good state", geLossGood);
+    cmd.AddValue("geLossBad", "Gilbert-Elliott loss probability in the bad state", geLossBad);
+    cmd.AddValue("weather", "Access link capacity timeline: off, file or rain", weatherMode);
+    cmd.AddValue("weatherFile", "Capacity timeline file for --weather=file (time class:n factor|rate)", weatherFile);
+    cmd.AddValue("rainGap", "Mean time between rain fades on a link (s)", rainGap);
+    cmd.AddValue("rainFade", "Mean rain fade duration (s)", rainFade);
+    cmd.AddValue("rainMinFactor", "Deepest rain fade as a fraction of the link rate", rainMinFactor);
+    cmd.AddValue("weatherBin", "Width of the weather report time bins (s)", weatherBin);
+    cmd.AddValue("power", "Site power outages: off, schedule or solar", powerMode);
+    cmd.AddValue("powerSchedule", "Power outages for --power=schedule as class:n@start-end;...", powerSchedule);
+    cmd.AddValue("dayLength", "Simulated seconds per modelled day", dayLength);
+    cmd.AddValue("dayStartHour", "Hour of day at the start of the run", dayStartHour);
+    cmd.AddValue("pvRatio", "Peak solar panel output over site load", pvRatio);
+    cmd.AddValue("batteryHours", "Mean site battery capacity in hours of load", batteryHours);
+    cmd.AddValue("cloudyDays", "Probability that a site's day is overcast", cloudyDays);
+    cmd.AddValue("reconnectLevel", "Battery fraction at which a site reconnects", reconnectLevel);
+    cmd.AddValue("storeForward", "Buffer readings on site during uplink outages", storeForward);
+    cmd.AddValue("bufferSize", "On-site buffer capacity (readings)", bufferSize);
+    cmd.AddValue("drainRate", "Buffered reading replay rate after recovery (readings/s)", drainRate);
+    cmd.AddValue("bulkSchools", "Number of schools running a TCP bulk log upload", bulkSchools);
+    cmd.AddValue("bulkBytes", "Size of each bulk upload (bytes)", bulkBytes);
+    cmd.AddValue("bulkStart", "Bulk upload start time (s)", bulkStart);
+    cmd.AddValue("videoClinics", "Number of clinics running teleconsultation video", videoClinics);
+    cmd.AddValue("videoSessions", "Concurrent video sessions per video clinic", videoSessions);
+    cmd.AddValue("videoRate", "Mean bit rate of each video session", videoRate);
+    cmd.AddValue("videoFps", "Video frame rate (frames/s)", videoFps);
+    cmd.AddValue("videoGop", "Video GOP pattern of I/P/B frames", videoGop);
+    cmd.AddValue("videoDeadline", "Video frame playout deadline (ms)", videoDeadline);
+    cmd.AddValue("demandResponse", "Send demand-response commands to every micro-grid", enableDemandResponse);
+    cmd.AddValue("drInterval", "Time between demand-response commands (s)", drInterval);
+    cmd.AddValue("drDeadline", "Demand-response acknowledgement deadline (ms)", drDeadline);
+    cmd.AddValue("drActuation", "Micro-grid actuation delay before acknowledging (ms)", drActuation);
+    cmd.AddValue("drRetry", "Demand-response command retry timeout (ms)", drRetry);
+    cmd.AddValue("wifiSchools", "Number of schools with a Wi-Fi LAN", wifiSchools);
+    cmd.AddValue("wifiStations", "Stations on each school Wi-Fi LAN", wifiStations);
+    cmd.AddValue("webPageSize", "Mean web page size (bytes)", webPageSize);
+    cmd.AddValue("webThink", "Mean think time between web pages (s)", webThink);
+    cmd.AddValue("contentCache", "Enable school content fetches through a cache at router 1", enableContentCache);
+    cmd.AddValue("cacheSize", "Content cache capacity in bytes (0 disables caching)", cacheSize);
+    cmd.AddValue("cachePolicy", "Content cache eviction policy (lru or lfu)", cachePolicy);
+    cmd.AddValue("contentObjects", "Objects in the content catalogue", contentObjects);
+    cmd.AddValue("contentMeanSize", "Mean content object size (bytes)", contentMeanSize);
+    cmd.AddValue("zipfAlpha", "Zipf popularity exponent of content requests", zipfAlpha);
+    cmd.AddValue("contentInterval", "Mean gap between a school's content fetches (s)", contentInterval);
+    cmd.AddValue("contentPeak", "Peak content demand window as start-end (s)", contentPeak);
+    cmd.AddValue("peakFactor", "Content request-rate multiplier inside the peak window", peakFactor);
+    cmd.AddValue("prefetch", "Enable off-peak prefetching into the content cache", enablePrefetch);
+    cmd.AddValue("prefetchUtil", "Backbone utilisation that prefetching may fill up to", prefetchUtil);
+    cmd.AddValue("timeSync", "Enable NTP-style clock synchronisation of the sites", enableTimeSync);
+    cmd.AddValue("ntpPoll", "Time-sync poll interval (s)", ntpPoll);
+    cmd.AddValue("clockOffset", "Maximum initial site clock offset (s)", clockOffset);
+    cmd.AddValue("clockSkew", "Maximum site clock frequency error (ppm)", clockSkew);
+    cmd.AddValue("clockWander", "Site clock random-walk wander (us per sqrt(s))", clockWander);
+    cmd.AddValue("rohc", "Enable ROHC-style header compression on the micro-grid links", enableRohc);
+    cmd.AddValue("clinicPriority", "Strict priority for clinic traffic (off, subnet or dscp)", clinicPriority);
+    cmd.AddValue("background", "Background flood rate between router 2 and central (e.g. 120Mbps)", backgroundRate);
+    cmd.AddValue("queueSizing", "Queue sizing with a buffer report: default or bdp", queueSizing);
+    cmd.AddValue("bdpFactor", "Queue limit as a multiple of the link bandwidth-delay product", bdpFactor);
+    cmd.AddValue("queueTrace", "Write router queue occupancy samples to this file", queueTrace);
+    cmd.AddValue("queueTraceFormat", "Queue occupancy file format (csv or binary)", queueTraceFormat);
+    cmd.AddValue("queueTraceInterval", "Queue occupancy sampling interval (s)", queueTraceInterval);
+    cmd.AddValue("queueTraceBuffer", "Queue occupancy records buffered before each write", queueTraceBuffer);
+    cmd.AddValue("dscp", "Mark site traffic with DSCP per class and count it per DSCP at the routers", dscpMarking);
+    cmd.AddValue("shapeRate", "Token-bucket shaper rate on every site uplink (e.g. 5Mbps)", shapeRate);
+    cmd.AddValue("shapeBurst", "Token-bucket shaper depth (bytes)", shapeBurst);
+    cmd.AddValue("siteFlood", "UDP flood from one school during the middle third of the run (e.g. 40Mbps)", siteFlood);
+    cmd.AddValue("siteFloodSchool", "Index of the flooding school", siteFloodSchool);
+    cmd.AddValue("aqmWan", "Queue disc on backbone links (none, codel or fq_codel)", aqmWan);
+    cmd.AddValue("aqmRemote", "Queue disc on school and clinic links (none, codel or fq_codel)", aqmRemote);
+    cmd.AddValue("aqmMicrogrid", "Queue disc on micro-grid links (none, codel or fq_codel)", aqmMicrogrid);
+    cmd.AddValue("trading", "Enable peer-to-peer energy trading between micro-grids", enableTrading);
+    cmd.AddValue("marketInterval", "Energy market clearing interval (s)", marketInterval);
     cmd.AddValue("verbose", "Enable logging", verbose);
     cmd.Parse(argc, argv);
 
+    NS_ABORT_MSG_IF(sendJitter < 0.0 || sendJitter >= 1.0, "jitter must be in [0,1)");
+    NS_ABORT_MSG_IF(startWindow < 0.0, "startWindow must not be negative");
+    NS_ABORT_MSG_IF(firmwareMode != "multicast" && firmwareMode != "unicast",
+                    "firmwareMode must be multicast or unicast");
+    NS_ABORT_MSG_IF(drainRate <= 0.0, "drainRate must be positive");
+    NS_ABORT_MSG_IF(bulkSchools > nSchools, "bulkSchools exceeds the number of schools");
+    NS_ABORT_MSG_IF(videoClinics > nClinics, "videoClinics exceeds the number of clinics");
+    NS_ABORT_MSG_IF(videoFps <= 0.0, "videoFps must be positive");
+    NS_ABORT_MSG_IF(wifiSchools > nSchools, "wifiSchools exceeds the number of schools");
+    NS_ABORT_MSG_IF(webThink <= 0.0, "webThink must be positive");
+    // Pages and objects are capped at 20 times the mean and must fit in
+    // 65535 fragments of 1400 bytes
+    NS_ABORT_MSG_IF(webPageSize > 4500000, "webPageSize must be at most 4500000 bytes");
+    NS_ABORT_MSG_IF(cachePolicy != "lru" && cachePolicy != "lfu", "cachePolicy must be lru or lfu");
+    NS_ABORT_MSG_IF(contentObjects == 0, "contentObjects must be positive");
+    NS_ABORT_MSG_IF(contentMeanSize > 4500000, "contentMeanSize must be at most 4500000 bytes");
+    NS_ABORT_MSG_IF(contentInterval <= 0.0, "contentInterval must be positive");
+    NS_ABORT_MSG_IF(peakFactor <= 0.0, "peakFactor must be positive");
+    NS_ABORT_MSG_IF(prefetchUtil <= 0.0 || prefetchUtil > 1.0, "prefetchUtil must be in (0, 1]");
+    double peakStart = 0.0, peakEnd = 0.0;
+    if (!contentPeak.empty())
+    {
+        std::vector<std::string> times = SplitString(contentPeak, '-');
+        NS_ABORT_MSG_IF(times.size() != 2, "Malformed contentPeak: " << contentPeak);
+        peakStart = std::atof(times[0].c_str());
+        peakEnd = std::atof(times[1].c_str());
+        NS_ABORT_MSG_IF(peakEnd <= peakStart, "contentPeak must end after it starts");
+    }
+    NS_ABORT_MSG_IF(ntpPoll <= 0.0, "ntpPoll must be positive");
+    NS_ABORT_MSG_IF(clinicPriority != "off" && clinicPriority != "subnet" && clinicPriority != "dscp",
+                    "clinicPriority must be off, subnet or dscp");
+    // DSCP-based prioritisation has nothing to act on unless sites mark
+    if (clinicPriority == "dscp")
+    {
+        dscpMarking = true;
+    }
+    NS_ABORT_MSG_IF(!queueSizing.empty() && queueSizing != "default" && queueSizing != "bdp",
+                    "queueSizing must be default or bdp");
+    NS_ABORT_MSG_IF(bdpFactor <= 0.0, "bdpFactor must be positive");
+    NS_ABORT_MSG_IF(queueTraceFormat != "csv" && queueTraceFormat != "binary",
+                    "queueTraceFormat must be csv or binary");
+    NS_ABORT_MSG_IF(queueTraceInterval <= 0.0, "queueTraceInterval must be positive");
+    NS_ABORT_MSG_IF(!shapeRate.empty() && shapeBurst < 1500,
+                    "shapeBurst must hold at least one full-size packet (1500 bytes)");
+    NS_ABORT_MSG_IF(!siteFlood.empty() && siteFloodSchool >= nSchools, "siteFloodSchool exceeds the number of schools");
+    const std::string* aqmChoices[] = { &aqmWan, &aqmRemote, &aqmMicrogrid };
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        NS_ABORT_MSG_IF(*aqmChoices[c] != "none" && *aqmChoices[c] != "codel" && *aqmChoices[c] != "fq_codel",
+                        "AQM must be none, codel or fq_codel: " << *aqmChoices[c]);
+    }
+    NS_ABORT_MSG_IF(marketInterval <= 0.0, "marketInterval must be positive");
+    NS_ABORT_MSG_IF(scadaRegisters == 0 || scadaRegisters > ModbusHeader::MAX_READ_REGISTERS,
+                    "scadaRegisters must be between 1 and 125");
+    std::vector<SiteOutage> outages = ParseOutages(outageSpec);
+    NS_ABORT_MSG_IF(satSchools > nSchools, "satSchools exceeds the number of schools");
+    NS_ABORT_MSG_IF(satBulk > satSchools, "satBulk exceeds satSchools");
+    NS_ABORT_MSG_IF(satType != "geo" && satType != "leo", "satType must be geo or leo");
+    NS_ABORT_MSG_IF(linkErrors != "off" && linkErrors != "rate" && linkErrors != "ge",
+                    "linkErrors must be off, rate or ge");
+    const double probabilities[] = { errorRate, gePGoodBad, gePBadGood, geLossGood, geLossBad };
+    for (uint32_t i = 0; i < 5; ++i)
+    {
+        NS_ABORT_MSG_IF(probabilities[i] < 0.0 || probabilities[i] > 1.0,
+                        "Error rates and Gilbert-Elliott probabilities must be in [0, 1]");
+    }
+    NS_ABORT_MSG_IF(weatherMode != "off" && weatherMode != "file" && weatherMode != "rain",
+                    "weather must be off, file or rain");
+    NS_ABORT_MSG_IF(rainGap <= 0.0 || rainFade <= 0.0 || weatherBin <= 0.0,
+                    "rainGap, rainFade and weatherBin must be positive");
+    NS_ABORT_MSG_IF(rainMinFactor <= 0.0 || rainMinFactor > 0.75, "rainMinFactor must be in (0, 0.75]");
+    NS_ABORT_MSG_IF(powerMode != "off" && powerMode != "schedule" && powerMode != "solar",
+                    "power must be off, schedule or solar");
+    NS_ABORT_MSG_IF(powerMode != "off" && !outages.empty(),
+                    "Uplink outages and power outages both switch the access links; use one or the other");
+    NS_ABORT_MSG_IF(dayLength <= 0.0 || batteryHours <= 0.0 || pvRatio < 0.0,
+                    "dayLength and batteryHours must be positive, pvRatio non-negative");
+    NS_ABORT_MSG_IF(reconnectLevel <= 0.0 || reconnectLevel > 1.0, "reconnectLevel must be in (0, 1]");
+    std::vector<SiteOutage> powerOutages;
+    if (powerMode == "schedule")
+    {
+        powerOutages = ParseOutages(powerSchedule);
+    }
+    else if (powerMode == "solar")
+    {
+        SolarModel solar = { dayLength, std::fmod(dayStartHour, 24.0), pvRatio, batteryHours, cloudyDays, reconnectLevel };
+        Ptr<UniformRandomVariable> weatherRng = CreateObject<UniformRandomVariable>();
+        const std::string classes[] = { "school", "clinic", "microgrid" };
+        const uint32_t counts[] = { nSchools, nClinics, nMicrogrids };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            std::vector<SiteOutage> generated = SimulateSolarOutages(classes[c], counts[c], solar, simulationTime, weatherRng);
+            powerOutages.insert(powerOutages.end(), generated.begin(), generated.end());
+        }
+    }
+
     if (verbose)
     {
         LogComponentEnable("SolarEnergyWAN", LOG_LEVEL_INFO);
@@ -88,6 +7550,9 @@ int main(int argc, char* argv[])
     std::cout << "  Solar-Powered Clinics:    " << nClinics << "\n";
     std::cout << "  Community Micro-grids:    " << nMicrogrids << "\n";
     std::cout << "  Simulation Time:          " << simulationTime << " seconds\n";
+    std::cout << "  Site Start Window:        [" << appStart << ", "
+              << (appStart + startWindow) << "] seconds\n";
+    std::cout << "  Send Jitter:              +/- " << (sendJitter * 100.0) << " %\n";
     std::cout << "================================================================\n\n";
 
     // ========================================================================
@@ -120,6 +7585,13 @@ int main(int argc, char* argv[])
     NodeContainer microgrids;
     microgrids.Create(nMicrogrids);
 
+    // Wi-Fi stations (classroom computers) behind the first wifiSchools schools
+    NodeContainer* schoolStations = new NodeContainer[wifiSchools];
+    for (uint32_t i = 0; i < wifiSchools; ++i)
+    {
+        schoolStations[i].Create(wifiStations);
+    }
+
     NS_LOG_INFO("Network nodes created successfully");
 
     // ========================================================================
@@ -135,6 +7607,10 @@ int main(int argc, char* argv[])
     stack.Install(solarSchools);
     stack.Install(solarClinics);
     stack.Install(microgrids);
+    for (uint32_t i = 0; i < wifiSchools; ++i)
+    {
+        stack.Install(schoolStations[i]);
+    }
 
     // ========================================================================
     // CONFIGURE POINT-TO-POINT LINKS
@@ -168,11 +7644,36 @@ int main(int argc, char* argv[])
     NetDeviceContainer devWAN12 = p2pWAN.Install(wanRouters.Get(1), wanRouters.Get(2));
     NetDeviceContainer devWAN20 = p2pWAN.Install(wanRouters.Get(2), wanRouters.Get(0));
 
-    // Connect solar schools to WAN Router 1 (Education Network)
+    // Satellite access for the remotest schools
+    SatelliteProfile satProfile = GetSatelliteProfile(satType);
+    if (!satUp.empty())
+    {
+        satProfile.uplink = satUp;
+    }
+    if (!satDown.empty())
+    {
+        satProfile.downlink = satDown;
+    }
+    PointToPointHelper p2pSatellite;
+    p2pSatellite.SetChannelAttribute("Delay", TimeValue(MilliSeconds(satProfile.baseDelay)));
+    Ptr<UniformRandomVariable> satDelayRng = CreateObject<UniformRandomVariable>();
+    const uint32_t firstSatSchool = nSchools - satSchools;
+
+    // Connect solar schools to WAN Router 1 (Education Network); the last
+    // satSchools of them over satellite
     NetDeviceContainer* schoolDevices = new NetDeviceContainer[nSchools];
     for (uint32_t i = 0; i < nSchools; ++i)
     {
-        schoolDevices[i] = p2pRemote.Install(solarSchools.Get(i), wanRouters.Get(1));
+        if (i < firstSatSchool)
+        {
+            schoolDevices[i] = p2pRemote.Install(solarSchools.Get(i), wanRouters.Get(1));
+            continue;
+        }
+        schoolDevices[i] = p2pSatellite.Install(solarSchools.Get(i), wanRouters.Get(1));
+        schoolDevices[i].Get(0)->SetAttribute("DataRate", DataRateValue(DataRate(satProfile.uplink)));
+        schoolDevices[i].Get(1)->SetAttribute("DataRate", DataRateValue(DataRate(satProfile.downlink)));
+        Ptr<PointToPointChannel> channel = DynamicCast<PointToPointChannel>(schoolDevices[i].Get(0)->GetChannel());
+        Simulator::Schedule(Seconds(0.0), &VarySatelliteDelay, channel, satProfile, satDelayRng);
     }
 
     // Connect solar clinics to WAN Router 2 (Healthcare Network)
@@ -186,7 +7687,87 @@ int main(int argc, char* argv[])
     NetDeviceContainer* microgridDevices = new NetDeviceContainer[nMicrogrids];
     for (uint32_t i = 0; i < nMicrogrids; ++i)
     {
-        microgridDevices[i] = p2pMicrogrid.Install(microgrids.Get(i), wanRouters.Get(0));
+        if (enableRohc)
+        {
+            microgridDevices[i] = InstallRohcLink(microgrids.Get(i), wanRouters.Get(0), "10Mbps", "5ms");
+        }
+        else
+        {
+            microgridDevices[i] = p2pMicrogrid.Install(microgrids.Get(i), wanRouters.Get(0));
+        }
+    }
+
+    // Receive error models on the school/clinic and micro-grid links, one per
+    // device so burst state is never shared between links or directions
+    const char* errorClassNames[] = { "School/Clinic", "Micro-grid" };
+    ErrorLoss errorLoss[2] = { { 0, 0 }, { 0, 0 } };
+    if (linkErrors != "off")
+    {
+        for (uint32_t c = 0; c < 2; ++c)
+        {
+            NetDeviceContainer lossy;
+            for (uint32_t i = 0; c == 0 && i < nSchools; ++i)
+            {
+                lossy.Add(schoolDevices[i]);
+            }
+            for (uint32_t i = 0; c == 0 && i < nClinics; ++i)
+            {
+                lossy.Add(clinicDevices[i]);
+            }
+            for (uint32_t i = 0; c == 1 && i < nMicrogrids; ++i)
+            {
+                lossy.Add(microgridDevices[i]);
+            }
+            for (uint32_t d = 0; d < lossy.GetN(); ++d)
+            {
+                Ptr<ErrorModel> model;
+                if (linkErrors == "rate")
+                {
+                    Ptr<RateErrorModel> rate = CreateObject<RateErrorModel>();
+                    rate->SetUnit(RateErrorModel::ERROR_UNIT_PACKET);
+                    rate->SetRate(errorRate);
+                    model = rate;
+                }
+                else
+                {
+                    Ptr<GilbertElliottErrorModel> burst = CreateObject<GilbertElliottErrorModel>();
+                    burst->Setup(gePGoodBad, gePBadGood, geLossGood, geLossBad);
+                    model = burst;
+                }
+                DynamicCast<PointToPointNetDevice>(lossy.Get(d))->SetReceiveErrorModel(model);
+                lossy.Get(d)->TraceConnectWithoutContext("PhyRxDrop", MakeBoundCallback(&CountErrorLoss, &errorLoss[c]));
+            }
+        }
+    }
+
+    // School Wi-Fi LANs: the school node is the access point and routes its
+    // stations over the school uplink. Every LAN gets its own channel, so
+    // schools never interfere with each other and the PHY cost per school
+    // stays bounded by its own station count.
+    NetDeviceContainer* schoolLanDevices = new NetDeviceContainer[wifiSchools];
+    if (wifiSchools > 0)
+    {
+        YansWifiChannelHelper wifiChannel = YansWifiChannelHelper::Default();
+        YansWifiPhyHelper wifiPhy = YansWifiPhyHelper::Default();
+        WifiHelper wifi;
+        wifi.SetStandard(WIFI_PHY_STANDARD_80211a);
+        wifi.SetRemoteStationManager("ns3::ConstantRateWifiManager",
+                                     "DataMode", StringValue("OfdmRate24Mbps"),
+                                     "ControlMode", StringValue("OfdmRate6Mbps"));
+        WifiMacHelper wifiMac;
+        for (uint32_t i = 0; i < wifiSchools; ++i)
+        {
+            std::ostringstream ssidName;
+            ssidName << "school-" << (i + 1);
+            Ssid ssid(ssidName.str());
+            wifiPhy.SetChannel(wifiChannel.Create());
+
+            wifiMac.SetType("ns3::ApWifiMac", "Ssid", SsidValue(ssid));
+            schoolLanDevices[i] = wifi.Install(wifiPhy, wifiMac, solarSchools.Get(i));
+            wifiMac.SetType("ns3::StaWifiMac", "Ssid", SsidValue(ssid),
+                            "ActiveProbing", BooleanValue(false));
+            schoolLanDevices[i].Add(wifi.Install(wifiPhy, wifiMac, schoolStations[i]));
+        }
     }
 
     // ========================================================================
@@ -206,6 +7787,174 @@ int main(int argc, char* argv[])
     mobility.Install(solarClinics);
     mobility.Install(microgrids);
 
+    // Stations sit on a 5 m grid around their access point
+    if (wifiSchools > 0)
+    {
+        MobilityHelper lanMobility;
+        lanMobility.SetPositionAllocator("ns3::GridPositionAllocator",
+                                         "MinX", DoubleValue(5.0), "MinY", DoubleValue(5.0),
+                                         "DeltaX", DoubleValue(5.0), "DeltaY", DoubleValue(5.0),
+                                         "GridWidth", UintegerValue(4),
+                                         "LayoutType", StringValue("RowFirst"));
+        lanMobility.SetMobilityModel("ns3::ConstantPositionMobilityModel");
+        for (uint32_t i = 0; i < wifiSchools; ++i)
+        {
+            lanMobility.Install(schoolStations[i]);
+        }
+    }
+
+    // ========================================================================
+    // CONFIGURE TRAFFIC CONTROL
+    // ========================================================================
+
+    // Queue discs must be in place before addresses are assigned, or the
+    // address helper installs the default pfifo_fast on every device
+
+    // Point-to-point devices of each link class, both ends
+    const char* linkClassNames[] = { "Backbone", "School/Clinic", "Micro-grid" };
+    NetDeviceContainer linkClasses[3];
+    linkClasses[0].Add(devCentralWAN0);
+    linkClasses[0].Add(devMonitorWAN0);
+    linkClasses[0].Add(devWAN01);
+    linkClasses[0].Add(devWAN12);
+    linkClasses[0].Add(devWAN20);
+    for (uint32_t i = 0; i < nSchools; ++i)
+    {
+        linkClasses[1].Add(schoolDevices[i]);
+    }
+    for (uint32_t i = 0; i < nClinics; ++i)
+    {
+        linkClasses[1].Add(clinicDevices[i]);
+    }
+    for (uint32_t i = 0; i < nMicrogrids; ++i)
+    {
+        linkClasses[2].Add(microgridDevices[i]);
+    }
+
+    // Clinic prioritisation: every router egress on the path between the
+    // clinics and the central station, in both directions
+    QueueDiscContainer clinicQueueDiscs;
+    if (clinicPriority != "off")
+    {
+        NetDeviceContainer clinicPath;
+        clinicPath.Add(devCentralWAN0);         // Central egress and router 0 towards central
+        clinicPath.Add(devWAN20);               // Router 2 <-> router 0
+        clinicPath.Add(devWAN12.Get(1));        // Router 2 towards router 1
+        for (uint32_t i = 0; i < nClinics; ++i)
+        {
+            clinicPath.Add(clinicDevices[i].Get(1));
+        }
+
+        TrafficControlHelper prio;
+        uint16_t handle = prio.SetRootQueueDisc("ns3::PrioQueueDisc");
+        TrafficControlHelper::ClassIdList bands = prio.AddQueueDiscClasses(handle, 2, "ns3::QueueDiscClass");
+        prio.AddChildQueueDisc(handle, bands[0], "ns3::FifoQueueDisc");
+        prio.AddChildQueueDisc(handle, bands[1], "ns3::FifoQueueDisc");
+        clinicQueueDiscs = prio.Install(clinicPath);
+        for (uint32_t i = 0; i < clinicQueueDiscs.GetN(); ++i)
+        {
+            Ptr<ClinicPacketFilter> filter = CreateObject<ClinicPacketFilter>();
+            filter->SetMode(clinicPriority == "dscp" ? ClinicPacketFilter::BY_DSCP : ClinicPacketFilter::BY_SUBNET);
+            clinicQueueDiscs.Get(i)->AddPacketFilter(filter);
+
+            // A one-packet device queue keeps the backlog in the queue disc,
+            // where the priority applies
+            DynamicCast<PointToPointNetDevice>(clinicPath.Get(i))->GetQueue()->SetMaxSize(QueueSize("1p"));
+        }
+    }
+
+    // Token-bucket shapers on the site side of every access link. The device
+    // queue keeps its default size: the shaper releases traffic below the line
+    // rate, so the device never holds more than a burst.
+    std::vector<Ptr<NetDevice> > shapedUplinks;
+    for (uint32_t i = 0; i < nSchools; ++i)
+    {
+        shapedUplinks.push_back(schoolDevices[i].Get(0));
+    }
+    for (uint32_t i = 0; i < nClinics; ++i)
+    {
+        shapedUplinks.push_back(clinicDevices[i].Get(0));
+    }
+    for (uint32_t i = 0; i < nMicrogrids; ++i)
+    {
+        shapedUplinks.push_back(microgridDevices[i].Get(0));
+    }
+    QueueDiscContainer shaperQueueDiscs;
+    std::deque<ShaperStats> shaperStats;
+    if (!shapeRate.empty())
+    {
+        TrafficControlHelper tbf;
+        tbf.SetRootQueueDisc("ns3::TbfQueueDisc",
+                             "Rate", DataRateValue(DataRate(shapeRate)),
+                             "Burst", UintegerValue(shapeBurst));
+        for (uint32_t i = 0; i < shapedUplinks.size(); ++i)
+        {
+            Ptr<QueueDisc> shaper = tbf.Install(shapedUplinks[i]).Get(0);
+            ShaperStats empty = { 0, 0, SampleStats() };
+            shaperStats.push_back(empty);
+            shaper->TraceConnectWithoutContext("Dequeue", MakeBoundCallback(&RecordShaperDequeue, &shaperStats.back()));
+            shaperQueueDiscs.Add(shaper);
+        }
+    }
+
+    // AQM per link class; devices that already carry the clinic priority
+    // queue disc or a shaper keep it
+    QueueDiscContainer aqmQueueDiscs[3];
+    SampleStats aqmSojourn[3];
+    SampleStats aqmStanding[3];
+    std::deque<SojournTracker> sojournTrackers;
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        if (*aqmChoices[c] == "none")
+        {
+            continue;
+        }
+        TrafficControlHelper aqm;
+        aqm.SetRootQueueDisc(*aqmChoices[c] == "codel" ? "ns3::CoDelQueueDisc" : "ns3::FqCoDelQueueDisc");
+        for (uint32_t d = 0; d < linkClasses[c].GetN(); ++d)
+        {
+            Ptr<NetDevice> device = linkClasses[c].Get(d);
+            if (HasRootQueueDisc(device))
+            {
+                continue;
+            }
+            QueueDiscContainer installed = aqm.Install(device);
+            DynamicCast<PointToPointNetDevice>(device)->GetQueue()->SetMaxSize(QueueSize("1p"));
+
+            SojournTracker tracker = { &aqmSojourn[c], &aqmStanding[c], Seconds(0.0), 0.0 };
+            sojournTrackers.push_back(tracker);
+            installed.Get(0)->TraceConnectWithoutContext("SojournTime",
+                                                         MakeBoundCallback(&RecordSojourn, &sojournTrackers.back()));
+            aqmQueueDiscs[c].Add(installed.Get(0));
+        }
+    }
+
+    // BDP sizing: every device still on the default gets the usual pfifo_fast
+    // limited to bdpFactor x BDP packets, and a one-packet device queue so
+    // that limit is the whole buffer
+    uint32_t bdpLimit[3] = { 0, 0, 0 };
+    if (queueSizing == "bdp")
+    {
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t d = 0; d < linkClasses[c].GetN(); ++d)
+            {
+                Ptr<NetDevice> device = linkClasses[c].Get(d);
+                if (HasRootQueueDisc(device))
+                {
+                    continue;
+                }
+                uint32_t limit = BdpPackets(device, bdpFactor);
+                TrafficControlHelper sized;
+                sized.SetRootQueueDisc("ns3::PfifoFastQueueDisc",
+                                       "MaxSize", QueueSizeValue(QueueSize(QueueSizeUnit::PACKETS, limit)));
+                sized.Install(device);
+                DynamicCast<PointToPointNetDevice>(device)->GetQueue()->SetMaxSize(QueueSize("1p"));
+                bdpLimit[c] = std::max(bdpLimit[c], limit);
+            }
+        }
+    }
+
     // ========================================================================
     // ASSIGN IP ADDRESSES
     // ========================================================================
@@ -230,13 +7979,18 @@ int main(int argc, char* argv[])
     address.SetBase("10.2.3.0", "255.255.255.0");
     address.Assign(devWAN20);
 
+    // Site-side addresses, used by applications that contact the sites
+    std::vector<Ipv4Address> schoolAddresses;
+    std::vector<Ipv4Address> clinicAddresses;
+    std::vector<Ipv4Address> microgridAddresses;
+
     // Solar Schools Network: 172.16.x.0/24 (Education Network)
     for (uint32_t i = 0; i < nSchools; ++i)
     {
         std::ostringstream subnet;
         subnet << "172.16." << (i + 1) << ".0";
         address.SetBase(subnet.str().c_str(), "255.255.255.0");
-        address.Assign(schoolDevices[i]);
+        schoolAddresses.push_back(address.Assign(schoolDevices[i]).GetAddress(0));
     }
 
     // Solar Clinics Network: 172.17.x.0/24 (Healthcare Network)
@@ -245,7 +7999,7 @@ int main(int argc, char* argv[])
         std::ostringstream subnet;
         subnet << "172.17." << (i + 1) << ".0";
         address.SetBase(subnet.str().c_str(), "255.255.255.0");
-        address.Assign(clinicDevices[i]);
+        clinicAddresses.push_back(address.Assign(clinicDevices[i]).GetAddress(0));
     }
 
     // Community Micro-grids: 192.168.x.0/24
@@ -254,7 +8008,16 @@ int main(int argc, char* argv[])
         std::ostringstream subnet;
         subnet << "192.168." << (i + 1) << ".0";
         address.SetBase(subnet.str().c_str(), "255.255.255.0");
-        address.Assign(microgridDevices[i]);
+        microgridAddresses.push_back(address.Assign(microgridDevices[i]).GetAddress(0));
+    }
+
+    // School Wi-Fi LANs: 10.16.x.0/24, access point first
+    for (uint32_t i = 0; i < wifiSchools; ++i)
+    {
+        std::ostringstream subnet;
+        subnet << "10.16." << (i + 1) << ".0";
+        address.SetBase(subnet.str().c_str(), "255.255.255.0");
+        address.Assign(schoolLanDevices[i]);
     }
 
     // Enable global routing
@@ -262,59 +8025,705 @@ int main(int argc, char* argv[])
 
     NS_LOG_INFO("IP addressing and routing configured");
 
+    // Buffer-induced latency on every point-to-point device
+    SampleStats bufferDelay[3];
+    std::deque<BufferTracker> bufferTrackers;
+    if (!queueSizing.empty())
+    {
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t d = 0; d < linkClasses[c].GetN(); ++d)
+            {
+                Ptr<PointToPointNetDevice> device = DynamicCast<PointToPointNetDevice>(linkClasses[c].Get(d));
+                DataRateValue rate;
+                device->GetAttribute("DataRate", rate);
+                BufferTracker tracker = { RootQueueDisc(device), device->GetQueue(),
+                                          static_cast<double>(rate.Get().GetBitRate()), &bufferDelay[c] };
+                bufferTrackers.push_back(tracker);
+                tracker.disc->TraceConnectWithoutContext("Enqueue",
+                                                         MakeBoundCallback(&RecordBufferDelay, &bufferTrackers.back()));
+            }
+        }
+    }
+
+    // Per-DSCP accounting on every router interface. Address assignment has
+    // given each device a root queue disc by now.
+    std::deque<DscpAccount> dscpAccounts;
+    if (dscpMarking)
+    {
+        for (uint32_t r = 0; r < wanRouters.GetN(); ++r)
+        {
+            Ptr<Node> router = wanRouters.Get(r);
+            Ptr<TrafficControlLayer> tc = router->GetObject<TrafficControlLayer>();
+            Ptr<Ipv4> ipv4 = router->GetObject<Ipv4>();
+            for (uint32_t d = 0; d < router->GetNDevices(); ++d)
+            {
+                Ptr<NetDevice> device = router->GetDevice(d);
+                Ptr<QueueDisc> root = tc->GetRootQueueDiscOnDevice(device);
+                int32_t interface = ipv4->GetInterfaceForDevice(device);
+                if (!root || interface < 0)
+                {
+                    continue;
+                }
+                std::ostringstream name;
+                name << "Router " << r << " (" << ipv4->GetAddress(interface, 0).GetLocal() << ")";
+                DscpAccount account;
+                account.name = name.str();
+                dscpAccounts.push_back(account);
+                root->TraceConnectWithoutContext("Dequeue", MakeBoundCallback(&CountDscpDequeue, &dscpAccounts.back()));
+                root->TraceConnectWithoutContext("Drop", MakeBoundCallback(&CountDscpDrop, &dscpAccounts.back()));
+            }
+        }
+    }
+
+    // Queue occupancy time series of every router interface
+    QueueOccupancySampler queueSampler;
+    if (!queueTrace.empty())
+    {
+        for (uint32_t r = 0; r < wanRouters.GetN(); ++r)
+        {
+            Ptr<Node> router = wanRouters.Get(r);
+            Ptr<Ipv4> ipv4 = router->GetObject<Ipv4>();
+            for (uint32_t d = 0; d < router->GetNDevices(); ++d)
+            {
+                Ptr<PointToPointNetDevice> device = DynamicCast<PointToPointNetDevice>(router->GetDevice(d));
+                if (!device || !HasRootQueueDisc(device))
+                {
+                    continue;
+                }
+                std::ostringstream name;
+                name << "r" << r << "/" << ipv4->GetAddress(ipv4->GetInterfaceForDevice(device), 0).GetLocal();
+                queueSampler.AddInterface(name.str(), RootQueueDisc(device), device->GetQueue());
+            }
+        }
+        NS_ABORT_MSG_IF(!queueSampler.Open(queueTrace,
+                                           queueTraceFormat == "binary" ? QueueOccupancySampler::BINARY
+                                                                        : QueueOccupancySampler::CSV,
+                                           queueTraceBuffer),
+                        "Cannot open queue trace file " << queueTrace);
+        queueSampler.Start(Seconds(queueTraceInterval), Seconds(simulationTime));
+    }
+
     // ========================================================================
     // CONFIGURE APPLICATIONS
     // ========================================================================
     
     NS_LOG_INFO("Installing monitoring applications...");
 
-    uint16_t port = 9;
+    uint16_t port = 9;
+
+    // Central Station Server (receives energy data and management commands)
+    UdpEchoServerHelper centralServer(port);
+    ApplicationContainer serverApps = centralServer.Install(centralStation.Get(0));
+    serverApps.Start(Seconds(1.0));
+    serverApps.Stop(Seconds(simulationTime));
+
+    Address centralAddress(InetSocketAddress(ifCentralWAN.GetAddress(0), port));
+
+    // Every site starts at a random instant inside the start window rather than
+    // on a linear stagger, so large site counts still start within the run.
+    Ptr<UniformRandomVariable> startRng = CreateObject<UniformRandomVariable>();
+    std::vector<Ptr<TelemetryClient> > schoolClients;
+    std::vector<Ptr<TelemetryClient> > clinicClients;
+    std::vector<Ptr<TelemetryClient> > microgridClients;
+
+    // With DSCP marking, clinic readings (the alarm path) are EF and the other
+    // sites' telemetry AF21; bulk uploads and everything else stay best effort
+    const uint8_t clinicTos = dscpMarking ? Ipv4Header::DSCP_EF << 2 : 0;
+    const uint8_t telemetryTos = dscpMarking ? Ipv4Header::DSCP_AF21 << 2 : 0;
+
+    // Solar Schools send energy usage data and receive power management
+    for (uint32_t i = 0; i < nSchools; ++i)
+    {
+        Ptr<TelemetryClient> schoolClient = CreateObject<TelemetryClient>();
+        schoolClient->Setup(centralAddress, 256, 100, Seconds(0.5), sendJitter); // Small data packets
+        schoolClient->SetTos(telemetryTos);
+        if (storeForward)
+        {
+            schoolClient->EnableStoreAndForward(schoolDevices[i].Get(0), bufferSize, drainRate);
+        }
+        solarSchools.Get(i)->AddApplication(schoolClient);
+        schoolClient->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+        schoolClient->SetStopTime(Seconds(simulationTime));
+        schoolClients.push_back(schoolClient);
+    }
+
+    // Solar Clinics send critical health facility data
+    for (uint32_t i = 0; i < nClinics; ++i)
+    {
+        Ptr<TelemetryClient> clinicClient = CreateObject<TelemetryClient>();
+        clinicClient->Setup(centralAddress, 512, 150, Seconds(0.3), sendJitter); // More frequent, larger packets
+        clinicClient->SetTos(clinicTos);
+        if (storeForward)
+        {
+            clinicClient->EnableStoreAndForward(clinicDevices[i].Get(0), bufferSize, drainRate);
+        }
+        solarClinics.Get(i)->AddApplication(clinicClient);
+        clinicClient->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+        clinicClient->SetStopTime(Seconds(simulationTime));
+        clinicClients.push_back(clinicClient);
+    }
+
+    // Community Micro-grids send energy production/consumption data
+    for (uint32_t i = 0; i < nMicrogrids; ++i)
+    {
+        Ptr<TelemetryClient> microgridClient = CreateObject<TelemetryClient>();
+        microgridClient->Setup(centralAddress, 128, 80, Seconds(0.8), sendJitter);
+        microgridClient->SetTos(telemetryTos);
+        if (storeForward)
+        {
+            microgridClient->EnableStoreAndForward(microgridDevices[i].Get(0), bufferSize, drainRate);
+        }
+        microgrids.Get(i)->AddApplication(microgridClient);
+        microgridClient->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+        microgridClient->SetStopTime(Seconds(simulationTime));
+        microgridClients.push_back(microgridClient);
+    }
+
+    // Monitoring Center actively sweeps every site (each site answers polls
+    // with a small echo responder)
+    uint16_t pollPort = 161;
+    Ptr<SitePoller> poller;
+    if (enablePoller)
+    {
+        std::vector<Address> pollTargets;
+        NodeContainer allSites(solarSchools, solarClinics);
+        allSites.Add(microgrids);
+        for (uint32_t i = 0; i < nSchools; ++i)
+        {
+            pollTargets.push_back(InetSocketAddress(schoolAddresses[i], pollPort));
+        }
+        for (uint32_t i = 0; i < nClinics; ++i)
+        {
+            pollTargets.push_back(InetSocketAddress(clinicAddresses[i], pollPort));
+        }
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            pollTargets.push_back(InetSocketAddress(microgridAddresses[i], pollPort));
+        }
+
+        UdpEchoServerHelper pollResponder(pollPort);
+        ApplicationContainer responderApps = pollResponder.Install(allSites);
+        responderApps.Start(Seconds(1.0));
+        responderApps.Stop(Seconds(simulationTime));
+
+        poller = CreateObject<SitePoller>();
+        poller->Setup(pollTargets, 64, pollConcurrency, Seconds(pollTimeout), Seconds(pollInterval));
+        monitoringCenter.Get(0)->AddApplication(poller);
+        poller->SetStartTime(Seconds(appStart));
+        poller->SetStopTime(Seconds(simulationTime));
+    }
+
+    // SCADA master on the central station polls the micro-grid controllers
+    uint16_t modbusPort = 502;
+    const uint16_t scadaTableSize = 256;                 // Holding registers per controller
+    const Time scadaProcessing = MilliSeconds(2);        // Controller service time per request
+    Ptr<ModbusMaster> scadaMaster;
+    if (enableScada && nMicrogrids > 0)
+    {
+        std::vector<Address> slaves;
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            Ptr<ModbusSlave> slave = CreateObject<ModbusSlave>();
+            slave->Setup(modbusPort, scadaTableSize, scadaProcessing);
+            microgrids.Get(i)->AddApplication(slave);
+            slave->SetStartTime(Seconds(1.0));
+            slave->SetStopTime(Seconds(simulationTime));
+            slaves.push_back(InetSocketAddress(microgridAddresses[i], modbusPort));
+        }
+
+        scadaMaster = CreateObject<ModbusMaster>();
+        scadaMaster->Setup(slaves, 0, scadaOutstanding, Seconds(scadaTimeout), Seconds(scadaInterval));
+        scadaMaster->SetRegisters(0, scadaRegisters);
+        centralStation.Get(0)->AddApplication(scadaMaster);
+        scadaMaster->SetStartTime(Seconds(appStart));
+        scadaMaster->SetStopTime(Seconds(simulationTime));
+    }
+
+    // Topic broker on the central station: every site publishes its readings
+    // and the monitoring center hosts the subscribing consumers
+    uint16_t brokerPort = 1883;
+    Ptr<PubSubBroker> broker;
+    std::vector<std::string> subscriberNames;
+    std::vector<Ptr<TopicSubscriber> > subscribers;
+    if (enablePubSub)
+    {
+        Address brokerAddress(InetSocketAddress(ifCentralWAN.GetAddress(0), brokerPort));
+        broker = CreateObject<PubSubBroker>();
+        broker->Setup(brokerPort);
+        centralStation.Get(0)->AddApplication(broker);
+        broker->SetStartTime(Seconds(1.0));
+        broker->SetStopTime(Seconds(simulationTime));
+
+        NodeContainer* siteClasses[] = { &solarSchools, &solarClinics, &microgrids };
+        const char* topicRoots[] = { "school", "clinic", "microgrid" };
+        uint32_t payloadSizes[] = { 256, 512, 128 };
+        double intervals[] = { 0.5, 0.3, 0.8 };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t i = 0; i < siteClasses[c]->GetN(); ++i)
+            {
+                std::ostringstream topic;
+                topic << topicRoots[c] << "/" << (i + 1) << "/energy";
+                Ptr<TopicPublisher> publisher = CreateObject<TopicPublisher>();
+                publisher->Setup(brokerAddress, topic.str(), payloadSizes[c],
+                                 Seconds(intervals[c]), sendJitter);
+                siteClasses[c]->Get(i)->AddApplication(publisher);
+                publisher->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+                publisher->SetStopTime(Seconds(simulationTime));
+            }
+        }
+
+        std::vector<std::string> entries = SplitString(subscriberSpec, ';');
+        for (uint32_t i = 0; i < entries.size(); ++i)
+        {
+            std::string::size_type eq = entries[i].find('=');
+            NS_ABORT_MSG_IF(eq == std::string::npos, "Malformed subscriber entry: " << entries[i]);
+            Ptr<TopicSubscriber> subscriber = CreateObject<TopicSubscriber>();
+            subscriber->Setup(brokerAddress, brokerPort + 1 + i,
+                              SplitString(entries[i].substr(eq + 1), ','));
+            monitoringCenter.Get(0)->AddApplication(subscriber);
+            subscriber->SetStartTime(Seconds(1.0));
+            subscriber->SetStopTime(Seconds(simulationTime));
+            subscriberNames.push_back(entries[i]);
+            subscribers.push_back(subscriber);
+        }
+    }
+
+    // Firmware push from the central station to every micro-grid controller.
+    // Multicast uses a static tree: central station -> router 0 -> all
+    // micro-grid links.
+    uint16_t firmwarePort = 6969;
+    Ptr<FirmwareSender> firmwareSender;
+    std::vector<Ptr<FirmwareReceiver> > firmwareReceivers;
+    PortTrafficCounter firmwareBackbone = { firmwarePort, 0, 0 };
+    PortTrafficCounter firmwareAccess = { firmwarePort, 0, 0 };
+    if (enableFirmware)
+    {
+        bool multicast = (firmwareMode == "multicast");
+        Ipv4Address firmwareGroup("225.1.1.1");
+        if (multicast)
+        {
+            NetDeviceContainer treeBranches;
+            for (uint32_t i = 0; i < nMicrogrids; ++i)
+            {
+                treeBranches.Add(microgridDevices[i].Get(1));
+            }
+            Ipv4StaticRoutingHelper multicastRouting;
+            multicastRouting.SetDefaultMulticastRoute(centralStation.Get(0), devCentralWAN0.Get(0));
+            multicastRouting.AddMulticastRoute(wanRouters.Get(0), ifCentralWAN.GetAddress(0),
+                                               firmwareGroup, devCentralWAN0.Get(1), treeBranches);
+        }
+
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            Ptr<FirmwareReceiver> receiver = CreateObject<FirmwareReceiver>();
+            receiver->Setup(firmwarePort);
+            microgrids.Get(i)->AddApplication(receiver);
+            receiver->SetStartTime(Seconds(1.0));
+            receiver->SetStopTime(Seconds(simulationTime));
+            firmwareReceivers.push_back(receiver);
+        }
+
+        firmwareSender = CreateObject<FirmwareSender>();
+        firmwareSender->Setup(microgridAddresses, multicast, firmwareGroup, firmwarePort,
+                              firmwareSize, 1024, DataRate(firmwareRate));
+        centralStation.Get(0)->AddApplication(firmwareSender);
+        firmwareSender->SetStartTime(Seconds(firmwareStart));
+        firmwareSender->SetStopTime(Seconds(simulationTime));
+
+        // Backbone = central station link plus the router mesh
+        WatchPortTraffic(devCentralWAN0, &firmwareBackbone);
+        WatchPortTraffic(devWAN01, &firmwareBackbone);
+        WatchPortTraffic(devWAN12, &firmwareBackbone);
+        WatchPortTraffic(devWAN20, &firmwareBackbone);
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            WatchPortTraffic(microgridDevices[i], &firmwareAccess);
+        }
+    }
+
+    // Daily e-learning log and backup uploads from the first bulkSchools
+    // schools, and from the last satBulk, over TCP, sharing the remote and
+    // central links with telemetry
+    uint16_t bulkPort = 50000;
+    BulkTransferTracker bulkTracker;
+    bulkTracker.target = bulkBytes;
+    std::vector<Ipv4Address> bulkSenders;
+    std::vector<uint32_t> bulkSenderSchools;
+    std::vector<bool> schoolUploads(nSchools, false);
+    if (bulkSchools > 0 || satBulk > 0)
+    {
+        PacketSinkHelper bulkSink("ns3::TcpSocketFactory",
+                                  InetSocketAddress(Ipv4Address::GetAny(), bulkPort));
+        ApplicationContainer sinkApps = bulkSink.Install(centralStation.Get(0));
+        sinkApps.Start(Seconds(1.0));
+        sinkApps.Stop(Seconds(simulationTime));
+        sinkApps.Get(0)->TraceConnectWithoutContext("Rx", MakeBoundCallback(&TrackBulkRx, &bulkTracker));
+
+        BulkSendHelper bulkSender("ns3::TcpSocketFactory",
+                                  InetSocketAddress(ifCentralWAN.GetAddress(0), bulkPort));
+        bulkSender.SetAttribute("MaxBytes", UintegerValue(bulkBytes));
+        bulkSender.SetAttribute("SendSize", UintegerValue(1448));
+        for (uint32_t i = 0; i < nSchools; ++i)
+        {
+            if (i >= bulkSchools && i < nSchools - satBulk)
+            {
+                continue;
+            }
+            ApplicationContainer bulkApp = bulkSender.Install(solarSchools.Get(i));
+            bulkApp.Start(Seconds(bulkStart));
+            bulkApp.Stop(Seconds(simulationTime));
+            bulkSenders.push_back(schoolAddresses[i]);
+            bulkSenderSchools.push_back(i);
+            schoolUploads[i] = true;
+        }
+    }
+
+    // Teleconsultation video from the first videoClinics clinics to the
+    // central station
+    uint16_t videoPort = 5004;
+    Ptr<VideoReceiver> videoReceiver;
+    std::vector<Ptr<VideoSender> > videoSenders;
+    if (videoClinics > 0)
+    {
+        videoReceiver = CreateObject<VideoReceiver>();
+        videoReceiver->Setup(videoPort, Seconds(videoDeadline / 1000.0));
+        centralStation.Get(0)->AddApplication(videoReceiver);
+        videoReceiver->SetStartTime(Seconds(1.0));
+        videoReceiver->SetStopTime(Seconds(simulationTime));
+
+        Address videoAddress(InetSocketAddress(ifCentralWAN.GetAddress(0), videoPort));
+        for (uint32_t i = 0; i < videoClinics; ++i)
+        {
+            for (uint32_t k = 0; k < videoSessions; ++k)
+            {
+                Ptr<VideoSender> sender = CreateObject<VideoSender>();
+                sender->Setup(videoAddress, videoSenders.size(), DataRate(videoRate), videoFps,
+                              videoGop, 1400);
+                solarClinics.Get(i)->AddApplication(sender);
+                sender->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+                // Stop one deadline early so the last frames are not miscounted as lost
+                sender->SetStopTime(Seconds(simulationTime - videoDeadline / 1000.0));
+                videoSenders.push_back(sender);
+            }
+        }
+    }
+
+    // Demand-response commands from the central station to every micro-grid
+    uint16_t drPort = 20000;
+    Ptr<DemandResponseController> drController;
+    if (enableDemandResponse && nMicrogrids > 0)
+    {
+        std::vector<Address> drTargets;
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            Ptr<DemandResponseAgent> agent = CreateObject<DemandResponseAgent>();
+            agent->Setup(drPort, Seconds(drActuation / 1000.0));
+            microgrids.Get(i)->AddApplication(agent);
+            agent->SetStartTime(Seconds(1.0));
+            agent->SetStopTime(Seconds(simulationTime));
+            drTargets.push_back(InetSocketAddress(microgridAddresses[i], drPort));
+        }
+
+        drController = CreateObject<DemandResponseController>();
+        drController->Setup(drTargets, Seconds(drInterval), Seconds(drDeadline / 1000.0),
+                            Seconds(drRetry / 1000.0));
+        centralStation.Get(0)->AddApplication(drController);
+        drController->SetStartTime(Seconds(appStart + startWindow));
+        drController->SetStopTime(Seconds(simulationTime));
+    }
+
+    // Web browsing from the school Wi-Fi LANs against a server on the
+    // central station; downloads share the school uplink with telemetry
+    uint16_t webPort = 8080;
+    std::vector<Ptr<WebClient> > webClients;
+    PortTrafficCounter webTraffic = { webPort, 0, 0 };
+    if (wifiSchools > 0)
+    {
+        Ptr<WebServer> webServer = CreateObject<WebServer>();
+        webServer->Setup(webPort, 1400);
+        centralStation.Get(0)->AddApplication(webServer);
+        webServer->SetStartTime(Seconds(1.0));
+        webServer->SetStopTime(Seconds(simulationTime));
+
+        Address webAddress(InetSocketAddress(ifCentralWAN.GetAddress(0), webPort));
+        for (uint32_t i = 0; i < wifiSchools; ++i)
+        {
+            for (uint32_t s = 0; s < wifiStations; ++s)
+            {
+                Ptr<WebClient> client = CreateObject<WebClient>();
+                client->Setup(webAddress, webPageSize, Seconds(webThink), Seconds(5.0));
+                schoolStations[i].Get(s)->AddApplication(client);
+                client->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+                client->SetStopTime(Seconds(simulationTime));
+                webClients.push_back(client);
+            }
+            // Router 1 egress onto the school uplink
+            WatchPortTraffic(NetDeviceContainer(schoolDevices[i].Get(1)), &webTraffic);
+        }
+    }
+
+    // School content fetches through the caching proxy on router 1; misses
+    // cross the backbone to the origin on the central station
+    uint16_t proxyPort = 3128;
+    uint16_t originPort = 8081;
+    std::vector<uint32_t> catalogue;
+    Ptr<ContentCache> contentCache;
+    std::vector<Ptr<ContentClient> > contentClients;
+    PortTrafficCounter originTraffic = { originPort, 0, 0 };
+    PeakLoadSample peakLoadStart = { 0, 0 };
+    PeakLoadSample peakLoadEnd = { 0, 0 };
+    if (enableContentCache)
+    {
+        // Heavy-tailed object sizes, fixed for the run
+        Ptr<LogNormalRandomVariable> objectSize = CreateObject<LogNormalRandomVariable>();
+        const double sigma = 1.0;
+        double mu = std::log(static_cast<double>(contentMeanSize)) - sigma * sigma / 2.0;
+        for (uint32_t i = 0; i < contentObjects; ++i)
+        {
+            double size = std::min(objectSize->GetValue(mu, sigma), 20.0 * contentMeanSize);
+            catalogue.push_back(std::max<uint32_t>(static_cast<uint32_t>(size), 1));
+        }
+
+        Ptr<WebServer> origin = CreateObject<WebServer>();
+        origin->Setup(originPort, 1400);
+        centralStation.Get(0)->AddApplication(origin);
+        origin->SetStartTime(Seconds(1.0));
+        origin->SetStopTime(Seconds(simulationTime));
+
+        contentCache = CreateObject<ContentCache>();
+        contentCache->Setup(proxyPort, InetSocketAddress(ifCentralWAN.GetAddress(0), originPort), cacheSize,
+                            cachePolicy == "lfu" ? ContentCache::LFU : ContentCache::LRU, 1400, Seconds(5.0));
+        wanRouters.Get(1)->AddApplication(contentCache);
+        contentCache->SetStartTime(Seconds(1.0));
+        contentCache->SetStopTime(Seconds(simulationTime));
+
+        // Each school addresses the proxy on its own access link
+        for (uint32_t i = 0; i < nSchools; ++i)
+        {
+            Ptr<Ipv4> routerIp = wanRouters.Get(1)->GetObject<Ipv4>();
+            int32_t lanIf = routerIp->GetInterfaceForDevice(schoolDevices[i].Get(1));
+            Address proxy(InetSocketAddress(routerIp->GetAddress(lanIf, 0).GetLocal(), proxyPort));
+
+            Ptr<ContentClient> client = CreateObject<ContentClient>();
+            client->Setup(proxy, &catalogue, zipfAlpha, Seconds(contentInterval), Seconds(10.0));
+            client->SetPeakWindow(Seconds(peakStart), Seconds(peakEnd), peakFactor);
+            solarSchools.Get(i)->AddApplication(client);
+            client->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+            client->SetStopTime(Seconds(simulationTime));
+            contentClients.push_back(client);
+        }
+
+        // Router 0 egress onto the backbone link to router 1
+        WatchPortTraffic(NetDeviceContainer(devWAN01.Get(0)), &originTraffic);
+
+        if (enablePrefetch)
+        {
+            DataRateValue backboneRate;
+            devWAN01.Get(0)->GetAttribute("DataRate", backboneRate);
+            contentCache->EnablePrefetch(&catalogue, devWAN01.Get(0), backboneRate.Get(), prefetchUtil,
+                                         Seconds(1.0), Seconds(peakStart), Seconds(peakEnd));
+        }
+        if (peakEnd > peakStart)
+        {
+            Simulator::Schedule(Seconds(peakStart), &SamplePeakLoad, &peakLoadStart, &originTraffic, contentCache);
+            Simulator::Schedule(Seconds(std::min(peakEnd, simulationTime)), &SamplePeakLoad, &peakLoadEnd,
+                                &originTraffic, contentCache);
+        }
+    }
+
+    // Every site disciplines its own drifting clock against the central
+    // station; each site draws its own offset and frequency error
+    uint16_t ntpPort = 123;
+    std::vector<Ptr<NtpClient> > ntpClients[3];
+    if (enableTimeSync)
+    {
+        Ptr<NtpServer> ntpServer = CreateObject<NtpServer>();
+        ntpServer->Setup(ntpPort);
+        centralStation.Get(0)->AddApplication(ntpServer);
+        ntpServer->SetStartTime(Seconds(1.0));
+        ntpServer->SetStopTime(Seconds(simulationTime));
+
+        Address ntpAddress(InetSocketAddress(ifCentralWAN.GetAddress(0), ntpPort));
+        NodeContainer* siteClasses[] = { &solarSchools, &solarClinics, &microgrids };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t i = 0; i < siteClasses[c]->GetN(); ++i)
+            {
+                Ptr<NtpClient> client = CreateObject<NtpClient>();
+                client->Setup(ntpAddress, Seconds(ntpPoll), startRng->GetValue(-clockOffset, clockOffset),
+                              startRng->GetValue(-clockSkew, clockSkew), clockWander);
+                siteClasses[c]->Get(i)->AddApplication(client);
+                client->SetStartTime(Seconds(appStart + startRng->GetValue(0.0, startWindow)));
+                client->SetStopTime(Seconds(simulationTime));
+                ntpClients[c].push_back(client);
+            }
+        }
+    }
+
+    // One school floods the central station during the middle third of the
+    // run, to see how far it pushes the other sites' latency
+    uint16_t siteFloodPort = 9001;
+    Time siteFloodStart = Seconds(simulationTime / 3.0);
+    Time siteFloodStop = Seconds(2.0 * simulationTime / 3.0);
+    if (!siteFlood.empty())
+    {
+        PacketSinkHelper siteFloodSink("ns3::UdpSocketFactory", InetSocketAddress(Ipv4Address::GetAny(), siteFloodPort));
+        ApplicationContainer siteFloodSinks = siteFloodSink.Install(centralStation.Get(0));
+        siteFloodSinks.Start(Seconds(1.0));
+        siteFloodSinks.Stop(Seconds(simulationTime));
+        InstallFlood(solarSchools.Get(siteFloodSchool), InetSocketAddress(ifCentralWAN.GetAddress(0), siteFloodPort),
+                     DataRate(siteFlood), siteFloodStart, siteFloodStop);
+    }
+
+    // Background aggregate between router 2 and the central station,
+    // loading every hop of the clinic path to central in both directions
+    uint16_t floodPort = 9000;
+    if (!backgroundRate.empty())
+    {
+        Ptr<Node> router2 = wanRouters.Get(2);
+        Ptr<Ipv4> router2Ip = router2->GetObject<Ipv4>();
+        Ipv4Address router2Address =
+            router2Ip->GetAddress(router2Ip->GetInterfaceForDevice(devWAN20.Get(0)), 0).GetLocal();
 
-    // Central Station Server (receives energy data and management commands)
-    UdpEchoServerHelper centralServer(port);
-    ApplicationContainer serverApps = centralServer.Install(centralStation.Get(0));
-    serverApps.Start(Seconds(1.0));
-    serverApps.Stop(Seconds(simulationTime));
+        PacketSinkHelper floodSink("ns3::UdpSocketFactory", InetSocketAddress(Ipv4Address::GetAny(), floodPort));
+        ApplicationContainer floodSinks = floodSink.Install(centralStation.Get(0));
+        floodSinks.Add(floodSink.Install(router2));
+        floodSinks.Start(Seconds(1.0));
+        floodSinks.Stop(Seconds(simulationTime));
 
-    Address centralAddress(InetSocketAddress(ifCentralWAN.GetAddress(0), port));
+        InstallFlood(router2, InetSocketAddress(ifCentralWAN.GetAddress(0), floodPort), DataRate(backgroundRate),
+                     Seconds(appStart), Seconds(simulationTime));
+        InstallFlood(centralStation.Get(0), InetSocketAddress(router2Address, floodPort), DataRate(backgroundRate),
+                     Seconds(appStart), Seconds(simulationTime));
+    }
 
-    // Solar Schools send energy usage data and receive power management
-    for (uint32_t i = 0; i < nSchools; ++i)
+    // Peer-to-peer energy market between the micro-grids; every order
+    // crosses router 0
+    uint16_t tradePort = 30000;
+    Time firstMarketRound = Seconds(appStart + startWindow);
+    std::vector<Ptr<EnergyTrader> > traders;
+    PortTrafficCounter tradeTraffic = { tradePort, 0, 0 };
+    if (enableTrading && nMicrogrids > 1)
     {
-        UdpEchoClientHelper schoolClient(ifCentralWAN.GetAddress(0), port);
-        schoolClient.SetAttribute("MaxPackets", UintegerValue(100));
-        schoolClient.SetAttribute("Interval", TimeValue(Seconds(0.5)));
-        schoolClient.SetAttribute("PacketSize", UintegerValue(256)); // Small data packets
+        std::vector<Address> traderAddresses;
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            traderAddresses.push_back(InetSocketAddress(microgridAddresses[i], tradePort));
+        }
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            Ptr<EnergyTrader> trader = CreateObject<EnergyTrader>();
+            trader->Setup(i, traderAddresses, tradePort, firstMarketRound, Seconds(marketInterval));
+            microgrids.Get(i)->AddApplication(trader);
+            trader->SetStartTime(Seconds(1.0));
+            trader->SetStopTime(Seconds(simulationTime));
+            traders.push_back(trader);
 
-        ApplicationContainer schoolApp = schoolClient.Install(solarSchools.Get(i));
-        schoolApp.Start(Seconds(2.0 + i * 0.3));
-        schoolApp.Stop(Seconds(simulationTime));
+            // Router 0 egress towards each micro-grid
+            WatchPortTraffic(NetDeviceContainer(microgridDevices[i].Get(1)), &tradeTraffic);
+        }
     }
 
-    // Solar Clinics send critical health facility data
-    for (uint32_t i = 0; i < nClinics; ++i)
+    // Scheduled uplink outages: both ends of the site's access link go down
+    for (uint32_t i = 0; i < outages.size(); ++i)
     {
-        UdpEchoClientHelper clinicClient(ifCentralWAN.GetAddress(0), port);
-        clinicClient.SetAttribute("MaxPackets", UintegerValue(150));
-        clinicClient.SetAttribute("Interval", TimeValue(Seconds(0.3))); // More frequent
-        clinicClient.SetAttribute("PacketSize", UintegerValue(512)); // Larger packets
+        const SiteRef& site = outages[i].site;
+        NetDeviceContainer* links = (site.siteClass == "school") ? schoolDevices
+                                    : (site.siteClass == "clinic") ? clinicDevices
+                                    : microgridDevices;
+        uint32_t count = (site.siteClass == "school") ? nSchools
+                         : (site.siteClass == "clinic") ? nClinics
+                         : nMicrogrids;
+        NS_ABORT_MSG_IF(site.index >= count, "No such site: " << site.siteClass << ":" << (site.index + 1));
+        Simulator::Schedule(Seconds(outages[i].start), &SetLinkState, links[site.index], false);
+        Simulator::Schedule(Seconds(outages[i].end), &SetLinkState, links[site.index], true);
+    }
 
-        ApplicationContainer clinicApp = clinicClient.Install(solarClinics.Get(i));
-        clinicApp.Start(Seconds(1.5 + i * 0.2));
-        clinicApp.Stop(Seconds(simulationTime));
+    // Power outages: the site's access link and its applications go dark
+    for (uint32_t i = 0; i < powerOutages.size(); ++i)
+    {
+        const SiteRef& site = powerOutages[i].site;
+        NetDeviceContainer* links = (site.siteClass == "school") ? schoolDevices
+                                    : (site.siteClass == "clinic") ? clinicDevices
+                                    : microgridDevices;
+        const NodeContainer& nodes = (site.siteClass == "school") ? solarSchools
+                                     : (site.siteClass == "clinic") ? solarClinics
+                                     : microgrids;
+        NS_ABORT_MSG_IF(site.index >= nodes.GetN(), "No such site: " << site.siteClass << ":" << (site.index + 1));
+        Ptr<Node> node = nodes.Get(site.index);
+        Simulator::Schedule(Seconds(powerOutages[i].start), &SetSitePower, node, links[site.index], false);
+        if (powerOutages[i].end < simulationTime)
+        {
+            Simulator::Schedule(Seconds(powerOutages[i].end), &SetSitePower, node, links[site.index], true);
+        }
     }
 
-    // Community Micro-grids send energy production/consumption data
-    for (uint32_t i = 0; i < nMicrogrids; ++i)
+    // Weather: capacity changes on the access links, and the bytes those
+    // links carry per time bin
+    std::vector<CapacityChange> capacityChanges;
+    if (weatherMode == "file")
+    {
+        capacityChanges = ReadCapacityFile(weatherFile);
+    }
+    else if (weatherMode == "rain")
+    {
+        Ptr<UniformRandomVariable> fadeDepth = CreateObject<UniformRandomVariable>();
+        Ptr<ExponentialRandomVariable> fadeTiming = CreateObject<ExponentialRandomVariable>();
+        const std::string classes[] = { "school", "clinic", "microgrid" };
+        const uint32_t counts[] = { nSchools, nClinics, nMicrogrids };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            std::vector<CapacityChange> fades = SimulateRainFades(classes[c], counts[c], rainGap, rainFade,
+                                                                  rainMinFactor, simulationTime, fadeDepth, fadeTiming);
+            capacityChanges.insert(capacityChanges.end(), fades.begin(), fades.end());
+        }
+    }
+    std::map<std::string, std::vector<std::pair<double, double> > > capacityTimelines;   // "class:n" -> (time, fraction)
+    ThroughputBins weatherThroughput;
+    weatherThroughput.width = weatherBin;
+    weatherThroughput.bytes.resize(static_cast<uint32_t>(std::ceil(simulationTime / weatherBin)), 0);
+    for (uint32_t i = 0; i < capacityChanges.size(); ++i)
     {
-        UdpEchoClientHelper microgridClient(ifCentralWAN.GetAddress(0), port);
-        microgridClient.SetAttribute("MaxPackets", UintegerValue(80));
-        microgridClient.SetAttribute("Interval", TimeValue(Seconds(0.8)));
-        microgridClient.SetAttribute("PacketSize", UintegerValue(128));
+        const SiteRef& site = capacityChanges[i].site;
+        NetDeviceContainer* links = (site.siteClass == "school") ? schoolDevices
+                                    : (site.siteClass == "clinic") ? clinicDevices
+                                    : microgridDevices;
+        uint32_t count = (site.siteClass == "school") ? nSchools
+                         : (site.siteClass == "clinic") ? nClinics
+                         : nMicrogrids;
+        NS_ABORT_MSG_IF(site.index >= count, "No such site: " << site.siteClass << ":" << (site.index + 1));
+        DataRateValue nominal;
+        links[site.index].Get(0)->GetAttribute("DataRate", nominal);
+        double fraction = capacityChanges[i].rate.empty()
+                              ? capacityChanges[i].factor
+                              : static_cast<double>(DataRate(capacityChanges[i].rate).GetBitRate()) / nominal.Get().GetBitRate();
+        for (uint32_t d = 0; d < links[site.index].GetN(); ++d)
+        {
+            DataRateValue deviceRate;
+            links[site.index].Get(d)->GetAttribute("DataRate", deviceRate);
+            Simulator::Schedule(Seconds(capacityChanges[i].time), &SetDeviceRate, links[site.index].Get(d),
+                                DataRate(static_cast<uint64_t>(deviceRate.Get().GetBitRate() * fraction)));
+        }
 
-        ApplicationContainer microgridApp = microgridClient.Install(microgrids.Get(i));
-        microgridApp.Start(Seconds(3.0 + i * 0.4));
-        microgridApp.Stop(Seconds(simulationTime));
+        std::ostringstream key;
+        key << site.siteClass << ":" << (site.index + 1);
+        std::vector<std::pair<double, double> >& timeline = capacityTimelines[key.str()];
+        if (timeline.empty())
+        {
+            for (uint32_t d = 0; d < links[site.index].GetN(); ++d)
+            {
+                links[site.index].Get(d)->TraceConnectWithoutContext("PhyRxEnd",
+                                                                     MakeBoundCallback(&CountBinBytes, &weatherThroughput));
+            }
+        }
+        timeline.push_back(std::make_pair(capacityChanges[i].time, fraction));
+    }
+    for (std::map<std::string, std::vector<std::pair<double, double> > >::iterator it = capacityTimelines.begin();
+         it != capacityTimelines.end(); ++it)
+    {
+        std::stable_sort(it->second.begin(), it->second.end());
     }
 
     NS_LOG_INFO("Applications configured successfully");
@@ -454,6 +8863,1079 @@ int main(int argc, char* argv[])
             std::cout << "  Latency Status: ACCEPTABLE - May need optimization\n";
     }
 
+    std::cout << "\nSite Telemetry Readings:\n";
+    ReportTelemetry("Schools:                  ", schoolClients);
+    ReportTelemetry("Clinics:                  ", clinicClients);
+    ReportTelemetry("Micro-grids:              ", microgridClients);
+
+    if (!bulkSenders.empty())
+    {
+        std::cout << "\nTCP Bulk Uploads (" << bulkSenders.size() << " schools x "
+                  << bulkBytes << " bytes):\n";
+        Time lastDone = Seconds(bulkStart);
+        uint32_t finished = 0;
+        for (uint32_t i = 0; i < bulkSenders.size(); ++i)
+        {
+            std::cout << "    School-" << std::left << std::setw(8) << (bulkSenderSchools[i] + 1) << std::right;
+            std::map<Ipv4Address, Time>::const_iterator done = bulkTracker.completed.find(bulkSenders[i]);
+            if (done != bulkTracker.completed.end())
+            {
+                double duration = done->second.GetSeconds() - bulkStart;
+                std::cout << "completed in " << duration << " s ("
+                          << (bulkBytes * 8.0 / duration / 1e6) << " Mbps)\n";
+                lastDone = std::max(lastDone, done->second);
+                ++finished;
+            }
+            else
+            {
+                std::cout << "incomplete, " << bulkTracker.received[bulkSenders[i]] << " bytes received\n";
+            }
+        }
+
+        // Telemetry latency while the uploads were running against the rest
+        // of the run
+        Time transferEnd = (finished == bulkSenders.size()) ? lastDone : Seconds(simulationTime);
+        std::vector<std::pair<Time, Time> > transferWindow(1, std::make_pair(Seconds(bulkStart), transferEnd));
+        const std::vector<Ptr<TelemetryClient> >* classes[] = { &schoolClients, &clinicClients, &microgridClients };
+        const char* classNames[] = { "Schools", "Clinics", "Micro-grids" };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            SampleStats during, outside;
+            for (uint32_t j = 0; j < classes[c]->size(); ++j)
+            {
+                SplitRttByWindows((*classes[c])[j], transferWindow, during, outside);
+            }
+            std::cout << "  " << classNames[c] << " telemetry RTT\n";
+            std::cout << "    During Uploads:         ";
+            during.Print(std::cout, " ms");
+            std::cout << "\n    Outside Uploads:        ";
+            outside.Print(std::cout, " ms");
+            std::cout << "\n";
+        }
+    }
+
+    if (videoReceiver)
+    {
+        std::cout << "\nTelemedicine Video (" << videoSenders.size() << " sessions, " << videoRate
+                  << ", " << videoFps << " fps, GOP " << videoGop << "):\n";
+        uint32_t totalSent = 0, totalOnTime = 0, totalLate = 0;
+        uint32_t sessionsOk = 0;
+        for (uint32_t s = 0; s < videoSenders.size(); ++s)
+        {
+            uint32_t sent = videoSenders[s]->GetFramesSent();
+            uint32_t onTime = videoReceiver->GetFramesOnTime(s);
+            uint32_t late = videoReceiver->GetFramesLate(s);
+            uint32_t missing = sent > onTime + late ? sent - onTime - late : 0;
+            double lossPct = sent > 0 ? 100.0 * (late + missing) / sent : 0.0;
+            const SampleStats& latency = videoReceiver->GetFrameLatency(s);
+            std::cout << "    Clinic-" << (s / videoSessions + 1) << " #" << (s % videoSessions + 1)
+                      << ": " << sent << " frames, " << late << " late, " << missing
+                      << " missing (" << lossPct << " % lost), latency ";
+            latency.Print(std::cout, " ms");
+            std::cout << "\n";
+            totalSent += sent;
+            totalOnTime += onTime;
+            totalLate += late;
+            // A session is carried if under 1 % of frames miss the deadline
+            if (lossPct < 1.0)
+            {
+                ++sessionsOk;
+            }
+        }
+        if (totalSent > 0)
+        {
+            std::cout << "  Frame Loss (all):         " << (100.0 * (totalSent - totalOnTime) / totalSent)
+                      << " % (" << totalLate << " late)\n";
+        }
+        std::cout << "  Sessions Carried:         " << sessionsOk << " / " << videoSenders.size()
+                  << " (under 1 % frame loss at " << videoDeadline << " ms deadline)\n";
+    }
+
+    if (drController)
+    {
+        std::cout << "\nDemand Response (" << nMicrogrids << " micro-grids, deadline "
+                  << drDeadline << " ms):\n";
+        std::cout << "  Commands Issued:          " << drController->GetRounds() << " ("
+                  << drController->GetRetransmissions() << " retransmissions)\n";
+        std::cout << "  Command-to-Actuation:     ";
+        drController->GetAckLatency().Print(std::cout, " ms");
+        std::cout << "\n  Time to All Acked:        ";
+        drController->GetTimeToAllAcked().Print(std::cout, " ms");
+        std::cout << "\n  Rounds Fully Acked:       " << drController->GetTimeToAllAcked().GetCount()
+                  << " / " << drController->GetRounds() << "\n";
+        const SampleStats& reached = drController->GetReachedWithinDeadline();
+        if (reached.GetCount() > 0)
+        {
+            std::cout << "  Sites Within Deadline:    mean " << reached.GetMean() << " %, worst round "
+                      << reached.GetPercentile(0.0) << " %\n";
+        }
+    }
+
+    if (!webClients.empty())
+    {
+        uint32_t loaded = 0, failed = 0;
+        uint64_t webBytes = 0;
+        SampleStats loadTimes;
+        for (uint32_t i = 0; i < webClients.size(); ++i)
+        {
+            loaded += webClients[i]->GetPagesLoaded();
+            failed += webClients[i]->GetPagesFailed();
+            webBytes += webClients[i]->GetBytesReceived();
+            loadTimes.Merge(webClients[i]->GetLoadTimes());
+        }
+        double activeTime = simulationTime - appStart;
+        double uplinkMbps = webTraffic.bytes * 8.0 / activeTime / 1e6 / wifiSchools;
+
+        // Web traffic is counted leaving router 1 towards the schools, so it
+        // is set against that direction's rate, whatever the access link is
+        double capacityMbps = 0.0;
+        for (uint32_t i = 0; i < wifiSchools; ++i)
+        {
+            DataRateValue rate;
+            schoolDevices[i].Get(1)->GetAttribute("DataRate", rate);
+            capacityMbps += rate.Get().GetBitRate() / 1e6;
+        }
+
+        std::cout << "\nSchool Wi-Fi LANs (" << wifiSchools << " schools x " << wifiStations
+                  << " stations):\n";
+        std::cout << "  Pages Loaded / Abandoned: " << loaded << " / " << failed << "\n";
+        std::cout << "  Page Load Time:           ";
+        loadTimes.Print(std::cout, " ms");
+        std::cout << "\n  Web Goodput:              " << (webBytes * 8.0 / activeTime / 1e6) << " Mbps\n";
+        std::cout << "  Uplink Web Load:          " << uplinkMbps << " Mbps per school ("
+                  << (uplinkMbps * wifiSchools / capacityMbps * 100.0) << " % of "
+                  << (capacityMbps / wifiSchools) << " Mbps mean uplink)\n";
+
+        // Telemetry from schools sharing their uplink with a LAN against the rest
+        SampleStats withLan, withoutLan;
+        for (uint32_t i = 0; i < schoolClients.size(); ++i)
+        {
+            const std::vector<TelemetryClient::RttSample>& samples = schoolClients[i]->GetRttSamples();
+            for (uint32_t k = 0; k < samples.size(); ++k)
+            {
+                (i < wifiSchools ? withLan : withoutLan).Add(samples[k].rtt);
+            }
+        }
+        std::cout << "  School telemetry RTT\n";
+        std::cout << "    With Wi-Fi LAN:         ";
+        withLan.Print(std::cout, " ms");
+        std::cout << "\n    Without Wi-Fi LAN:      ";
+        withoutLan.Print(std::cout, " ms");
+        std::cout << "\n";
+    }
+
+    if (contentCache)
+    {
+        uint32_t fetched = 0, failed = 0;
+        SampleStats fetchLatency;
+        for (uint32_t i = 0; i < contentClients.size(); ++i)
+        {
+            fetched += contentClients[i]->GetFetched();
+            failed += contentClients[i]->GetFailed();
+            fetchLatency.Merge(contentClients[i]->GetFetchLatency());
+        }
+        uint32_t requests = contentCache->GetRequests();
+        uint64_t hitBytes = contentCache->GetHitBytes();
+        uint64_t missBytes = contentCache->GetFetchedBytes();
+
+        std::cout << "\nContent Cache at Router 1 (" << (cacheSize / 1e6) << " MB, " << cachePolicy
+                  << ", " << contentObjects << " objects, Zipf " << zipfAlpha << "):\n";
+        std::cout << "  Requests / Hits:          " << requests << " / " << contentCache->GetHits()
+                  << " (" << (requests > 0 ? 100.0 * contentCache->GetHits() / requests : 0.0)
+                  << " % hit ratio, " << contentCache->GetEvictions() << " evictions)\n";
+        std::cout << "  Byte Hit Ratio:           "
+                  << (hitBytes + missBytes > 0 ? 100.0 * hitBytes / (hitBytes + missBytes) : 0.0) << " %\n";
+        std::cout << "  Backbone Bytes Saved:     " << hitBytes << " (" << originTraffic.bytes
+                  << " origin bytes carried router 0 -> 1)\n";
+        std::cout << "  Fetches Done / Failed:    " << fetched << " / " << failed << "\n";
+        std::cout << "  Fetch Latency:            ";
+        fetchLatency.Print(std::cout, " ms");
+        std::cout << "\n";
+        if (enablePrefetch)
+        {
+            std::cout << "  Prefetched:               " << contentCache->GetPrefetches() << " objects, "
+                      << contentCache->GetPrefetchedBytes() << " bytes (" << contentCache->GetPrefetchHitBytes()
+                      << " bytes later requested)\n";
+        }
+        if (peakEnd > peakStart && simulationTime > peakStart)
+        {
+            // Bytes served from prefetched copies during the peak would
+            // otherwise have crossed the backbone on demand
+            double peakSeconds = std::min(peakEnd, simulationTime) - peakStart;
+            uint64_t peakBytes = peakLoadEnd.originBytes - peakLoadStart.originBytes;
+            uint64_t avoided = peakLoadEnd.prefetchHitBytes - peakLoadStart.prefetchHitBytes;
+            std::cout << "  Peak Backbone Load:       " << (peakBytes * 8.0 / peakSeconds / 1e6) << " Mbps ["
+                      << peakStart << ", " << std::min(peakEnd, simulationTime) << "] s\n";
+            if (enablePrefetch)
+            {
+                uint64_t onDemand = peakBytes + avoided;
+                std::cout << "  On-Demand Equivalent:     " << (onDemand * 8.0 / peakSeconds / 1e6) << " Mbps ("
+                          << (onDemand > 0 ? 100.0 * avoided / onDemand : 0.0) << " % reduction)\n";
+            }
+        }
+    }
+
+    if (enableTimeSync)
+    {
+        std::cout << "\nSite Time Synchronisation (poll " << ntpPoll << " s, skew up to +/- "
+                  << clockSkew << " ppm):\n";
+
+        // The first exchanges only remove the initial offset; accuracy is
+        // judged once every site has synchronised a few times
+        const uint32_t settle = 3;
+        const char* classNames[] = { "Schools", "Clinics", "Micro-grids" };
+        const double queueingBins[] = { 1.0, 5.0, 20.0 };
+        SampleStats binned[4];
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            SampleStats raw, filtered, delay;
+            for (uint32_t j = 0; j < ntpClients[c].size(); ++j)
+            {
+                const std::vector<NtpClient::SyncSample>& samples = ntpClients[c][j]->GetSamples();
+                for (uint32_t k = settle; k < samples.size(); ++k)
+                {
+                    raw.Add(samples[k].rawError);
+                    filtered.Add(samples[k].filteredError);
+                    delay.Add(samples[k].delay);
+                    uint32_t bin = 0;
+                    while (bin < 3 && samples[k].queueing >= queueingBins[bin])
+                    {
+                        ++bin;
+                    }
+                    binned[bin].Add(samples[k].filteredError);
+                }
+            }
+            std::cout << "  " << classNames[c] << "\n";
+            std::cout << "    Round-Trip Delay:       ";
+            delay.Print(std::cout, " ms");
+            std::cout << "\n    Offset Error (raw):     ";
+            raw.Print(std::cout, " us");
+            std::cout << "\n    Offset Error (filter):  ";
+            filtered.Print(std::cout, " us");
+            std::cout << "\n";
+        }
+
+        // Filtered accuracy against the queueing seen on the exchange
+        const char* binNames[] = { "< 1 ms", "1-5 ms", "5-20 ms", ">= 20 ms" };
+        std::cout << "  Offset error by path queueing\n";
+        for (uint32_t b = 0; b < 4; ++b)
+        {
+            std::cout << "    Queueing " << std::left << std::setw(14) << binNames[b] << std::right;
+            binned[b].Print(std::cout, " us");
+            std::cout << "\n";
+        }
+    }
+
+    if (clinicPriority != "off" || !backgroundRate.empty())
+    {
+        std::cout << "\nClinic Prioritisation (" << clinicPriority << ", background "
+                  << (backgroundRate.empty() ? "none" : backgroundRate) << "):\n";
+        const std::vector<Ptr<TelemetryClient> >* classes[] = { &clinicClients, &schoolClients, &microgridClients };
+        const char* classNames[] = { "Clinics:                ", "Schools:                ",
+                                     "Micro-grids:            " };
+        std::cout << "  Telemetry RTT\n";
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            SampleStats rtt;
+            for (uint32_t j = 0; j < classes[c]->size(); ++j)
+            {
+                const std::vector<TelemetryClient::RttSample>& samples = (*classes[c])[j]->GetRttSamples();
+                for (uint32_t k = 0; k < samples.size(); ++k)
+                {
+                    rtt.Add(samples[k].rtt);
+                }
+            }
+            std::cout << "    " << classNames[c];
+            rtt.Print(std::cout, " ms");
+            std::cout << "\n";
+        }
+
+        // Per-band totals over all prioritising queue discs
+        uint64_t bandSent[2] = { 0, 0 };
+        uint64_t bandDropped[2] = { 0, 0 };
+        for (uint32_t i = 0; i < clinicQueueDiscs.GetN(); ++i)
+        {
+            for (uint32_t b = 0; b < 2; ++b)
+            {
+                const QueueDisc::Stats& band =
+                    clinicQueueDiscs.Get(i)->GetQueueDiscClass(b)->GetQueueDisc()->GetStats();
+                bandSent[b] += band.nTotalSentPackets;
+                bandDropped[b] += band.nTotalDroppedPackets;
+            }
+        }
+        if (clinicQueueDiscs.GetN() > 0)
+        {
+            std::cout << "  Clinic Band Sent / Drop:  " << bandSent[0] << " / " << bandDropped[0] << "\n";
+            std::cout << "  Other Band Sent / Drop:   " << bandSent[1] << " / " << bandDropped[1] << "\n";
+        }
+    }
+
+    if (!shapeRate.empty() || !siteFlood.empty())
+    {
+        std::cout << "\nAccess Shaping (" << (shapeRate.empty() ? "off" : shapeRate) << ", burst "
+                  << shapeBurst << " bytes, flood "
+                  << (siteFlood.empty() ? "none" : siteFlood) << "):\n";
+        if (!shaperStats.empty())
+        {
+            // Shapers are in uplink order: schools, clinics, micro-grids
+            const char* classNames[] = { "Schools:                  ", "Clinics:                  ",
+                                         "Micro-grids:              " };
+            uint32_t classEnd[] = { nSchools, nSchools + nClinics, nSchools + nClinics + nMicrogrids };
+            uint32_t first = 0;
+            for (uint32_t c = 0; c < 3; ++c)
+            {
+                uint64_t dequeued = 0, delayed = 0, dropped = 0;
+                SampleStats delay;
+                for (uint32_t i = first; i < classEnd[c]; ++i)
+                {
+                    if (c == 0 && !siteFlood.empty() && i == siteFloodSchool)
+                    {
+                        continue;
+                    }
+                    dequeued += shaperStats[i].dequeued;
+                    delayed += shaperStats[i].delayed;
+                    delay.Merge(shaperStats[i].delay);
+                    dropped += shaperQueueDiscs.Get(i)->GetStats().nTotalDroppedPackets;
+                }
+                first = classEnd[c];
+                std::cout << "  " << classNames[c] << "sent " << dequeued << ", delayed " << delayed
+                          << ", dropped " << dropped << "\n";
+                if (delay.GetCount() > 0)
+                {
+                    std::cout << "    Shaper Delay:           ";
+                    delay.Print(std::cout, " ms");
+                    std::cout << "\n";
+                }
+            }
+            if (!siteFlood.empty())
+            {
+                const ShaperStats& flooder = shaperStats[siteFloodSchool];
+                std::cout << "  Flooding School " << siteFloodSchool << ":       sent " << flooder.dequeued
+                          << ", delayed " << flooder.delayed << ", dropped "
+                          << shaperQueueDiscs.Get(siteFloodSchool)->GetStats().nTotalDroppedPackets << "\n";
+            }
+        }
+        if (!siteFlood.empty())
+        {
+            // Readings of every other site sent while the flood was running
+            const std::vector<Ptr<TelemetryClient> >* classes[] = { &schoolClients, &clinicClients, &microgridClients };
+            const char* classNames[] = { "Other Schools:          ", "Clinics:                ",
+                                         "Micro-grids:            " };
+            std::cout << "  Telemetry RTT During Flood\n";
+            for (uint32_t c = 0; c < 3; ++c)
+            {
+                SampleStats rtt;
+                for (uint32_t j = 0; j < classes[c]->size(); ++j)
+                {
+                    if (c == 0 && j == siteFloodSchool)
+                    {
+                        continue;
+                    }
+                    const std::vector<TelemetryClient::RttSample>& samples = (*classes[c])[j]->GetRttSamples();
+                    for (uint32_t k = 0; k < samples.size(); ++k)
+                    {
+                        if (samples[k].sent >= siteFloodStart.GetSeconds() && samples[k].sent < siteFloodStop.GetSeconds())
+                        {
+                            rtt.Add(samples[k].rtt);
+                        }
+                    }
+                }
+                std::cout << "    " << classNames[c];
+                rtt.Print(std::cout, " ms");
+                std::cout << "\n";
+            }
+        }
+    }
+
+    if (!queueSizing.empty())
+    {
+        std::cout << "\nQueue Sizing (" << queueSizing;
+        if (queueSizing == "bdp")
+        {
+            std::cout << ", " << bdpFactor << " x BDP";
+        }
+        std::cout << "):\n";
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            uint64_t received = 0, dropped = 0;
+            for (uint32_t d = 0; d < linkClasses[c].GetN(); ++d)
+            {
+                Ptr<PointToPointNetDevice> device = DynamicCast<PointToPointNetDevice>(linkClasses[c].Get(d));
+                const QueueDisc::Stats& st = RootQueueDisc(device)->GetStats();
+                received += st.nTotalReceivedPackets;
+                dropped += st.nTotalDroppedPackets + device->GetQueue()->GetTotalDroppedPackets();
+            }
+            std::cout << "  " << linkClassNames[c] << " Links";
+            if (bdpLimit[c] > 0)
+            {
+                std::cout << " (limit " << bdpLimit[c] << " packets)";
+            }
+            std::cout << ":\n    Buffer Delay:           ";
+            bufferDelay[c].Print(std::cout, " ms");
+            std::cout << "\n    Dropped:                " << dropped << " of " << received << " ("
+                      << (received > 0 ? 100.0 * dropped / received : 0.0) << " %)\n";
+        }
+    }
+
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        if (aqmQueueDiscs[c].GetN() == 0)
+        {
+            continue;
+        }
+        uint64_t sent = 0, dropped = 0;
+        for (uint32_t q = 0; q < aqmQueueDiscs[c].GetN(); ++q)
+        {
+            const QueueDisc::Stats& st = aqmQueueDiscs[c].Get(q)->GetStats();
+            sent += st.nTotalSentPackets;
+            dropped += st.nTotalDroppedPackets;
+        }
+        std::cout << "\n" << linkClassNames[c] << " Links with " << *aqmChoices[c] << " ("
+                  << aqmQueueDiscs[c].GetN() << " queue discs):\n";
+        std::cout << "  Sent / Dropped:           " << sent << " / " << dropped << " ("
+                  << (sent + dropped > 0 ? 100.0 * dropped / (sent + dropped) : 0.0) << " %)\n";
+        std::cout << "  Sojourn Time:             ";
+        aqmSojourn[c].Print(std::cout, " ms");
+        std::cout << "\n  Standing Queue (100 ms):  ";
+        aqmStanding[c].Print(std::cout, " ms");
+        std::cout << "\n";
+    }
+
+    if (!queueTrace.empty())
+    {
+        queueSampler.Close();
+        std::cout << "\nRouter Queue Occupancy (" << queueSampler.GetSampleCount() << " samples every "
+                  << queueTraceInterval * 1000.0 << " ms, " << queueTraceFormat << " in " << queueTrace << "):\n";
+        for (uint32_t i = 0; i < queueSampler.GetNInterfaces(); ++i)
+        {
+            if (queueSampler.GetMaxPackets(i) > 0)
+            {
+                std::cout << "  " << std::setw(24) << std::left << queueSampler.GetName(i) << std::right
+                          << "peak " << queueSampler.GetMaxPackets(i) << " packets / "
+                          << queueSampler.GetMaxBytes(i) << " bytes\n";
+            }
+        }
+    }
+
+    if (!dscpAccounts.empty())
+    {
+        std::cout << "\nPer-DSCP Traffic at Router Interfaces (packets / bytes / drops):\n";
+        Ipv4Header names;
+        for (uint32_t a = 0; a < dscpAccounts.size(); ++a)
+        {
+            const DscpAccount& account = dscpAccounts[a];
+            if (account.classes.empty())
+            {
+                continue;
+            }
+            std::cout << "  " << account.name << ":\n";
+            for (std::map<Ipv4Header::DscpType, DscpCounters>::const_iterator it = account.classes.begin();
+                 it != account.classes.end(); ++it)
+            {
+                std::cout << "    " << std::setw(8) << std::left << names.DscpTypeToString(it->first) << std::right
+                          << it->second.packets << " / " << it->second.bytes << " / "
+                          << it->second.drops << " (" << it->second.dropBytes << " bytes)\n";
+            }
+        }
+    }
+
+    if (enableRohc)
+    {
+        RohcPointToPointNetDevice::Stats total = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+        uint32_t maxContexts = 0, maxStateBytes = 0;
+        for (uint32_t i = 0; i < nMicrogrids; ++i)
+        {
+            uint32_t contexts = 0, stateBytes = 0;
+            for (uint32_t e = 0; e < 2; ++e)
+            {
+                Ptr<RohcPointToPointNetDevice> device =
+                    DynamicCast<RohcPointToPointNetDevice>(microgridDevices[i].Get(e));
+                const RohcPointToPointNetDevice::Stats& st = device->GetStats();
+                total.ir += st.ir;
+                total.uo0 += st.uo0;
+                total.uor2 += st.uor2;
+                total.uncompressed += st.uncompressed;
+                total.headerBytesIn += st.headerBytesIn;
+                total.headerBytesOut += st.headerBytesOut;
+                total.frameBytes += st.frameBytes;
+                total.failures += st.failures;
+                total.nacks += st.nacks;
+                total.resyncs += st.resyncs;
+                contexts += device->GetContextCount();
+                stateBytes += device->GetStateBytes();
+            }
+            maxContexts = std::max(maxContexts, contexts);
+            maxStateBytes = std::max(maxStateBytes, stateBytes);
+        }
+
+        // The same traffic without compression would have needed the saved
+        // header bytes on top of what was sent
+        uint64_t saved = total.headerBytesIn - total.headerBytesOut;
+        uint64_t uncompressedBytes = total.frameBytes + saved;
+        std::cout << "\nHeader Compression on Micro-grid Links (" << nMicrogrids << " links):\n";
+        std::cout << "  IR / UO-0 / UOR-2:        " << total.ir << " / " << total.uo0 << " / " << total.uor2
+                  << " (" << total.uncompressed << " sent uncompressed)\n";
+        std::cout << "  UDP/IP Header Bytes:      " << total.headerBytesIn << " -> " << total.headerBytesOut << "\n";
+        std::cout << "  Link Bytes:               " << total.frameBytes << " (" << uncompressedBytes
+                  << " uncompressed, goodput gain "
+                  << (total.frameBytes > 0 ? 100.0 * saved / total.frameBytes : 0.0) << " %)\n";
+        std::cout << "  Context Failures / NACKs: " << total.failures << " / " << total.nacks << " ("
+                  << total.resyncs << " resyncs)\n";
+        std::cout << "  State per Link:           up to " << maxContexts << " contexts, "
+                  << maxStateBytes << " bytes\n";
+    }
+
+    if (!traders.empty())
+    {
+        // A round is cleared once the slowest trader has every order; a
+        // round any trader had to close with orders missing counts apart
+        std::set<uint32_t> shortRounds;
+        for (uint32_t t = 0; t < traders.size(); ++t)
+        {
+            shortRounds.insert(traders[t]->GetShortRounds().begin(), traders[t]->GetShortRounds().end());
+        }
+        SampleStats clearTimes;
+        uint32_t opened = 0;
+        for (std::map<uint32_t, Time>::const_iterator it = traders[0]->GetClearTimes().begin();
+             it != traders[0]->GetClearTimes().end(); ++it)
+        {
+            Time roundStart = firstMarketRound + Seconds(marketInterval * it->first);
+            Time cleared = it->second;
+            bool complete = shortRounds.find(it->first) == shortRounds.end();
+            for (uint32_t t = 1; t < traders.size() && complete; ++t)
+            {
+                std::map<uint32_t, Time>::const_iterator other = traders[t]->GetClearTimes().find(it->first);
+                complete = (other != traders[t]->GetClearTimes().end());
+                if (complete)
+                {
+                    cleared = std::max(cleared, other->second);
+                }
+            }
+            if (complete)
+            {
+                clearTimes.Add((cleared - roundStart).GetSeconds() * 1000.0);
+            }
+        }
+        if (simulationTime > firstMarketRound.GetSeconds())
+        {
+            opened = std::ceil((simulationTime - firstMarketRound.GetSeconds()) / marketInterval);
+        }
+        double latencySum = 0.0;
+        uint32_t latencyCount = 0;
+        double worstP99 = 0.0;
+        for (uint32_t t = 0; t < traders.size(); ++t)
+        {
+            const SampleStats& latency = traders[t]->GetOrderLatency();
+            latencySum += latency.GetMean() * latency.GetCount();
+            latencyCount += latency.GetCount();
+            worstP99 = std::max(worstP99, latency.GetPercentile(99.0));
+        }
+
+        std::cout << "\nPeer-to-Peer Energy Market (" << traders.size() << " micro-grids, every "
+                  << marketInterval << " s):\n";
+        std::cout << "  Rounds Cleared:           " << clearTimes.GetCount() << " / " << opened << " ("
+                  << shortRounds.size() << " more cleared with orders missing)\n";
+        std::cout << "  Round Clearing Time:      ";
+        clearTimes.Print(std::cout, " ms");
+        std::cout << "\n  Energy Traded:            " << (traders[0]->GetClearedVolume() / 1000.0) << " kWh\n";
+
+        // Every trader clears to the same price (orders carry thousandths of a
+        // currency unit per kWh)
+        SampleStats prices;
+        const std::map<uint32_t, double>& roundPrices = traders[0]->GetClearingPrices();
+        for (std::map<uint32_t, double>::const_iterator it = roundPrices.begin(); it != roundPrices.end(); ++it)
+        {
+            prices.Add(it->second / 1000.0);
+        }
+        std::cout << "  Clearing Price:           ";
+        prices.Print(std::cout, " per kWh");
+        std::cout << " (" << prices.GetCount() << " rounds with trades)\n";
+        std::cout << "  Router 0 Trade Traffic:   " << tradeTraffic.packets << " orders forwarded, "
+                  << tradeTraffic.bytes << " bytes (" << (traders.size() * (traders.size() - 1))
+                  << " orders per round)\n";
+        std::cout << "  Order Delay:              mean "
+                  << (latencyCount > 0 ? latencySum / latencyCount : 0.0) << " ms, worst trader p99 "
+                  << worstP99 << " ms\n";
+    }
+
+    for (uint32_t i = 0; i < outages.size(); ++i)
+    {
+        const SiteRef& site = outages[i].site;
+        // Sites sharing the WAN router: micro-grids on 0, schools on 1, clinics on 2
+        const std::vector<Ptr<TelemetryClient> >& peers = (site.siteClass == "school") ? schoolClients
+                                                         : (site.siteClass == "clinic") ? clinicClients
+                                                         : microgridClients;
+        Ptr<TelemetryClient> client = peers[site.index];
+
+        if (i == 0)
+        {
+            std::cout << "\nSite Uplink Outages (" << (storeForward ? "store-and-forward" : "no buffering")
+                      << "):\n";
+        }
+        std::cout << "  " << site.siteClass << ":" << (site.index + 1) << " down "
+                  << outages[i].start << "-" << outages[i].end << " s, "
+                  << client->GetSent() << " sent / " << client->GetReceived() << " echoed\n";
+        if (!storeForward)
+        {
+            continue;
+        }
+
+        const std::vector<std::pair<Time, Time> >& drains = client->GetDrainWindows();
+        std::cout << "    Buffered / Max Backlog: " << client->GetBuffered() << " / "
+                  << client->GetMaxBacklog() << " readings (" << client->GetBufferDrops()
+                  << " dropped on overflow)\n";
+        std::cout << "    Reading Age on Replay:  ";
+        client->GetBufferDelay().Print(std::cout, " ms");
+        std::cout << "\n";
+        for (uint32_t w = 0; w < drains.size(); ++w)
+        {
+            std::cout << "    Drain " << (w + 1) << ":                " << drains[w].first.GetSeconds()
+                      << " s -> " << drains[w].second.GetSeconds() << " s ("
+                      << (drains[w].second - drains[w].first).GetSeconds() << " s)\n";
+        }
+
+        // Latency seen by the other sites on the same router while the
+        // backlog was replayed, against the rest of the run
+        SampleStats during, baseline;
+        for (uint32_t j = 0; j < peers.size(); ++j)
+        {
+            if (j != site.index)
+            {
+                SplitRttByWindows(peers[j], drains, during, baseline);
+            }
+        }
+        std::cout << "    Neighbour RTT (drain):  ";
+        during.Print(std::cout, " ms");
+        std::cout << "\n    Neighbour RTT (other):  ";
+        baseline.Print(std::cout, " ms");
+        std::cout << "\n";
+    }
+
+    if (satSchools > 0)
+    {
+        std::cout << "\nSatellite Schools (" << satType << ", " << satSchools << " of " << nSchools << ", "
+                  << satProfile.uplink << " up / " << satProfile.downlink << " down, one-way delay "
+                  << satProfile.baseDelay << "-" << (satProfile.baseDelay + satProfile.delaySpread) << " ms):\n";
+
+        // Telemetry latency and loss against the terrestrial schools, kept
+        // apart by whether the school runs its own bulk upload so that
+        // self-inflicted queueing is not charged to the satellite
+        SampleStats rtt[2][2];
+        uint32_t sent[2][2] = { { 0, 0 }, { 0, 0 } }, echoed[2][2] = { { 0, 0 }, { 0, 0 } };
+        for (uint32_t i = 0; i < schoolClients.size(); ++i)
+        {
+            uint32_t group = i < firstSatSchool ? 0 : 1;
+            uint32_t load = schoolUploads[i] ? 1 : 0;
+            const std::vector<TelemetryClient::RttSample>& samples = schoolClients[i]->GetRttSamples();
+            for (uint32_t k = 0; k < samples.size(); ++k)
+            {
+                rtt[group][load].Add(samples[k].rtt);
+            }
+            sent[group][load] += schoolClients[i]->GetSent();
+            echoed[group][load] += schoolClients[i]->GetReceived();
+        }
+        const char* groupNames[] = { "Terrestrial", "Satellite" };
+        const char* loadNames[] = { "idle", "uploading" };
+        for (uint32_t l = 0; l < 2; ++l)
+        {
+            for (uint32_t g = 0; g < 2; ++g)
+            {
+                if (sent[g][l] == 0)
+                {
+                    continue;
+                }
+                std::cout << "  " << std::setw(12) << std::left << groupNames[g] << std::setw(10) << loadNames[l]
+                          << std::right << "RTT ";
+                rtt[g][l].Print(std::cout, " ms");
+                std::cout << ", " << echoed[g][l] << "/" << sent[g][l] << " echoed\n";
+            }
+            if (rtt[0][l].GetCount() > 0 && rtt[1][l].GetCount() > 0)
+            {
+                std::string label = std::string("RTT Penalty (") + loadNames[l] + "):";
+                std::cout << "  " << std::setw(26) << std::left << label << std::right << "+"
+                          << (rtt[1][l].GetPercentile(50.0) - rtt[0][l].GetPercentile(50.0)) << " ms p50, +"
+                          << (rtt[1][l].GetPercentile(95.0) - rtt[0][l].GetPercentile(95.0)) << " ms p95\n";
+            }
+        }
+
+        // TCP bulk uploads: goodput of completed transfers, or of what
+        // arrived by the end of the run for unfinished ones
+        double goodput[2] = { 0.0, 0.0 };
+        uint32_t uploads[2] = { 0, 0 }, unfinished[2] = { 0, 0 };
+        for (uint32_t i = 0; i < bulkSenders.size(); ++i)
+        {
+            uint32_t group = bulkSenderSchools[i] < firstSatSchool ? 0 : 1;
+            std::map<Ipv4Address, Time>::const_iterator done = bulkTracker.completed.find(bulkSenders[i]);
+            if (done != bulkTracker.completed.end())
+            {
+                goodput[group] += bulkBytes * 8.0 / (done->second.GetSeconds() - bulkStart) / 1e6;
+            }
+            else
+            {
+                std::map<Ipv4Address, uint64_t>::const_iterator got = bulkTracker.received.find(bulkSenders[i]);
+                uint64_t bytes = got != bulkTracker.received.end() ? got->second : 0;
+                goodput[group] += bytes * 8.0 / (simulationTime - bulkStart) / 1e6;
+                ++unfinished[group];
+            }
+            ++uploads[group];
+        }
+        for (uint32_t g = 0; g < 2; ++g)
+        {
+            if (uploads[g] > 0)
+            {
+                std::cout << "  " << std::setw(12) << std::left << groupNames[g] << std::right << "TCP bulk "
+                          << goodput[g] / uploads[g] << " Mbps mean over " << uploads[g] << " uploads ("
+                          << unfinished[g] << " unfinished)\n";
+            }
+        }
+        if (uploads[0] > 0 && uploads[1] > 0 && goodput[0] > 0.0)
+        {
+            std::cout << "  Bulk Throughput Penalty:  "
+                      << 100.0 * (1.0 - (goodput[1] / uploads[1]) / (goodput[0] / uploads[0])) << " %\n";
+        }
+    }
+
+    if (linkErrors != "off")
+    {
+        std::cout << "\nLink Errors (" << linkErrors;
+        if (linkErrors == "rate")
+        {
+            std::cout << ", " << errorRate << " per packet";
+        }
+        else
+        {
+            std::cout << ", p " << gePGoodBad << " r " << gePBadGood << ", loss " << geLossGood
+                      << " good / " << geLossBad << " bad";
+        }
+        std::cout << "):\n";
+
+        // Link errors: frames the receive error models threw away.
+        // Congestion: drops in the queue discs and device queues.
+        uint64_t congestion[3] = { 0, 0, 0 };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t d = 0; d < linkClasses[c].GetN(); ++d)
+            {
+                Ptr<PointToPointNetDevice> device = DynamicCast<PointToPointNetDevice>(linkClasses[c].Get(d));
+                Ptr<QueueDisc> root = RootQueueDisc(device);
+                congestion[c] += (root ? root->GetStats().nTotalDroppedPackets : 0)
+                                 + device->GetQueue()->GetTotalDroppedPackets();
+            }
+        }
+        for (uint32_t c = 0; c < 2; ++c)
+        {
+            std::cout << "  " << std::setw(14) << std::left << errorClassNames[c] << std::right
+                      << "link errors " << errorLoss[c].packets << " packets (" << errorLoss[c].bytes
+                      << " bytes), congestion " << congestion[c + 1] << " packets\n";
+        }
+        std::cout << "  " << std::setw(14) << std::left << linkClassNames[0] << std::right
+                  << "congestion " << congestion[0] << " packets\n";
+    }
+
+    if (weatherMode != "off")
+    {
+        std::cout << "\nLink Weather (" << weatherMode << ", " << capacityChanges.size() << " capacity changes on "
+                  << capacityTimelines.size() << " links):\n";
+        std::cout << "   time (s)  degraded  capacity  throughput (Mbps)  RTT degraded p50/p95 (ms)  RTT clear p50 (ms)\n";
+
+        const std::string classes[] = { "school", "clinic", "microgrid" };
+        const std::vector<Ptr<TelemetryClient> >* clients[] = { &schoolClients, &clinicClients, &microgridClients };
+        std::vector<std::pair<double, double> > clear;
+        for (uint32_t b = 0; b < weatherThroughput.bytes.size(); ++b)
+        {
+            double from = b * weatherBin;
+            double to = from + weatherBin;
+            double mid = from + weatherBin / 2.0;
+
+            // Links below nominal at the middle of the bin, and their mean capacity
+            uint32_t degraded = 0;
+            double capacitySum = 0.0;
+            for (std::map<std::string, std::vector<std::pair<double, double> > >::const_iterator it =
+                     capacityTimelines.begin(); it != capacityTimelines.end(); ++it)
+            {
+                double factor = CapacityFactorAt(it->second, mid);
+                if (factor < 1.0)
+                {
+                    ++degraded;
+                    capacitySum += factor;
+                }
+            }
+
+            // Readings sent in this bin, split by whether their site's link was degraded
+            SampleStats rttDegraded, rttClear;
+            for (uint32_t c = 0; c < 3; ++c)
+            {
+                for (uint32_t j = 0; j < clients[c]->size(); ++j)
+                {
+                    std::ostringstream key;
+                    key << classes[c] << ":" << (j + 1);
+                    std::map<std::string, std::vector<std::pair<double, double> > >::const_iterator timeline =
+                        capacityTimelines.find(key.str());
+                    const std::vector<std::pair<double, double> >& changes =
+                        timeline != capacityTimelines.end() ? timeline->second : clear;
+                    const std::vector<TelemetryClient::RttSample>& samples = (*clients[c])[j]->GetRttSamples();
+                    for (uint32_t k = 0; k < samples.size(); ++k)
+                    {
+                        if (samples[k].sent >= from && samples[k].sent < to)
+                        {
+                            (CapacityFactorAt(changes, samples[k].sent) < 1.0 ? rttDegraded : rttClear).Add(samples[k].rtt);
+                        }
+                    }
+                }
+            }
+
+            std::cout << "  " << std::setw(8) << from << "  " << std::setw(8) << degraded << "  "
+                      << std::setw(7) << (degraded > 0 ? 100.0 * capacitySum / degraded : 100.0) << " %  "
+                      << std::setw(17) << weatherThroughput.bytes[b] * 8.0 / weatherBin / 1e6 << "  "
+                      << std::setw(12) << rttDegraded.GetPercentile(50.0) << " / " << std::setw(10)
+                      << rttDegraded.GetPercentile(95.0) << "  " << std::setw(18) << rttClear.GetPercentile(50.0) << "\n";
+        }
+    }
+
+    if (powerMode != "off")
+    {
+        std::cout << "\nSite Power Outages (" << powerMode;
+        if (powerMode == "solar")
+        {
+            std::cout << ", " << dayLength << " s per day from " << dayStartHour << ":00, battery "
+                      << batteryHours << " h";
+        }
+        std::cout << "):\n";
+
+        // Data lost per site class: readings never taken while dark, and
+        // readings sent that never came back
+        const std::string classes[] = { "school", "clinic", "microgrid" };
+        const std::vector<Ptr<TelemetryClient> >* clients[] = { &schoolClients, &clinicClients, &microgridClients };
+        const char* classNames[] = { "Schools:                ", "Clinics:                ",
+                                     "Micro-grids:            " };
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            uint32_t count = 0;
+            double downtime = 0.0;
+            for (uint32_t i = 0; i < powerOutages.size(); ++i)
+            {
+                if (powerOutages[i].site.siteClass == classes[c])
+                {
+                    ++count;
+                    downtime += std::min(powerOutages[i].end, simulationTime) - powerOutages[i].start;
+                }
+            }
+            uint32_t missed = 0, sent = 0, echoed = 0;
+            for (uint32_t j = 0; j < clients[c]->size(); ++j)
+            {
+                missed += (*clients[c])[j]->GetMissed();
+                sent += (*clients[c])[j]->GetSent();
+                echoed += (*clients[c])[j]->GetReceived();
+            }
+            std::cout << "  " << classNames[c] << count << " outages, " << downtime << " s dark, "
+                      << missed << " readings missed, " << (sent - echoed) << " of " << sent << " lost in transit\n";
+        }
+
+        // Reconnections within one modelled hour of each other count as one
+        // storm; the RTT of readings sent in the hour after each reconnection
+        // is compared with the rest of the run
+        std::vector<std::pair<Time, Time> > reconnectWindows;
+        std::vector<double> reconnects;
+        SampleStats reconnectDelay;
+        const double stormWindow = dayLength / 24.0;
+        for (uint32_t i = 0; i < powerOutages.size(); ++i)
+        {
+            double up = powerOutages[i].end;
+            if (up >= simulationTime)
+            {
+                continue;
+            }
+            reconnects.push_back(up);
+            reconnectWindows.push_back(std::make_pair(Seconds(up), Seconds(up + stormWindow)));
+
+            // Time from power-up to the first reading the central station echoed
+            const SiteRef& site = powerOutages[i].site;
+            Ptr<TelemetryClient> client = (site.siteClass == "school") ? schoolClients[site.index]
+                                          : (site.siteClass == "clinic") ? clinicClients[site.index]
+                                          : microgridClients[site.index];
+            const std::vector<TelemetryClient::RttSample>& samples = client->GetRttSamples();
+            for (uint32_t k = 0; k < samples.size(); ++k)
+            {
+                if (samples[k].sent >= up)
+                {
+                    reconnectDelay.Add((samples[k].sent - up) * 1000.0 + samples[k].rtt);
+                    break;
+                }
+            }
+        }
+        std::sort(reconnects.begin(), reconnects.end());
+        uint32_t largestStorm = 0;
+        double stormAt = 0.0;
+        for (uint32_t i = 0, j = 0; i < reconnects.size(); ++i)
+        {
+            while (reconnects[i] - reconnects[j] > stormWindow)
+            {
+                ++j;
+            }
+            if (i - j + 1 > largestStorm)
+            {
+                largestStorm = i - j + 1;
+                stormAt = reconnects[j];
+            }
+        }
+        std::cout << "  Reconnections:            " << reconnects.size();
+        if (largestStorm > 0)
+        {
+            std::cout << ", largest storm " << largestStorm << " sites within " << stormWindow
+                      << " s from " << stormAt << " s";
+        }
+        std::cout << "\n  Time to First Echo:       ";
+        reconnectDelay.Print(std::cout, " ms");
+        SampleStats afterReconnect, otherwise;
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t j = 0; j < clients[c]->size(); ++j)
+            {
+                SplitRttByWindows((*clients[c])[j], reconnectWindows, afterReconnect, otherwise);
+            }
+        }
+        std::cout << "\n  RTT After Reconnection:   ";
+        afterReconnect.Print(std::cout, " ms");
+        std::cout << "\n  RTT Otherwise:            ";
+        otherwise.Print(std::cout, " ms");
+        std::cout << "\n";
+    }
+
+    if (scadaMaster)
+    {
+        std::cout << "\nSCADA Polling (" << nMicrogrids << " micro-grids, " << scadaRegisters
+                  << " registers, every " << scadaInterval << " s):\n";
+        std::cout << "  Outstanding / Timeout:    " << scadaOutstanding << " / "
+                  << scadaTimeout << " s\n";
+        std::cout << "  Requests / Answered:      " << scadaMaster->GetRequests() << " / "
+                  << scadaMaster->GetResponses() << " (" << scadaMaster->GetTimeouts() << " timed out, "
+                  << scadaMaster->GetExceptions() << " exceptions)\n";
+        std::cout << "  Scan-Cycle Time:          ";
+        scadaMaster->GetCycleTimes().Print(std::cout, " ms");
+        std::cout << "\n";
+
+        // Queueing on a micro-grid link shows up as spread above the best RTT
+        const uint32_t maxRows = 12;
+        for (uint32_t i = 0; i < nMicrogrids && i < maxRows; ++i)
+        {
+            const SampleStats& rtt = scadaMaster->GetSiteRtts(i);
+            std::ostringstream name;
+            name << "Microgrid-" << (i + 1);
+            std::cout << "    " << std::left << std::setw(14) << name.str() << std::right;
+            rtt.Print(std::cout, " ms");
+            std::cout << " (p95 over best " << (rtt.GetPercentile(95.0) - rtt.GetPercentile(0.0))
+                      << " ms, " << scadaMaster->GetSiteTimeouts(i) << " timeouts)\n";
+        }
+        if (nMicrogrids > maxRows)
+        {
+            std::cout << "    ... " << (nMicrogrids - maxRows) << " more micro-grids\n";
+        }
+    }
+
+    if (poller)
+    {
+        std::cout << "\nMonitoring Center Poller:\n";
+        std::cout << "  Concurrency / Timeout:    " << pollConcurrency << " / "
+                  << pollTimeout << " s\n";
+        std::cout << "  Requests / Answered:      " << poller->GetRequests() << " / "
+                  << poller->GetResponses() << " (" << poller->GetTimeouts() << " timed out)\n";
+        std::cout << "  Poll-Cycle Time:          ";
+        poller->GetCycleTimes().Print(std::cout, " ms");
+        std::cout << "\n  Site RTT (all sites):     ";
+        poller->GetRtts().Print(std::cout, " ms");
+        std::cout << "\n";
+
+        // Per-site RTT distribution; large networks list only the first sites
+        const uint32_t maxRows = 12;
+        uint32_t nSites = nSchools + nClinics + nMicrogrids;
+        for (uint32_t i = 0; i < nSites && i < maxRows; ++i)
+        {
+            std::ostringstream name;
+            if (i < nSchools)
+                name << "School-" << (i + 1);
+            else if (i < nSchools + nClinics)
+                name << "Clinic-" << (i - nSchools + 1);
+            else
+                name << "Microgrid-" << (i - nSchools - nClinics + 1);
+            std::cout << "    " << std::left << std::setw(14) << name.str() << std::right;
+            poller->GetSiteRtts(i).Print(std::cout, " ms");
+            std::cout << "\n";
+        }
+        if (nSites > maxRows)
+        {
+            std::cout << "    ... " << (nSites - maxRows) << " more sites\n";
+        }
+    }
+
+    if (firmwareSender)
+    {
+        std::cout << "\nFirmware Distribution (" << firmwareMode << "):\n";
+        std::cout << "  Image:                    " << firmwareSize << " bytes in "
+                  << firmwareSender->GetTotalBlocks() << " blocks\n";
+        std::cout << "  Blocks Sent / Repairs:    " << firmwareSender->GetBlocksSent() << " / "
+                  << firmwareSender->GetRepairsSent() << " (" << firmwareSender->GetNacksReceived()
+                  << " NACKs)\n";
+        std::cout << "  Backbone Bytes:           " << firmwareBackbone.bytes << " ("
+                  << (nMicrogrids > 0 ? firmwareBackbone.bytes / nMicrogrids : 0)
+                  << " per controller)\n";
+        if (firmwareMode == "multicast")
+        {
+            std::cout << "  Unicast Equivalent:       ~" << firmwareBackbone.bytes * nMicrogrids
+                      << " backbone bytes (one copy per controller)\n";
+        }
+        std::cout << "  Micro-grid Access Bytes:  " << firmwareAccess.bytes << "\n";
+
+        uint32_t completed = 0;
+        double lastCompletion = 0.0;
+        for (uint32_t i = 0; i < firmwareReceivers.size(); ++i)
+        {
+            if (firmwareReceivers[i]->IsComplete())
+            {
+                ++completed;
+                lastCompletion = std::max(lastCompletion,
+                                          firmwareReceivers[i]->GetCompletionTime().GetSeconds() - firmwareStart);
+            }
+        }
+        std::cout << "  Controllers Updated:      " << completed << " / " << nMicrogrids << "\n";
+        if (completed == nMicrogrids && nMicrogrids > 0)
+        {
+            std::cout << "  Time to Complete (all):   " << lastCompletion << " s\n";
+        }
+        else
+        {
+            std::cout << "  Time to Complete (all):   not reached within the simulation\n";
+        }
+    }
+
+    if (broker)
+    {
+        double active = broker->GetActiveTime().GetSeconds();
+        std::cout << "\nPub/Sub Broker (central station):\n";
+        std::cout << "  Publications Received:    " << broker->GetPublished() << "\n";
+        std::cout << "  Deliveries Fanned Out:    " << broker->GetDelivered();
+        if (broker->GetPublished() > 0)
+        {
+            std::cout << " (x" << (double(broker->GetDelivered()) / broker->GetPublished()) << ")";
+        }
+        std::cout << "\n";
+        if (active > 0.0)
+        {
+            std::cout << "  Fan-out Throughput:       " << (broker->GetDelivered() / active)
+                      << " msg/s, " << (broker->GetDeliveredBytes() * 8.0 / active / 1000.0)
+                      << " kbps\n";
+        }
+        for (uint32_t i = 0; i < subscribers.size(); ++i)
+        {
+            std::cout << "  Subscriber " << subscriberNames[i] << "\n";
+            std::cout << "    Messages Received:      " << subscribers[i]->GetReceived() << "\n";
+            std::cout << "    End-to-End Latency:     ";
+            subscribers[i]->GetEndToEndLatency().Print(std::cout, " ms");
+            std::cout << "\n    Added by Broker Hop:    ";
+            subscribers[i]->GetAddedLatency().Print(std::cout, " ms");
+            std::cout << "\n";
+        }
+    }
+
     std::cout << "\n================================================================\n";
     std::cout << "System Components Summary:\n";
     std::cout << "  Solar Schools Connected:     " << nSchools << "\n";
@@ -485,6 +9967,8 @@ int main(int argc, char* argv[])
     delete[] schoolDevices;
     delete[] clinicDevices;
     delete[] microgridDevices;
+    delete[] schoolStations;
+    delete[] schoolLanDevices;
     
     return 0;
 }